@@ -2,35 +2,53 @@
 
 int main(int argc, char **argv)
 {
-    int smooth = vs::findArgInt(argc, argv, "smooth", 15);
-    int stride = vs::findArgInt(argc, argv, "stride", 4);
-    int div = vs::findArgInt(argc, argv, "div", 4);
+    // klt follows a few hundred corners instead of computing the flow of every pixel
+    bool klt = vs::findArg(argc, argv, "klt");
+
+    // the pyramid tracks large motions at full resolution with a small window,
+    // a single scale (levels 1) needs a downscaled frame and a large window instead
+    int levels = vs::findArgInt(argc, argv, "levels", 3);
+    int iterations = vs::findArgInt(argc, argv, "iterations", 3);
+    bool pyramidal = levels > 1;
+
+    int smooth = vs::findArgInt(argc, argv, "smooth", pyramidal ? 7 : 15);
+    int stride = vs::findArgInt(argc, argv, "stride", pyramidal ? 16 : 4);
+    int div = vs::findArgInt(argc, argv, "div", pyramidal ? 1 : 4);
+
+    // the pyramidal flow is in pixels
+    float scale = pyramidal ? float(div) : float(smooth * div);
 
     int stream = vs::openStream("0");
-    vs::Mat prev, prev_c;
     vs::Mat im, im_c;
 
-    vs::readStream(stream, prev);
-    vs::resize(prev, prev_c, prev.w / div, prev.h / div);
-
     vs::readStream(stream, im);
     vs::resize(im, im_c, im.w / div, im.h / div);
 
+    // the flow keeps the previous frame, each frame is converted and filtered once
     vs::LucasKanade lk;
     vs::Mat v;
 
+    vs::KLTParams klt_params;
+    klt_params.levels = levels;
+    vs::KLTTracker tracker(klt_params);
+
     while (im.data)
     {
-        lk.opticalflow(im_c, prev_c, smooth, stride, v);
-        vs::drawFlow(im, v, smooth * div);
-        int key = vs::showMat(im, "flow", 10);
+        // the first frame only starts the stream, the tracker only detects on it
+        bool flow = false;
+        if (klt)
+            vs::drawTracks(im_c, tracker.track(im_c), scale);
+        else if (pyramidal)
+            flow = lk.pushFramePyramidal(im_c, levels, smooth, iterations, stride, v);
+        else
+            flow = lk.pushFrame(im_c, smooth, stride, v);
+        if (flow)
+            vs::drawFlow(im, v, scale);
+        int key = vs::showMat(klt ? im_c : im, "flow", 10);
 
         if (key == 27)
             break;
 
-        std::swap(prev, im);
-        std::swap(prev_c, im_c);
-
         vs::readStream(stream, im);
         vs::resize(im, im_c, im.w / div, im.h / div);
     }
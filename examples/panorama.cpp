@@ -1,140 +1,256 @@
 #include "../source/vs.hpp"
 
-static float getMin(vs::Mat const &im, int px, int py, int c, int w)
+// Marks the pixels of an image that are usable for stitching.
+// a channel sample is invalid if its 3x3 neighbourhood touches a black pixel,
+// this is because of the cylinder black borders.
+// returns: mask with the same size as im, 1 valid, 0 invalid.
+static vs::Mat validMask(vs::Mat const &im)
 {
-    float v = std::numeric_limits<float>::max();
+    vs::Mat mask(im.w, im.h, im.c);
 
-    for (int dx = -w / 2; dx < (w + 1) / 2; ++dx)
-        for (int dy = -w / 2; dy < (w + 1) / 2; ++dy)
-        {
-            float current = im.getClamp(px + dx, py + dy, c);
-            if (current < v)
-                v = current;
-        }
+    vs::parallelFor(0, im.h, [&](int y_begin, int y_end) {
+        for (int k = 0; k < im.c; ++k)
+            for (int y = y_begin; y < y_end; ++y)
+                for (int x = 0; x < im.w; ++x)
+                {
+                    float v = std::numeric_limits<float>::max();
+                    for (int dx = -1; dx <= 1; ++dx)
+                        for (int dy = -1; dy <= 1; ++dy)
+                            v = vs::minimum(v, im.getClamp(x + dx, y + dy, k));
+
+                    mask.row(y, k)[x] = vs::equivalent(v, 0.0f) ? 0.0f : 1.0f;
+                }
+    });
 
-    return v;
+    return mask;
 }
 
-// Stitches two images together using a projective transformation.
-// image a, b: images to stitch.
-// matrix H: homography from image a coordinates to image b coordinates.
-// returns: combined image stitched together.
-static vs::Mat combine_images(vs::Mat const &a, vs::Mat const &b, vs::Matd const &H)
+// A registration between two of the input images.
+struct Link
 {
-    vs::Matd Hinv = H.invert();
-
-    // Project the corners of image b into image a coordinates.
-    vs::Point c1 = vs::projectPoint(Hinv, vs::Point(0, 0));
-    vs::Point c2 = vs::projectPoint(Hinv, vs::Point(b.w - 1, 0));
-    vs::Point c3 = vs::projectPoint(Hinv, vs::Point(0, b.h - 1));
-    vs::Point c4 = vs::projectPoint(Hinv, vs::Point(b.w - 1, b.h - 1));
-
-    // Find top left and bottom right corners of image b warped into image a.
-    vs::Point topleft, botright;
-    botright.x = vs::maximum(c1.x, vs::maximum(c2.x, vs::maximum(c3.x, c4.x)));
-    botright.y = vs::maximum(c1.y, vs::maximum(c2.y, vs::maximum(c3.y, c4.y)));
-    topleft.x = vs::minimum(c1.x, vs::minimum(c2.x, vs::minimum(c3.x, c4.x)));
-    topleft.y = vs::minimum(c1.y, vs::minimum(c2.y, vs::minimum(c3.y, c4.y)));
-
-    // Find how big our new image should be and the offsets from image a.
-    int dx = vs::minimum(0.0f, topleft.x);
-    int dy = vs::minimum(0.0f, topleft.y);
-    int w = vs::maximum(a.w, int(botright.x)) - dx;
-    int h = vs::maximum(a.h, int(botright.y)) - dy;
-
-    // Can disable this if you are making very big panoramas.
-    // Usually this means there was an error in calculating H.
-    if(w > 7000 || h > 7000){
-        fprintf(stderr, "output too big, stopping\n");
-        return a.clone();
-    }
-
-    vs::Mat c(w, h, a.c);
-
-    // Paste image a into the new image offset by dx and dy.
-    c.copy(a, -dx, -dy);
-
-    // Paste in image b as well.
-    // You should loop over some points in the new image (which? all?)
-    // and see if their projection from a coordinates to b coordinates falls
-    // inside of the bounds of image b. If so, use bilinear interpolation to
-    // estimate the value of b at that projection, then fill in image c.
-    for (int k = 0; k < b.c; ++k)
-        for (int y = topleft.y; y < int(botright.y); ++y)
-            for (int x = topleft.x; x < int(botright.x); ++x)
-            {
-                vs::Point p = vs::projectPoint(H, vs::Point(x, y));
-                if (p.x >= 0.0f && p.x < b.w && p.y >= 0.0f && p.y < b.h)
-                {
+    size_t a = 0;
+    size_t b = 0;
+    vs::Matd H; // image a coordinates to image b coordinates
+    int inliers = 0;
+};
+
+// The features of one image, described with floats or with bits.
+struct Features
+{
+    bool binary = false;
+    vs::DescriptorSet floats;
+    vs::DescriptorIndex index; // approximate nearest neighbour index over floats
+    vs::BinaryDescriptorSet bits;
+
+    std::vector<vs::Point> const &points() const { return binary ? bits.points : floats.points; }
+};
+
+// Matches the features of two images.
+// checks: distances evaluated per float feature, 0 for exact matching.
+// no_match: pair every feature of a with every feature of b and let RANSAC sort them out.
+static vs::Matches pairFeatures(Features const &af, Features const &bf, int checks, bool no_match)
+{
+    std::vector<vs::Point> const &ap = af.points();
+    std::vector<vs::Point> const &bp = bf.points();
 
-                    // this is because of the cylinder black borders
-                    if (vs::equivalent(getMin(b, p.x, p.y, k, 3), 0.0f))
-                        continue;
+    if (ap.empty() || bp.empty())
+        return vs::Matches();
 
-                    float value = vs::interpolateBL(b, p.x, p.y, k);
-                    c.set(x - dx, y - dy, k, value);
-                }
-            }
+    if (!no_match)
+        return af.binary ? vs::matchDescriptors(af.bits, bf.bits) : vs::matchDescriptors(af.floats, bf.index, checks);
 
-    return c;
+    vs::Matches m;
+    for (size_t a = 0; a != ap.size(); ++a)
+        for (size_t b = 0; b != bp.size(); ++b)
+        {
+            vs::Match current;
+            current.ai = int(a);
+            current.bi = int(b);
+            current.p = ap[a];
+            current.q = bp[b];
+            current.distance = 0;
+
+            m.push_back(current);
+        }
+    return m;
 }
 
-// Create a panoramam between two images.
-// image a, b: images to stitch together.
+// Create a panorama from a set of images.
+// Features are detected once per image and the image pairs are matched in parallel.
+// The best links form a spanning tree rooted at the first image, the pairwise homographies
+// are chained along it and every image is warped once into a single canvas.
+// images: images to stitch, later images are drawn on top of earlier ones.
+// detector: corner detector, harris or fast.
 // float sigma: gaussian for harris corner detector. Typical: 2
-// float thresh: threshold for corner/no corner. Typical: 1-5
+// float thresh: threshold for corner/no corner. Typical: 1-5 (harris), 0.05-0.15 (fast)
 // int nms: window to perform nms on. Typical: 3
-// float inlier_thresh: threshold for RANSAC inliers. Typical: 2-5
-// int iters: number of RANSAC iterations. Typical: 1,000-50,000
-// int cutoff: RANSAC inlier cutoff. Typical: 10-100
-static vs::Mat panorama_image(vs::Mat &a, vs::Mat &b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, bool no_match)
+// budget: maximum number of corners per image and how to spread them. Typical: 500-2000
+// ransac: RANSAC settings. inlier threshold typical: 2-5, iterations typical: 1,000-50,000, confidence: 0.99
+//         inlier cutoff typical: -1 (the confidence exit is used) or 10-100, Td,d pre-test: 0 or 1
+//         prosac sampling needs the matches sorted by distance, no_match gives them all the same distance.
+// int min_inliers: links with this many inliers or fewer are discarded. Typical: 10-100
+// int checks: descriptor comparisons per feature when matching, 0 for exact matching. Typical: 64-512
+// bool binary: describe the corners with binary descriptors instead of float patches.
+// bool adjacent: only match consecutive images instead of all pairs.
+static vs::Mat panorama_image(std::vector<vs::Mat> const &images, vs::CornerDetector detector, float sigma, float thresh, int nms, vs::KeypointBudget const &budget, vs::RansacParams const &ransac, int min_inliers, int checks, bool no_match, bool binary, bool adjacent)
 {
-    srand(10);
-    // Calculate corners and descriptors
-    vs::Descriptors ad = vs::harrisCornerDetector(a, sigma, thresh, nms);
-    vs::Descriptors bd = vs::harrisCornerDetector(b, sigma, thresh, nms);
+    int const count = int(images.size());
+
+    // Calculate corners and descriptors, indexing them once for all the pairs
+    std::vector<Features> features(images.size());
+    vs::parallelFor(0, count, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i)
+        {
+            Features &f = features[size_t(i)];
+            f.binary = binary;
+
+            if (binary)
+            {
+                vs::detectCorners(images[size_t(i)], f.bits, detector, sigma, thresh, nms, budget);
+            }
+            else
+            {
+                vs::detectCorners(images[size_t(i)], f.floats, detector, sigma, thresh, nms, budget);
+                if (!no_match)
+                    f.index.build(f.floats);
+            }
+        }
+    });
 
     // Find matches
-    vs::Matches m;
-    if (no_match)
-    {
-        for (size_t a = 0; a != ad.size(); ++a)
-            for (size_t b = 0; b != bd.size(); ++b)
+    std::vector<Link> links;
+    for (size_t a = 0; a != images.size(); ++a)
+        for (size_t b = a + 1; b != images.size(); ++b)
+            if (!adjacent || b == a + 1)
             {
-                vs::Match current;
-                current.ai = int(a);
-                current.bi = int(b);
-                current.p = ad[size_t(current.ai)].p;
-                current.q = bd[size_t(current.bi)].p;
-                current.distance = 0;
-
-                m.push_back(current);
+                Link link;
+                link.a = a;
+                link.b = b;
+                links.push_back(link);
             }
-    }
-    else
+
+    std::vector<vs::Matches> matches(links.size());
+    vs::parallelFor(0, int(links.size()), [&](int begin, int end) {
+        for (int i = begin; i != end; ++i)
+        {
+            Link const &link = links[size_t(i)];
+            matches[size_t(i)] = pairFeatures(features[link.a], features[link.b], checks, no_match);
+        }
+    });
+
+    // Run RANSAC to find the homographies, every pair at the same time.
+    // RANSAC random streams come from its seed, so the result does not depend on the threads
+    std::vector<vs::RansacReport> reports(links.size());
+    vs::parallelFor(0, int(links.size()), [&](int begin, int end) {
+        for (int i = begin; i != end; ++i)
+        {
+            Link &link = links[size_t(i)];
+            if (matches[size_t(i)].size() <= 4)
+                continue;
+
+            link.H = vs::RANSAC(matches[size_t(i)], ransac, &reports[size_t(i)]);
+            if (link.H.size() != 0)
+                link.inliers = reports[size_t(i)].inliers;
+
+            // a few inliers are easy to find between unrelated images, don't trust those links
+            if (link.inliers <= min_inliers)
+                link.inliers = 0;
+        }
+    });
+
+    for (size_t i = 0; i != links.size(); ++i)
+        std::cout << "Link " << links[i].a << " - " << links[i].b << ": " << reports[i].inliers << " inliers of "
+                  << matches[i].size() << " matches, " << reports[i].iterations << " iterations, confidence "
+                  << reports[i].confidence << std::endl;
+
+    // Grow a tree from the first image, always taking the strongest link to an unplaced image.
+    // transforms[i] maps first image coordinates to image i coordinates
+    std::vector<vs::Mat3d> transforms(images.size());
+    std::vector<bool> placed(images.size(), false);
+    placed[0] = true;
+
+    while (true)
     {
-        m = vs::matchDescriptors(ad, bd);
+        Link const *best = nullptr;
+        for (Link const &link : links)
+            if (link.inliers > 0 && placed[link.a] != placed[link.b] && (!best || link.inliers > best->inliers))
+                best = &link;
+
+        if (!best)
+            break;
+
+        vs::Mat3d H(best->H);
+        if (placed[best->a])
+        {
+            transforms[best->b] = vs::Mat3d::mmult(H, transforms[best->a]);
+            placed[best->b] = true;
+        }
+        else
+        {
+            vs::Mat3d Hinv;
+            H.invert(Hinv);
+            transforms[best->a] = vs::Mat3d::mmult(Hinv, transforms[best->b]);
+            placed[best->a] = true;
+        }
     }
 
-    // Run RANSAC to find the homography
-    vs::Matd H = RANSAC(m, inlier_thresh, iters, cutoff);
+    // Project the corners of every image into the first image coordinates
+    // to find the canvas size and each image bounding box.
+    std::vector<std::array<int, 4>> boxes(images.size()); // x0, y0, x1, y1
+    int x0 = 0, y0 = 0;
+    int x1 = images[0].w, y1 = images[0].h;
 
-    if (H.size() == 0)
+    for (size_t i = 0; i != images.size(); ++i)
     {
-        std::cout << "Unable to find homography" << std::endl;
+        vs::Mat3d inverse;
+        if (!placed[i] || !transforms[i].invert(inverse))
+        {
+            std::cout << "Unable to find homography for image " << i << std::endl;
+            placed[i] = false;
+            continue;
+        }
+
+        vs::Mat const &im = images[i];
+        vs::Point c1 = inverse.project(vs::Point(0, 0));
+        vs::Point c2 = inverse.project(vs::Point(im.w - 1, 0));
+        vs::Point c3 = inverse.project(vs::Point(0, im.h - 1));
+        vs::Point c4 = inverse.project(vs::Point(im.w - 1, im.h - 1));
+
+        std::array<int, 4> &box = boxes[i];
+        box[0] = int(floorf(vs::minimum(c1.x, c2.x, c3.x, c4.x)));
+        box[1] = int(floorf(vs::minimum(c1.y, c2.y, c3.y, c4.y)));
+        box[2] = int(ceilf(vs::maximum(c1.x, c2.x, c3.x, c4.x))) + 1;
+        box[3] = int(ceilf(vs::maximum(c1.y, c2.y, c3.y, c4.y))) + 1;
+
+        // Can disable this if you are making very big panoramas.
+        // Usually this means there was an error in calculating H.
+        if (box[2] - box[0] > 7000 || box[3] - box[1] > 7000)
+        {
+            std::cout << "Image " << i << " warps too big, skipping it" << std::endl;
+            placed[i] = false;
+            continue;
+        }
+
+        x0 = vs::minimum(x0, box[0]);
+        y0 = vs::minimum(y0, box[1]);
+        x1 = vs::maximum(x1, box[2]);
+        y1 = vs::maximum(y1, box[3]);
     }
 
-    if (false)
+    // Warp every image once into the canvas, canvas pixel (x, y) is (x + x0, y + y0) in the first image
+    vs::Mat c(x1 - x0, y1 - y0, images[0].c);
+    for (size_t i = 0; i != images.size(); ++i)
     {
-        // Mark corners and matches between images
-        vs::markCorners(a, ad);
-        vs::markCorners(b, bd);
-        vs::Mat inlier_matches = vs::drawInliers(a, b, H, m, inlier_thresh);
-        vs::saveImage("inliers.png", inlier_matches);
+        if (!placed[i])
+            continue;
+
+        std::array<int, 4> const &box = boxes[i];
+        vs::Mat region = c.roiView(box[0] - x0, box[1] - y0, box[2] - box[0], box[3] - box[1]);
+        vs::Mat3d H = vs::Mat3d::mmult(transforms[i], vs::Mat3d::makeTranslation(box[0], box[1]));
+        vs::warpPerspective(images[i], region, H, vs::Bilinear, vs::BorderTransparent, validMask(images[i]));
     }
 
-    // Stitch the images together with the homography
-    return combine_images(a, b, H);
+    return c;
 }
 
 //
@@ -143,16 +259,31 @@ static vs::Mat panorama_image(vs::Mat &a, vs::Mat &b, float sigma, float thresh,
 // ./panorama img ./data/Rainier1.png img ./data/Rainier2.png
 // ./panorama thresh 10 img ./data/Rainier1.png img ./data/Rainier2.png img ./data/Rainier5.png img ./data/Rainier6.png img ./data/Rainier3.png img ./data/Rainier4.png
 // ./panorama cylindrical 800 thresh 5 inlier_thresh 5 img ./data/Rainier1.png img ./data/Rainier2.png img ./data/Rainier6.png img ./data/Rainier3.png img ./data/Rainier4.png img ./data/Rainier5.png
+// ./panorama fast img ./data/Rainier1.png img ./data/Rainier2.png img ./data/Rainier5.png
+// ./panorama binary thresh 10 img ./data/Rainier1.png img ./data/Rainier2.png img ./data/Rainier5.png
+// ./panorama adjacent img ./data/Rainier1.png img ./data/Rainier2.png img ./data/Rainier3.png
 int main(int argc, char **argv)
 {
     bool no_match = vs::findArg(argc, argv, "no_match");
+    bool adjacent = vs::findArg(argc, argv, "adjacent");
+    bool binary = vs::findArg(argc, argv, "binary");
     float cylindrical = vs::findArgFloat(argc, argv, "cylindrical", 0.0f);
     float sigma = vs::findArgFloat(argc, argv, "sigma", 2.0f);
-    float thresh = vs::findArgFloat(argc, argv, "thresh", 50.0f);
+    vs::CornerDetector detector = vs::findArg(argc, argv, "fast") ? vs::FastCorners : vs::HarrisCorners;
+    float thresh = vs::findArgFloat(argc, argv, "thresh", detector == vs::FastCorners ? 0.1f : 50.0f);
     int nms = vs::findArgInt(argc, argv, "nms", 3);
-    float inlier_thresh = vs::findArgFloat(argc, argv, "inlier_thresh", 2.0f);
-    int iters = vs::findArgInt(argc, argv, "iters", 50000);
-    int cutoff = vs::findArgInt(argc, argv, "cutoff", 30);
+    vs::KeypointBudget budget;
+    budget.count = vs::findArgInt(argc, argv, "budget", 0);
+    budget.mode = vs::findArg(argc, argv, "anms") ? vs::BudgetAdaptive : vs::BudgetGrid;
+    vs::RansacParams ransac;
+    ransac.thresh = vs::findArgFloat(argc, argv, "inlier_thresh", 2.0f);
+    ransac.iterations = vs::findArgInt(argc, argv, "iters", 50000);
+    ransac.confidence = vs::findArgFloat(argc, argv, "confidence", 0.99f);
+    ransac.sampling = vs::findArg(argc, argv, "prosac") ? vs::RansacProsac : vs::RansacUniform;
+    ransac.pretest = vs::findArgInt(argc, argv, "pretest", 0);
+    ransac.cutoff = vs::findArgInt(argc, argv, "cutoff", -1);
+    int min_inliers = vs::findArgInt(argc, argv, "min_inliers", 30);
+    int checks = vs::findArgInt(argc, argv, "checks", 128);
 
     std::vector<std::string> inputs;
     std::string name = vs::findArgStr(argc, argv, "img", "");
@@ -171,7 +302,7 @@ int main(int argc, char **argv)
         }
 
         vs::Mat a = vs::loadImage(inputs[0]);
-        vs::drawHarrisCorners(a, sigma, thresh, nms);
+        vs::drawCorners(a, detector, sigma, thresh, nms);
         vs::saveImage("generated.png", a);
         return 0;
     }
@@ -185,7 +316,7 @@ int main(int argc, char **argv)
 
         vs::Mat a = vs::loadImage(inputs[0]);
         vs::Mat b = vs::loadImage(inputs[1]);
-        vs::Mat out = vs::drawMatches(a, b, sigma, thresh, nms);
+        vs::Mat out = vs::drawMatches(a, b, sigma, thresh, nms, detector);
         vs::saveImage("generated.png", out);
         return 0;
     }
@@ -196,21 +327,18 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    vs::Mat current = vs::loadImage(inputs[0], 3);
-    if (cylindrical > 0.0)
-        current = vs::cylindricalProject(current, cylindrical);
-
-    for (size_t i = 1; i != inputs.size(); ++i)
+    std::vector<vs::Mat> images;
+    for (std::string const &input : inputs)
     {
-        std::cout << "Merging " << inputs[i] << std::endl;
-        vs::Mat next = vs::loadImage(inputs[i], 3);
+        std::cout << "Merging " << input << std::endl;
+        images.push_back(vs::loadImage(input, 3));
 
         if (cylindrical > 0.0)
-            next = vs::cylindricalProject(next, cylindrical);
-
-        current = panorama_image(current, next, sigma, thresh, nms, inlier_thresh, iters, cutoff, no_match);
-        vs::saveImage("generated.png", current);
+            images.back() = vs::cylindricalProject(images.back(), cylindrical);
     }
 
+    vs::Mat panorama = panorama_image(images, detector, sigma, thresh, nms, budget, ransac, min_inliers, checks, no_match, binary, adjacent);
+    vs::saveImage("generated.png", panorama);
+
     return 0;
 }
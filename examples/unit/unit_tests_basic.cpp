@@ -82,6 +82,38 @@ static void test_hsv_to_rgb()
     UTEST(vs::sameMat(im, c));
 }
 
+static void test_parallel_for()
+{
+    std::vector<int> hits(1000, 0);
+    vs::parallelFor(0, int(hits.size()), [&](int begin, int end) {
+        for (int i = begin; i != end; ++i)
+            hits[size_t(i)]++;
+    });
+    UTEST(std::count(hits.begin(), hits.end(), 1) == int(hits.size()));
+
+    // kernels must give the same bits regardless of the thread count
+    int concurrency = vs::getConcurrency();
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+
+    vs::setConcurrency(1);
+    vs::Mat serial_gray = vs::rgb2gray(im);
+    vs::Mat serial_smooth = vs::smoothImage(im, 2.0f);
+    vs::Mat serial_integral;
+    vs::makeIntegralImage(im, serial_integral);
+
+    vs::setConcurrency(4);
+    vs::Mat parallel_gray = vs::rgb2gray(im);
+    vs::Mat parallel_smooth = vs::smoothImage(im, 2.0f);
+    vs::Mat parallel_integral;
+    vs::makeIntegralImage(im, parallel_integral);
+
+    vs::setConcurrency(concurrency);
+
+    UTEST(memcmp(serial_gray.data, parallel_gray.data, size_t(serial_gray.size()) * sizeof(float)) == 0);
+    UTEST(memcmp(serial_smooth.data, parallel_smooth.data, size_t(serial_smooth.size()) * sizeof(float)) == 0);
+    UTEST(memcmp(serial_integral.data, parallel_integral.data, size_t(serial_integral.size()) * sizeof(float)) == 0);
+}
+
 int unit_tests_basic(int argc, char **argv)
 {
     test_get_pixel();
@@ -91,5 +123,6 @@ int unit_tests_basic(int argc, char **argv)
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_parallel_for();
     return 0;
 }
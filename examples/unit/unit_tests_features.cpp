@@ -1,5 +1,7 @@
 #include "../../source/vs.hpp"
 
+#include <set>
+
 // https://github.com/pjreddie/vision-hw2
 
 static void test_filter(){
@@ -184,6 +186,634 @@ static void test_ransac() {
     UTEST(vs::sameMat(inlier_matches, result));
 }
 
+static bool sameMatches(vs::Matches const &l, vs::Matches const &r)
+{
+    if (l.size() != r.size())
+        return false;
+
+    for (size_t i = 0; i != l.size(); ++i)
+        if (l[i].ai != r[i].ai || l[i].bi != r[i].bi || l[i].distance != r[i].distance)
+            return false;
+
+    return true;
+}
+
+static void test_descriptor_index() {
+    vs::Mat a = vs::loadImage("data/Rainier1.png", 3);
+    vs::Mat b = vs::loadImage("data/Rainier2.png", 3);
+
+    vs::Descriptors ad = vs::harrisCornerDetector(a, 2.0f, 1.0f, 3);
+    vs::Descriptors bd = vs::harrisCornerDetector(b, 2.0f, 1.0f, 3);
+
+    vs::DescriptorIndex index(bd);
+    UTEST(index.size() == int(bd.size()) && index.dims() == bd[0].n);
+
+    // exact search is the brute force matcher
+    vs::Matches exact = vs::matchDescriptors(ad, bd);
+    UTEST(sameMatches(vs::matchDescriptors(ad, index, 0), exact));
+
+    // approximate search finds the true neighbour most of the time, more checks find it more often
+    int found_few = 0, found_many = 0;
+    for (vs::Descriptor const &d : ad)
+    {
+        float distance;
+        int truth = index.nearest(d.data, 0, distance);
+        found_few += (index.nearest(d.data, 32, distance) == truth) ? 1 : 0;
+        found_many += (index.nearest(d.data, 256, distance) == truth) ? 1 : 0;
+    }
+    UTEST(found_few > int(ad.size()) * 7 / 10);
+    UTEST(found_many >= found_few && found_many > int(ad.size()) * 95 / 100);
+
+    // the approximate matches are nearly all the brute force ones
+    vs::Matches approximate = vs::matchDescriptors(ad, index);
+    std::set<std::pair<int, int>> exact_pairs;
+    for (vs::Match const &m : exact)
+        exact_pairs.insert(std::make_pair(m.ai, m.bi));
+    int agree = 0;
+    for (vs::Match const &m : approximate)
+        agree += exact_pairs.count(std::make_pair(m.ai, m.bi)) ? 1 : 0;
+    UTEST(agree > int(exact.size()) * 95 / 100);
+}
+
+static void test_descriptor_set() {
+    vs::Mat a = vs::loadImage("data/Rainier1.png", 3);
+    vs::Mat b = vs::loadImage("data/Rainier2.png", 3);
+
+    vs::Descriptors ad = vs::harrisCornerDetector(a, 2.0f, 50.0f, 3);
+    vs::Descriptors bd = vs::harrisCornerDetector(b, 2.0f, 50.0f, 3);
+
+    vs::DescriptorSet as, bs;
+    vs::harrisCornerDetector(a, as, 2.0f, 50.0f, 3);
+    vs::harrisCornerDetector(b, bs, 2.0f, 50.0f, 3);
+
+    // same descriptors either way, every row aligned
+    UTEST(as.size() == int(ad.size()) && as.dims() == ad[0].n);
+    bool same = true;
+    for (int i = 0; i != as.size(); ++i)
+    {
+        same = same && as.points[size_t(i)].x == ad[size_t(i)].p.x && as.points[size_t(i)].y == ad[size_t(i)].p.y;
+        same = same && memcmp(as.row(i), ad[size_t(i)].data, sizeof(float) * size_t(as.dims())) == 0;
+        same = same && (reinterpret_cast<uintptr_t>(as.row(i)) % vs::Mat::Alignment) == 0;
+    }
+    UTEST(same);
+
+    // conversions back and forth
+    vs::Descriptors round_trip = vs::DescriptorSet(ad).toDescriptors();
+    UTEST(round_trip.size() == ad.size());
+    UTEST(vs::Descriptor::distance(round_trip.back(), ad.back()) == 0.0f);
+
+    UTEST(sameMatches(vs::matchDescriptors(as, bs), vs::matchDescriptors(ad, bd)));
+}
+
+// the original scalar brute force matcher
+static vs::Matches reference_match(vs::Descriptors const &a, vs::Descriptors const &b)
+{
+    vs::Matches output;
+    for (size_t ai = 0; ai < a.size(); ++ai)
+    {
+        float best_distance = std::numeric_limits<float>::max();
+        size_t best_index = 0;
+        for (size_t bi = 0; bi < b.size(); ++bi)
+        {
+            float distance = vs::Descriptor::distance(a[ai], b[bi]);
+            if (distance < best_distance)
+            {
+                best_distance = distance;
+                best_index = bi;
+            }
+        }
+
+        vs::Match m;
+        m.ai = int(ai);
+        m.bi = int(best_index);
+        m.distance = best_distance;
+        output.push_back(m);
+    }
+
+    std::sort(output.begin(), output.end(), [](vs::Match const &l, vs::Match const &r) { return (l.distance < r.distance); });
+
+    vs::Matches filtered;
+    std::vector<bool> seen(b.size(), false);
+    for (vs::Match const &m : output)
+        if (!seen[size_t(m.bi)])
+        {
+            seen[size_t(m.bi)] = true;
+            filtered.push_back(m);
+        }
+    return filtered;
+}
+
+static void test_match_descriptors() {
+    vs::Mat a = vs::loadImage("data/Rainier1.png", 3);
+    vs::Mat b = vs::loadImage("data/Rainier2.png", 3);
+
+    // gray descriptors (25 values)
+    vs::Descriptors ad = vs::harrisCornerDetector(a, 2.0f, 1.0f, 3);
+    vs::Descriptors bd = vs::harrisCornerDetector(b, 2.0f, 1.0f, 3);
+    UTEST(sameMatches(vs::matchDescriptors(ad, bd), reference_match(ad, bd)));
+
+    // color descriptors (75 values), a database size that isn't a multiple of the block size
+    std::vector<int> ai, bi;
+    for (vs::Descriptor const &d : ad)
+        ai.push_back(int(d.p.y) * a.w + int(d.p.x));
+    for (size_t i = 0; i + 3 < bd.size(); ++i)
+        bi.push_back(int(bd[i].p.y) * b.w + int(bd[i].p.x));
+
+    vs::DescriptorSet as = vs::DescriptorSet::describe(a, ai);
+    vs::DescriptorSet bs = vs::DescriptorSet::describe(b, bi);
+    UTEST(as.dims() == 75);
+    UTEST(sameMatches(vs::matchDescriptors(as, bs), reference_match(as.toDescriptors(), bs.toDescriptors())));
+}
+
+static void test_binary_descriptors() {
+    // hamming distance against a bit by bit count
+    std::mt19937_64 rng(7);
+    bool same = true;
+    for (int i = 0; i != 1000; ++i)
+    {
+        uint64_t a[vs::BinaryDescriptorSet::Words], b[vs::BinaryDescriptorSet::Words];
+        int expected = 0;
+        for (int w = 0; w != vs::BinaryDescriptorSet::Words; ++w)
+        {
+            a[w] = rng();
+            b[w] = (i % 3 == 0) ? a[w] : rng();
+            for (int bit = 0; bit != 64; ++bit)
+                expected += int(((a[w] ^ b[w]) >> bit) & 1u);
+        }
+        same = same && vs::BinaryDescriptorSet::distance(a, b) == expected;
+    }
+    UTEST(same);
+
+    // a shifted copy has the same descriptors away from the borders
+    vs::Mat a = vs::loadImage("data/Rainier1.png", 3);
+    int const dx = 10, dy = 7;
+    vs::Mat b = a.roiView(dx, dy, a.w - 2 * dx, a.h - 2 * dy).clone();
+
+    vs::BinaryDescriptorSet ad, bd;
+    vs::harrisCornerDetector(a, ad, 2.0f, 50.0f, 3);
+    vs::harrisCornerDetector(b, bd, 2.0f, 50.0f, 3);
+    UTEST(ad.size() > 20 && bd.size() > 20);
+
+    vs::Matches m = vs::matchDescriptors(bd, ad);
+    int exact = 0;
+    for (vs::Match const &match : m)
+        if (match.distance == 0.0f && match.p.x + dx == match.q.x && match.p.y + dy == match.q.y)
+            exact++;
+    UTEST(exact > int(m.size()) * 8 / 10);
+}
+
+// segment test without the high speed test, true when arc contiguous circle pixels pass
+static bool reference_fast(vs::Mat const &im, int x, int y, float thresh, int arc)
+{
+    static const int cx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+    static const int cy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+    float c = im.get(x, y, 0);
+    for (int sign = -1; sign <= 1; sign += 2)
+        for (int start = 0; start != 16; ++start)
+        {
+            int run = 0;
+            while (run < arc && sign * (im.get(x + cx[(start + run) % 16], y + cy[(start + run) % 16], 0) - c) > thresh)
+                run++;
+            if (run == arc)
+                return true;
+        }
+    return false;
+}
+
+static void test_fast_corners() {
+    // a bright square has corners on its 4 corners only
+    vs::Mat square(64, 64, 1);
+    for (int y = 20; y != 44; ++y)
+        for (int x = 20; x != 44; ++x)
+            square.set(x, y, 0, 1.0f);
+
+    vs::Descriptors d = vs::fastCornerDetector(square, 0.1f, 3);
+    UTEST(d.size() == 4);
+    for (vs::Descriptor const &corner : d)
+        UTEST((vs::absolute(corner.p.x - 20) <= 1 || vs::absolute(corner.p.x - 43) <= 1) &&
+              (vs::absolute(corner.p.y - 20) <= 1 || vs::absolute(corner.p.y - 43) <= 1));
+
+    // the high speed test never rejects a corner
+    vs::Mat gray = vs::rgb2gray(vs::loadImage("data/Rainier1.png", 3));
+    for (int arc : {9, 12})
+    {
+        vs::Mat score;
+        vs::fastCornerScore(gray, score, 0.08f, arc);
+
+        int mismatches = 0, corners = 0;
+        for (int y = 3; y < gray.h - 3; ++y)
+            for (int x = 3; x < gray.w - 3; ++x)
+            {
+                bool corner = reference_fast(gray, x, y, 0.08f, arc);
+                corners += corner ? 1 : 0;
+                mismatches += (corner != (score.get(x, y, 0) > 0.0f)) ? 1 : 0;
+            }
+        UTEST(mismatches == 0 && corners > 0);
+    }
+
+    // the score only sums the side that forms the arc, even when the other side differs more
+    static const int cx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+    static const int cy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+    vs::Mat ring(16, 16, 1);
+    ring.fill(0, 0.5f);
+    for (int k = 0; k != 16; ++k)
+        ring.set(8 + cx[k], 8 + cy[k], 0, k < 9 ? 0.7f : 0.0f);
+    vs::Mat ring_score;
+    vs::fastCornerScore(ring, ring_score, 0.1f, 9);
+    UTEST(vs::absolute(ring_score.get(8, 8, 0) - 9 * 0.1f) < 1e-4f);
+
+    // both detectors fill the same descriptor types
+    vs::DescriptorSet set;
+    vs::detectCorners(gray, set, vs::FastCorners, 2.0f, 0.08f, 3);
+    UTEST(set.size() > 100 && set.size() == int(vs::fastCornerDetector(gray, 0.08f, 3).size()));
+}
+
+static void reference_nms(vs::Mat const &im, vs::Mat &dst, int w)
+{
+    const float low_response = std::numeric_limits<float>::min();
+    dst.reshape(im.w, im.h, 1);
+    for (int y = 0; y != im.h; ++y)
+        for (int x = 0; x != im.w; ++x)
+        {
+            float value = im.getClamp(x, y, 0);
+            dst.set(x, y, 0, value);
+            for (int ky = -w; ky <= w && (value > low_response); ++ky)
+                for (int kx = -w; kx <= w && (value > low_response); ++kx)
+                    if (im.getClamp(x + kx, y + ky, 0) > value)
+                    {
+                        dst.set(x, y, 0, low_response);
+                        value = low_response;
+                    }
+        }
+}
+
+static bool identical(vs::Mat const &a, vs::Mat const &b)
+{
+    if (a.w != b.w || a.h != b.h || a.c != b.c)
+        return false;
+    for (int y = 0; y != a.h; ++y)
+        for (int x = 0; x != a.w; ++x)
+            if (a.get(x, y, 0) != b.get(x, y, 0))
+                return false;
+    return true;
+}
+
+static void test_non_max_supression() {
+    vs::Mat im = vs::loadImage("data/Rainier1.png", 3);
+    vs::Mat S, R;
+    vs::harrisStructureMatrix(vs::rgb2gray(im), S, 2.0f);
+    vs::harrisCornernessResponse(S, R);
+
+    for (int w : {0, 1, 3, 7, 20})
+    {
+        vs::Mat dst, reference;
+        vs::nonMaxSupression(R, dst, w);
+        reference_nms(R, reference, w);
+        UTEST(identical(dst, reference));
+    }
+
+    // plateaus, negative values and a strided view
+    std::mt19937 rng(7);
+    vs::Mat levels(131, 77, 1);
+    for (int i = 0; i != levels.w * levels.h; ++i)
+        levels.data[i] = float(int(rng() % 7) - 2);
+    vs::Mat view = levels.roiView(5, 3, 100, 70);
+    for (int w : {1, 2, 5, 60})
+    {
+        vs::Mat dst, reference;
+        vs::nonMaxSupression(view, dst, w);
+        reference_nms(view, reference, w);
+        UTEST(identical(dst, reference));
+    }
+}
+
+static void test_keypoint_budget() {
+    vs::Mat gray = vs::rgb2gray(vs::loadImage("data/Rainier1.png", 3));
+    vs::Mat S, R, N;
+    vs::harrisStructureMatrix(gray, S, 2.0f);
+    vs::shiTomasiCornernessResponse(S, R);
+    vs::nonMaxSupression(R, N, 1);
+
+    std::vector<int> all;
+    for (int i = 0; i != N.w * N.h; ++i)
+        if (N.data[i] > 0.001f)
+            all.push_back(i);
+    UTEST(all.size() > 1000);
+
+    // grid: the budget is filled and every cell with corners keeps some
+    vs::KeypointBudget budget;
+    budget.mode = vs::BudgetGrid;
+    budget.count = 256;
+    budget.grid = 4;
+    std::vector<int> grid = all;
+    vs::selectCorners(N, grid, budget);
+    UTEST(grid.size() == 256 && std::is_sorted(grid.begin(), grid.end()));
+    auto cell = [&](int i) { return size_t((i / N.w) * 4 / N.h * 4 + (i % N.w) * 4 / N.w); };
+    std::vector<int> available(16, 0), kept(16, 0);
+    for (int i : all)
+        available[cell(i)]++;
+    for (int i : grid)
+        kept[cell(i)]++;
+    for (size_t c = 0; c != 16; ++c)
+        UTEST(kept[c] >= vs::minimum(available[c], 16));
+
+    // adaptive: same corners as the quadratic search
+    std::vector<int> sorted = all;
+    std::sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+        return N.data[a] > N.data[b] || (N.data[a] == N.data[b] && a < b);
+    });
+    std::vector<float> radius(sorted.size(), std::numeric_limits<float>::max());
+    for (size_t k = 0; k != sorted.size(); ++k)
+        for (size_t j = 0; j != k; ++j)
+        {
+            float dx = float(sorted[j] % N.w - sorted[k] % N.w);
+            float dy = float(sorted[j] / N.w - sorted[k] / N.w);
+            radius[k] = vs::minimum(radius[k], dx * dx + dy * dy);
+        }
+    std::vector<size_t> order(sorted.size());
+    for (size_t k = 0; k != order.size(); ++k)
+        order[k] = k;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return radius[a] > radius[b]; });
+    std::vector<int> reference;
+    for (size_t k = 0; k != 300; ++k)
+        reference.push_back(sorted[order[k]]);
+    std::sort(reference.begin(), reference.end());
+
+    budget.mode = vs::BudgetAdaptive;
+    budget.count = 300;
+    std::vector<int> adaptive = all;
+    vs::selectCorners(N, adaptive, budget);
+    UTEST(adaptive == reference);
+
+    // the detectors honour the budget
+    vs::DescriptorSet set;
+    vs::detectCorners(gray, set, vs::FastCorners, 2.0f, 0.05f, 1, budget);
+    UTEST(set.size() == 300);
+}
+
+static void test_cornerness_response() {
+    vs::Mat color = vs::loadImage("data/Rainier1.png", 3);
+    vs::Mat gray = vs::rgb2gray(color);
+    vs::Mat small = gray.roiView(100, 100, 7, 5);
+
+    for (vs::Mat const *im : {&gray, &color, &small})
+        for (float sigma : {1.0f, 2.0f})
+            for (bool shi_tomasi : {false, true})
+            {
+                vs::Mat S, reference, R;
+                vs::harrisStructureMatrix(*im, S, sigma);
+                if (shi_tomasi)
+                    vs::shiTomasiCornernessResponse(S, reference);
+                else
+                    vs::harrisCornernessResponse(S, reference);
+
+                vs::cornernessResponse(*im, R, sigma, shi_tomasi);
+                UTEST(identical(R, reference));
+            }
+}
+
+// matches between two views related by H, the first inliers agree with H (within 0.5 pixels),
+// the rest point anywhere. Sorted by distance like matchDescriptors, inliers tend to be closer.
+static vs::Matches synthetic_matches(vs::Mat3d const &H, int inliers, int outliers, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> x(0.0f, 640.0f), y(0.0f, 480.0f), noise(-0.35f, 0.35f);
+    std::uniform_real_distribution<float> close(0.0f, 1.0f), far(0.5f, 1.5f);
+
+    vs::Matches m;
+    for (int i = 0; i != inliers + outliers; ++i)
+    {
+        vs::Match match;
+        match.ai = i;
+        match.bi = i;
+        match.p = vs::Point(x(rng), y(rng));
+        if (i < inliers)
+        {
+            match.q = H.project(match.p);
+            match.q.x += noise(rng);
+            match.q.y += noise(rng);
+            match.distance = close(rng);
+        }
+        else
+        {
+            match.q = vs::Point(x(rng), y(rng));
+            match.distance = far(rng);
+        }
+        m.push_back(match);
+    }
+
+    std::stable_sort(m.begin(), m.end(), [](vs::Match const &a, vs::Match const &b) { return a.distance < b.distance; });
+    return m;
+}
+
+static const vs::Mat3d synthetic_H(0.9, 0.05, 40.0, -0.04, 1.1, -12.0, 0.0001, -0.00005, 1.0);
+
+static void test_model_inliers() {
+    // a count that is not a multiple of the scoring blocks, with inliers and outliers interleaved
+    vs::Matches m = synthetic_matches(synthetic_H, 77, 130, 5);
+    std::shuffle(m.begin(), m.end(), std::mt19937(5));
+
+    const float thresh = 2.0f;
+    vs::Matches expected;
+    vs::Matches outliers;
+    for (vs::Match const &match : m)
+    {
+        if (vs::Point::distance(synthetic_H.project(match.p), match.q) < thresh)
+            expected.push_back(match);
+        else
+            outliers.push_back(match);
+    }
+    const int count = int(expected.size());
+    expected.insert(expected.end(), outliers.begin(), outliers.end());
+
+    // inliers first, both sides keep their order
+    vs::Matches partitioned = m;
+    UTEST(vs::modelInliers(synthetic_H, partitioned, thresh) == count);
+    UTEST(count >= 77);
+    UTEST(sameMatches(partitioned, expected));
+
+    vs::Matches empty;
+    UTEST(vs::modelInliers(synthetic_H, empty, thresh) == 0);
+}
+
+static bool nearHomography(vs::Mat3d const &a, vs::Mat3d const &b, double tolerance)
+{
+    for (int i = 0; i != 9; ++i)
+        if (std::fabs(a.m[i] - b.m[i]) > tolerance * vs::maximum(std::fabs(b.m[i]), 1e-3))
+            return false;
+    return true;
+}
+
+static void test_minimal_homography() {
+    vs::Match sample[4];
+    const vs::Point corners[4] = {vs::Point(10, 20), vs::Point(600, 35), vs::Point(580, 450), vs::Point(30, 400)};
+    for (int i = 0; i != 4; ++i)
+    {
+        sample[i].p = corners[i];
+        sample[i].q = synthetic_H.project(corners[i]);
+    }
+
+    vs::Mat3d H;
+    UTEST(vs::computeHomography4(sample, H));
+    UTEST(nearHomography(H, synthetic_H, 1e-4));
+
+    vs::Matches matches(sample, sample + 4);
+    vs::Matd M = vs::computeHomography(matches);
+    UTEST(M.size() == 9 && nearHomography(vs::Mat3d(M), H, 1e-9));
+
+    // three points on a line, in either image
+    vs::Match degenerate[4] = {sample[0], sample[1], sample[2], sample[3]};
+    degenerate[2].p = vs::Point(305, 27.5f);
+    UTEST(!vs::computeHomography4(degenerate, H));
+    degenerate[2] = sample[2];
+    degenerate[3].q = degenerate[0].q;
+    UTEST(!vs::computeHomography4(degenerate, H));
+    UTEST(vs::computeHomography(vs::Matches(degenerate, degenerate + 4)).size() == 0);
+
+    // least squares over exact matches gives the homography back
+    vs::Matches m = synthetic_matches(synthetic_H, 100, 0, 6);
+    vs::HomographyAccumulator accumulator;
+    for (size_t i = 0; i != 3; ++i)
+        accumulator.add(m[i]);
+    UTEST(accumulator.count() == 3 && !accumulator.solve(H));
+
+    for (vs::Match &match : m)
+        match.q = synthetic_H.project(match.p);
+    accumulator.reset();
+    for (vs::Match const &match : m)
+        accumulator.add(match);
+    UTEST(accumulator.solve(H));
+    UTEST(nearHomography(H, synthetic_H, 1e-3));
+
+    // noisy matches, all the points are inliers of the fit
+    m = synthetic_matches(synthetic_H, 100, 0, 6);
+    M = vs::computeHomography(m);
+    UTEST(M.size() == 9 && vs::modelInliers(M, m, 1.0f) == 100);
+}
+
+static void test_adaptive_ransac() {
+    // 40% inliers: 0.99 confidence needs about 178 iterations
+    vs::Matches m = synthetic_matches(synthetic_H, 80, 120, 1);
+    vs::RansacParams params;
+    params.iterations = 50000;
+    vs::RansacReport report;
+    vs::Matd H = vs::RANSAC(m, params, &report);
+    UTEST(H.size() != 0);
+    UTEST(report.inliers >= 78 && report.inliers <= 82);
+    UTEST(report.iterations < 1000);
+    UTEST(report.confidence >= 0.99);
+    UTEST(vs::modelInliers(H, m, params.thresh) >= 78);
+
+    // iterations is an upper bound
+    params.iterations = 3;
+    vs::RANSAC(m, params, &report);
+    UTEST(report.iterations == 3 && report.confidence < 0.99);
+
+    // confidence 1 runs every iteration
+    params.iterations = 200;
+    params.confidence = 1.0f;
+    vs::RANSAC(m, params, &report);
+    UTEST(report.iterations == 200);
+
+    // unless the cutoff stops it, 0 stops at the first model
+    params.cutoff = 0;
+    vs::RANSAC(m, params, &report);
+    UTEST(report.iterations <= 3 && report.inliers > 0);
+    params.cutoff = -1;
+
+    // the Td,d pre-test rejects good hypotheses too, more iterations make up for it
+    vs::RansacReport full;
+    params.iterations = 50000;
+    params.confidence = 0.99f;
+    vs::RANSAC(m, params, &full);
+    params.pretest = 1;
+    H = vs::RANSAC(m, params, &report);
+    UTEST(H.size() != 0);
+    UTEST(report.inliers >= 78 && report.inliers <= 82);
+    UTEST(report.iterations > full.iterations && report.iterations < 2000);
+    UTEST(report.confidence >= 0.99);
+
+    // out of range pre-tests are clamped, past the maximum it is RansacMaxPretest and below 0 it is off
+    vs::RansacReport clamped;
+    params.pretest = vs::RansacMaxPretest;
+    vs::RANSAC(m, params, &clamped);
+    params.pretest = vs::RansacMaxPretest + 5;
+    H = vs::RANSAC(m, params, &report);
+    UTEST(H.size() != 0 && report.iterations == clamped.iterations && report.inliers == clamped.inliers);
+    params.pretest = -3;
+    H = vs::RANSAC(m, params, &report);
+    UTEST(report.iterations == full.iterations && report.inliers == full.inliers);
+}
+
+static void test_prosac() {
+    // 20% inliers, uniform sampling needs thousands of iterations
+    vs::Matches m = synthetic_matches(synthetic_H, 60, 240, 2);
+    vs::RansacParams params;
+    params.iterations = 50000;
+    vs::RansacReport uniform, prosac;
+    vs::Matches um = m;
+    vs::RANSAC(um, params, &uniform);
+
+    params.sampling = vs::RansacProsac;
+    vs::Matd H = vs::RANSAC(m, params, &prosac);
+    UTEST(H.size() != 0);
+    UTEST(prosac.inliers >= 58 && prosac.inliers <= 62);
+    UTEST(prosac.confidence >= 0.99);
+    UTEST(prosac.iterations < 100 && uniform.iterations > 1000);
+
+    // still finds the homography when the ranking is useless
+    std::mt19937 rng(3);
+    std::shuffle(m.begin(), m.end(), rng);
+    params.iterations = 20000;
+    H = vs::RANSAC(m, params, &prosac);
+    UTEST(prosac.inliers >= 58 && prosac.inliers <= 62);
+}
+
+static void test_parallel_ransac() {
+    const int threads = vs::getConcurrency();
+
+    vs::Matches m = synthetic_matches(synthetic_H, 50, 150, 4);
+    vs::RansacParams params;
+    params.iterations = 5000;
+    params.confidence = 0.999f;
+
+    // same result whatever the number of threads
+    vs::setConcurrency(1);
+    vs::Matches serial_m = m;
+    vs::RansacReport serial;
+    vs::Matd serial_H = vs::RANSAC(serial_m, params, &serial);
+
+    vs::setConcurrency(4);
+    vs::Matches parallel_m = m;
+    vs::RansacReport parallel;
+    vs::Matd parallel_H = vs::RANSAC(parallel_m, params, &parallel);
+
+    UTEST(serial.iterations == parallel.iterations && serial.inliers == parallel.inliers);
+    UTEST(serial_H.size() == 9 && parallel_H.size() == 9 &&
+          std::equal(serial_H.data, serial_H.data + 9, parallel_H.data));
+    UTEST(sameMatches(serial_m, parallel_m));
+    UTEST(serial.inliers >= 48);
+
+    // the inliers come first
+    UTEST(vs::modelInliers(serial_H, serial_m, params.thresh) == serial.inliers);
+
+    // runs at the same time don't interfere
+    std::vector<vs::RansacReport> reports(4);
+    std::vector<std::thread> jobs;
+    for (size_t i = 0; i != reports.size(); ++i)
+        jobs.emplace_back([&, i]() {
+            vs::Matches local = m;
+            vs::RANSAC(local, params, &reports[i]);
+        });
+    for (std::thread &job : jobs)
+        job.join();
+    for (vs::RansacReport const &report : reports)
+        UTEST(report.iterations == serial.iterations && report.inliers == serial.inliers);
+
+    vs::setConcurrency(threads);
+}
+
 int unit_tests_features(int argc, char **argv)
 {
     test_filter();
@@ -191,6 +821,19 @@ int unit_tests_features(int argc, char **argv)
     test_draw_matches();
     test_homography();
     test_ransac();
+    test_descriptor_index();
+    test_descriptor_set();
+    test_match_descriptors();
+    test_binary_descriptors();
+    test_fast_corners();
+    test_non_max_supression();
+    test_keypoint_budget();
+    test_cornerness_response();
+    test_model_inliers();
+    test_minimal_homography();
+    test_adaptive_ransac();
+    test_prosac();
+    test_parallel_ransac();
 
     return 0;
 }
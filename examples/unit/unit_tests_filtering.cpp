@@ -105,6 +105,60 @@ static void test_convolution(){
     UTEST(vs::sameMat(blur, gt));
 }
 
+// straightforward per pixel convolution, the engine must give the same bits
+static vs::Mat reference_convolve(vs::Mat const& src, vs::Mat const& filter, bool preserve) {
+    vs::Mat dst(src.w, src.h, preserve ? src.c : 1);
+    for (int y = 0; y != src.h; ++y)
+        for (int x = 0; x != src.w; ++x) {
+            float value = 0.0f;
+            for (int k = 0; k != src.c; ++k) {
+                int fc = (src.c == filter.c) ? k : 0;
+                for (int fy = 0; fy != filter.h; ++fy)
+                    for (int fx = 0; fx != filter.w; ++fx)
+                        value += src.getClamp(x + fx - filter.w / 2, y + fy - filter.h / 2, k) * filter.get(fx, fy, fc);
+                if (preserve) {
+                    dst.set(x, y, k, value);
+                    value = 0.0f;
+                }
+            }
+            if (!preserve)
+                dst.set(x, y, 0, value);
+        }
+    return dst;
+}
+
+static bool identical(vs::Mat const& a, vs::Mat const& b) {
+    if (a.w != b.w || a.h != b.h || a.c != b.c)
+        return false;
+    for (int k = 0; k != a.c; ++k)
+        for (int y = 0; y != a.h; ++y)
+            for (int x = 0; x != a.w; ++x)
+                if (a.get(x, y, k) != b.get(x, y, k))
+                    return false;
+    return true;
+}
+
+static void test_convolution_engine() {
+    vs::Mat im = vs::loadImage("test/dogsmall.jpg");
+    vs::Mat narrow = im.roiView(3, 2, 4, 9);
+
+    std::vector<vs::Mat> filters;
+    filters.push_back(vs::makeSobelFilter(true));
+    filters.push_back(vs::makeGaussianFilter(0.9f)); // 5x5
+    filters.push_back(vs::makeGaussianFilter(2.0f)); // 13x13
+    filters.push_back(vs::makeGaussianFilter1D(1.5f));
+    filters.push_back(vs::Mat(4, 4, 1).fill(1.0f / 16.0f));
+    filters.push_back(vs::Mat(3, 1, 1).fill(1.0f));
+    filters.push_back(vs::Mat(1, 3, 1).fill(1.0f));
+    filters.push_back(vs::Mat(1, 9, 1).fill(1.0f / 9.0f));
+
+    for (vs::Mat const& f : filters) {
+        UTEST(identical(vs::convolve(im, f, true), reference_convolve(im, f, true)));
+        UTEST(identical(vs::convolve(im, f, false), reference_convolve(im, f, false)));
+        UTEST(identical(vs::convolve(narrow, f, true), reference_convolve(narrow, f, true)));
+    }
+}
+
 static void test_gaussian_filter() {
     vs::Mat f = vs::makeGaussianFilter(7.0f);
 
@@ -155,6 +209,35 @@ static void test_gaussian_blur() {
     UTEST(vs::sameMat(D, d));
 }
 
+static void test_recursive_gaussian() {
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+
+    // the recursive filter approximates the sampled gaussian
+    float const sigmas[] = {1.0f, 2.0f, 5.0f, 10.0f};
+    for (float sigma : sigmas) {
+        vs::Mat fir = vs::smoothImage(im, sigma, vs::GaussianFIR);
+        vs::Mat iir = vs::smoothImage(im, sigma, vs::GaussianIIR);
+        UTEST(fir.w == iir.w && fir.h == iir.h && fir.c == iir.c);
+
+        double total = 0.0;
+        float worst = 0.0f;
+        for (int i = 0; i != fir.size(); ++i) {
+            float delta = vs::absolute(fir.data[i] - iir.data[i]);
+            total += delta;
+            worst = vs::maximum(worst, delta);
+        }
+        UTEST(total / fir.size() < 0.004);
+        UTEST(worst < 0.07f);
+    }
+
+    // unit gain, borders included
+    vs::Mat flat(37, 23, 1);
+    flat.fill(0.5f);
+    vs::Mat smooth = vs::smoothImage(flat, 4.0f, vs::GaussianIIR);
+    for (int i = 0; i != smooth.size(); ++i)
+        UTEST(vs::equivalent(smooth.data[i], 0.5f, 1e-4f));
+}
+
 static void test_hybrid_image() {
     vs::Mat man = vs::loadImage("data/melisa.png", 3);
     vs::Mat woman = vs::loadImage("data/aria.png", 3);
@@ -286,17 +369,78 @@ static void test_extract_image_4_points() {
     UTEST(vs::sameMat(frame, warped));
 }
 
+static void test_warp_perspective() {
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+    vs::Mat3d H(0.9, 0.1, 12.0, -0.05, 1.1, 7.0, 0.0002, -0.0001, 1.0);
+
+    vs::Mat warped(im.w, im.h, im.c);
+    vs::warpPerspective(im, warped, H, vs::Bilinear, vs::BorderConstant);
+
+    // reference: project every pixel and sample one channel at a time
+    float max_error = 0.0f;
+    for (int y = 0; y < warped.h; ++y)
+        for (int x = 0; x < warped.w; ++x)
+        {
+            vs::Point p = H.project(vs::Point(x, y));
+            // rounding decides samples that land on the border
+            if (vs::absolute(p.x) < 1e-3f || vs::absolute(p.y) < 1e-3f ||
+                vs::absolute(p.x - im.w) < 1e-3f || vs::absolute(p.y - im.h) < 1e-3f)
+                continue;
+
+            bool inside = p.x >= 0.0f && p.x < im.w && p.y >= 0.0f && p.y < im.h;
+            for (int k = 0; k < im.c; ++k)
+            {
+                float expected = inside ? vs::interpolateBL(im, p.x, p.y, k) : 0.0f;
+                max_error = vs::maximum(max_error, vs::absolute(expected - warped.get(x, y, k)));
+            }
+        }
+    UTEST(max_error < 1e-3f);
+
+    // a pure translation into a view only touches the view
+    vs::Mat canvas(im.w + 20, im.h + 20, im.c);
+    canvas.fill(0.5f);
+    vs::Mat view = canvas.roiView(10, 10, im.w, im.h);
+    vs::warpPerspective(im, view, vs::Mat3d(), vs::NearestNeighbor);
+    UTEST(vs::sameMat(view.clone(), im));
+    UTEST(vs::equivalent(canvas.get(5, 5, 0), 0.5f));
+
+    // masked samples keep the destination
+    vs::Mat mask(im.w, im.h, 1);
+    vs::Mat kept(im.w, im.h, im.c);
+    kept.fill(0.25f);
+    vs::warpPerspective(im, kept, vs::Mat3d(), vs::Bilinear, vs::BorderTransparent, mask);
+    UTEST(vs::equivalent(kept.max(0), 0.25f) && vs::equivalent(kept.max(2), 0.25f));
+
+    // with a constant border they are cleared like the samples outside of src
+    for (int y = 0; y != mask.h; ++y)
+        for (int x = 0; x != mask.w / 2; ++x)
+            mask.set(x, y, 0, 1.0f);
+    for (vs::ResizeMode mode : {vs::NearestNeighbor, vs::Bilinear})
+    {
+        vs::Mat cleared(im.w, im.h, im.c);
+        cleared.fill(0.25f);
+        vs::warpPerspective(im, cleared, vs::Mat3d(), mode, vs::BorderConstant, mask);
+        vs::Mat left = cleared.roiView(0, 0, im.w / 2, im.h).clone();
+        vs::Mat right = cleared.roiView(im.w / 2, 0, im.w - im.w / 2, im.h).clone();
+        UTEST(mode == vs::Bilinear || vs::sameMat(left, im.roiView(0, 0, im.w / 2, im.h).clone()));
+        UTEST(left.min(0) < 0.2f || left.max(0) > 0.3f);
+        UTEST(vs::equivalent(right.max(0), 0.0f) && vs::equivalent(right.min(2), 0.0f));
+    }
+}
+
 int unit_tests_filtering(int argc, char **argv)
 {
     test_nn_resize();
     test_bl_resize();
     test_multiple_resize(); // very slow
     test_convolution();
+    test_convolution_engine();
     test_highpass_filter();
     test_emboss_filter();
     test_sharpen_filter();
     test_gaussian_filter();
     test_gaussian_blur();
+    test_recursive_gaussian();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
@@ -304,6 +448,7 @@ int unit_tests_filtering(int argc, char **argv)
     test_gradients();
     test_canny();
     test_extract_image_4_points();
+    test_warp_perspective();
 
     return 0;
 }
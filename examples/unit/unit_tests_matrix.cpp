@@ -614,11 +614,155 @@ static void test_matrix_homography() {
     }
 }
 
+static void test_views() {
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+
+    // aligned storage
+    UTEST((uintptr_t(im.data) % vs::Mat::Alignment) == 0);
+    UTEST(im.isContinuous());
+
+    vs::Mat padded;
+    padded.reshapePadded(im.w + 3, im.h, im.c);
+    UTEST(!padded.isContinuous());
+    UTEST((padded.stride * sizeof(float)) % vs::Mat::Alignment == 0);
+    UTEST((uintptr_t(padded.row(7, 2)) % vs::Mat::Alignment) == 0);
+
+    // roi views share the parent memory
+    vs::Mat roi = im.roiView(10, 20, 100, 50);
+    UTEST(roi.w == 100 && roi.h == 50 && roi.c == im.c);
+    UTEST(!roi.isContinuous());
+    UTEST(vs::equivalent(roi.get(0, 0, 1), im.get(10, 20, 1)));
+    UTEST(vs::equivalent(roi.get(99, 49, 2), im.get(109, 69, 2)));
+
+    roi.set(5, 5, 0, 0.25f);
+    UTEST(vs::equivalent(im.get(15, 25, 0), 0.25f));
+
+    vs::Mat copied(100, 50, im.c);
+    copied.copy(im, 10, 20, 100, 50, 0, 0);
+    UTEST(vs::sameMat(copied, roi));
+    UTEST(vs::sameMat(roi.clone(), copied));
+    UTEST(roi.clone().isContinuous());
+
+    // views of views
+    vs::Mat inner = roi.roiView(1, 2, 10, 10).channelView(2);
+    UTEST(vs::equivalent(inner.get(3, 4, 0), im.get(14, 26, 2)));
+
+    // operations on a view only touch the view
+    padded.zero();
+    vs::Mat padded_roi = padded.roiView(1, 1, 10, 10);
+    padded_roi.fill(1.0f);
+    UTEST(vs::equivalent(padded.sum(0), 100.0f));
+    UTEST(vs::equivalent(padded.get(0, 0, 0), 0.0f));
+    UTEST(vs::equivalent(padded.get(10, 10, 2), 1.0f));
+}
+
+static vs::Mat paddedLike(vs::Mat const &im) {
+    vs::Mat padded;
+    padded.reshapePadded(im.w, im.h, im.c);
+    padded.copy(im, 0, 0);
+    return padded;
+}
+
+static void test_strided_kernels() {
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+
+    // the per pixel kernels follow the strides of views and padded mats, on both sides
+    vs::Mat view = im.roiView(30, 40, 121, 90);
+    vs::Mat dense = view.clone();
+
+    vs::Mat gray, gray_padded(paddedLike(vs::Mat(view.w, view.h, 1)));
+    vs::rgb2gray(dense, gray);
+    vs::rgb2gray(view, gray_padded);
+    UTEST(!gray_padded.isContinuous());
+    UTEST(vs::sameMat(gray_padded, gray));
+
+    vs::Mat bgr_padded = paddedLike(dense);
+    vs::rgb2bgr(view, bgr_padded);
+    UTEST(vs::sameMat(bgr_padded, vs::rgb2bgr(dense)));
+
+    vs::Mat thresholded, thresholded_padded = paddedLike(gray);
+    float otsu = vs::thresholdOtsu(gray, thresholded, vs::ThresholdMode::Binary);
+    UTEST(vs::equivalent(vs::thresholdOtsu(gray_padded, thresholded_padded, vs::ThresholdMode::Binary), otsu));
+    UTEST(vs::sameMat(thresholded_padded, thresholded));
+    vs::threshold(gray, thresholded, vs::ThresholdMode::ToZeroInverted, 0.4f);
+    vs::threshold(gray_padded, thresholded_padded, vs::ThresholdMode::ToZeroInverted, 0.4f);
+    UTEST(vs::sameMat(thresholded_padded, thresholded));
+
+    vs::Mat S, R, R_padded = paddedLike(gray);
+    vs::harrisStructureMatrix(gray, S, 2.0f);
+    vs::Mat S_padded = paddedLike(S);
+    vs::harrisCornernessResponse(S, R);
+    vs::harrisCornernessResponse(S_padded, R_padded);
+    UTEST(vs::sameMat(R_padded, R));
+    vs::shiTomasiCornernessResponse(S, R);
+    vs::shiTomasiCornernessResponse(S_padded, R_padded);
+    UTEST(vs::sameMat(R_padded, R));
+
+    vs::Mat mag, theta, mag_padded = paddedLike(gray), theta_padded = paddedLike(gray);
+    vs::gradientMagnitudeAngle(gray, mag, theta);
+    vs::gradientMagnitudeAngle(gray_padded, mag_padded, theta_padded);
+    UTEST(vs::sameMat(mag_padded, mag) && vs::sameMat(theta_padded, theta));
+
+    vs::Mat edges, edges_padded = paddedLike(gray);
+    vs::canny(gray, edges, 0.1f, 0.3f, 1.4f);
+    vs::canny(gray_padded, edges_padded, 0.1f, 0.3f, 1.4f);
+    UTEST(vs::sameMat(edges_padded, edges));
+
+    vs::Mat prev = vs::rgb2gray(im.roiView(32, 41, 121, 90).clone());
+    vs::Mat prev_padded = paddedLike(prev);
+    vs::LucasKanade lk;
+    vs::Mat T, T_padded = paddedLike(vs::Mat(gray.w, gray.h, 5));
+    lk.timeStructureMatrix(gray, prev, 5, T);
+    lk.timeStructureMatrix(gray_padded, prev_padded, 5, T_padded);
+    UTEST(vs::sameMat(T_padded, T));
+}
+
+static void test_mat3() {
+    constexpr vs::Mat3d T = vs::Mat3d::makeTranslation(3.0, -2.0);
+    static_assert(T(0, 2) == 3.0 && T(1, 2) == -2.0 && T(2, 2) == 1.0, "constexpr translation");
+
+    vs::Matd Hm(3, 3);
+    Hm(0, 0) = 0.9;   Hm(0, 1) = 0.05;  Hm(0, 2) = 12.0;
+    Hm(1, 0) = -0.03; Hm(1, 1) = 1.1;   Hm(1, 2) = -7.5;
+    Hm(2, 0) = 1e-4;  Hm(2, 1) = -2e-4; Hm(2, 2) = 1.0;
+    vs::Mat3d H(Hm);
+
+    // batch projection gives the same bits as the single point one
+    int const n = 37;
+    std::vector<float> xs(n), ys(n), px(n), py(n);
+    for (int i = 0; i != n; ++i) {
+        xs[size_t(i)] = float(i * 13 % 640) + 0.25f;
+        ys[size_t(i)] = float(i * 29 % 480) - 0.5f;
+    }
+    vs::projectPoints(H, xs.data(), ys.data(), n, px.data(), py.data());
+    for (int i = 0; i != n; ++i) {
+        vs::Point p = vs::projectPoint(Hm, vs::Point(xs[size_t(i)], ys[size_t(i)]));
+        UTEST(p.x == px[size_t(i)] && p.y == py[size_t(i)]);
+    }
+
+    // inverse
+    vs::Mat3d Hinv;
+    UTEST(H.invert(Hinv));
+    vs::Mat3d I = vs::Mat3d::mmult(H, Hinv);
+    for (int row = 0; row != 3; ++row)
+        for (int col = 0; col != 3; ++col)
+            UTEST(vs::equivalent(I(row, col), row == col ? 1.0 : 0.0, 1e-9));
+
+    vs::Point p = Hinv.project(H.project(vs::Point(100.0f, 50.0f)));
+    UTEST(vs::equivalent(p.x, 100.0f, 1e-3f) && vs::equivalent(p.y, 50.0f, 1e-3f));
+
+    vs::Mat3d singular(1, 2, 3, 2, 4, 6, 0, 0, 1);
+    UTEST(!singular.invert(Hinv));
+}
+
 int unit_tests_matrix(int argc, char **argv)
 {
     test_basics();
     test_invert();
     test_proj_mult();
     test_matrix_homography();
+    test_views();
+    test_strided_kernels();
+    test_mat3();
     return 0;
 }
@@ -112,6 +112,350 @@ static void test_box_filter() {
     UTEST(vs::sameMat(blur, gt));
 }
 
+// velocityImage as it was, one 2x2 Mat inverse per pixel
+static void reference_velocity(vs::Mat const &S, int stride, vs::Mat &v)
+{
+    v.reshape(S.w / stride, S.h / stride, 3);
+    v.zero();
+
+    vs::Mat A(2, 2);
+    vs::Mat B(1, 2);
+    vs::Mat P(1, 2);
+    for (int ty = 0; ty != v.h; ++ty)
+        for (int tx = 0; tx != v.w; ++tx)
+        {
+            int x = (stride - 1) / 2 + tx * stride;
+            int y = (stride - 1) / 2 + ty * stride;
+            A(0, 0) = S.get(x, y, 0);
+            A(0, 1) = S.get(x, y, 2);
+            A(1, 0) = S.get(x, y, 2);
+            A(1, 1) = S.get(x, y, 1);
+            B(0, 0) = -S.get(x, y, 3);
+            B(1, 0) = -S.get(x, y, 4);
+
+            if (vs::minEigenValue2x2(A) > 0.0002f)
+            {
+                vs::Mat Ai = A.invert();
+                vs::Mat::vmult(Ai, B, P);
+                v.set(tx, ty, 0, P(0, 0));
+                v.set(tx, ty, 1, P(1, 0));
+            }
+        }
+}
+
+static void test_velocity_image() {
+    vs::LucasKanade lk;
+
+    vs::Mat a = vs::loadImage("data/dog_a.jpg");
+    vs::Mat b = vs::loadImage("data/dog_b.jpg");
+    vs::Mat ga, gb;
+    vs::rgb2gray(a, ga);
+    vs::rgb2gray(b, gb);
+
+    vs::Mat S;
+    lk.timeStructureMatrix(gb, ga, 15, S);
+
+    for (int stride : {1, 3, 8})
+    {
+        vs::Mat v, expected;
+        lk.velocityImage(S, stride, v);
+        reference_velocity(S, stride, expected);
+
+        UTEST(v.w == expected.w && v.h == expected.h && v.c == 3);
+
+        int solved = 0;
+        bool same = true;
+        for (int i = 0; i != v.size(); ++i)
+        {
+            const float e = expected.data[i];
+            same = same && std::fabs(v.data[i] - e) <= 1e-3f * vs::maximum(std::fabs(e), 1.0f);
+            solved += (e != 0.0f) ? 1 : 0;
+        }
+        UTEST(same);
+        UTEST(solved > v.w * v.h / 4);
+    }
+}
+
+static void test_strided_structure_matrix() {
+    vs::LucasKanade lk;
+
+    vs::Mat a = vs::rgb2gray(vs::loadImage("data/dog_a.jpg"));
+    vs::Mat b = vs::rgb2gray(vs::loadImage("data/dog_b.jpg"));
+
+    vs::Mat S;
+    lk.timeStructureMatrix(b, a, 15, S);
+
+    for (int stride : {2, 4, 7})
+    {
+        // the samples of the full structure matrix, not an approximation
+        vs::Mat sampled;
+        lk.timeStructureMatrix(b, a, 15, stride, sampled);
+        UTEST(sampled.w == S.w / stride && sampled.h == S.h / stride && sampled.c == 5);
+
+        bool same = true;
+        const int offset = (stride - 1) / 2;
+        for (int k = 0; k != 5; ++k)
+            for (int ty = 0; ty != sampled.h; ++ty)
+                for (int tx = 0; tx != sampled.w; ++tx)
+                    same = same && sampled.get(tx, ty, k) == S.get(offset + tx * stride, offset + ty * stride, k);
+        UTEST(same);
+
+        // so the velocities are the ones of the full resolution path
+        vs::Mat v, expected;
+        lk.velocityImage(sampled, 1, v);
+        lk.velocityImage(S, stride, expected);
+        UTEST(vs::sameMat(v, expected));
+    }
+}
+
+static void test_pyramid() {
+    vs::Mat im = vs::loadImage("data/dog.jpg");
+    std::vector<vs::Mat> pyramid;
+    vs::makePyramid(im, 4, pyramid);
+
+    UTEST(pyramid.size() == 4);
+    UTEST(pyramid[0].data == im.data);
+    for (size_t level = 1; level != pyramid.size(); ++level)
+        UTEST(pyramid[level].w == (pyramid[level - 1].w + 1) / 2 && pyramid[level].h == (pyramid[level - 1].h + 1) / 2 &&
+              pyramid[level].c == im.c);
+
+    // a constant image stays constant
+    vs::Mat flat(37, 21, 1);
+    flat.fill(0.25f);
+    vs::makePyramid(flat, 10, pyramid);
+    UTEST(pyramid.size() == 2 && pyramid[1].w == 19 && pyramid[1].h == 11);
+    UTEST(pyramid[1].min() == 0.25f && pyramid[1].max() == 0.25f);
+}
+
+// im(x) = prev(x - d), sampled with bilinear interpolation
+static vs::Mat translated(vs::Mat const &prev, float dx, float dy)
+{
+    vs::Mat im(prev.w, prev.h, 1);
+    for (int y = 0; y != im.h; ++y)
+        for (int x = 0; x != im.w; ++x)
+            im.set(x, y, 0, vs::interpolateBL(prev, float(x) + 0.5f - dx, float(y) + 0.5f - dy, 0));
+    return im;
+}
+
+// median error of the flow against d, away from the borders
+static float flow_error(vs::Mat const &v, int stride, float dx, float dy)
+{
+    std::vector<float> errors;
+    const int margin = 24 / stride + 1;
+    for (int y = margin; y < v.h - margin; ++y)
+        for (int x = margin; x < v.w - margin; ++x)
+            errors.push_back(std::hypot(v.get(x, y, 0) - dx, v.get(x, y, 1) - dy));
+
+    std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+    return errors[errors.size() / 2];
+}
+
+static void test_pyramidal_flow() {
+    vs::Mat prev = vs::rgb2gray(vs::loadImage("data/dog.jpg"));
+    const float dx = 6.3f;
+    const float dy = -4.6f;
+    vs::Mat im = translated(prev, dx, dy);
+
+    vs::LucasKanade lk;
+    vs::Mat v;
+    lk.opticalflowPyramidal(im, prev, 4, 7, 3, 4, v);
+    UTEST(v.w == im.w / 4 && v.h == im.h / 4 && v.c == 3);
+    UTEST(flow_error(v, 4, dx, dy) < 0.25f);
+
+    // too far for a single scale with the same window
+    lk.opticalflowPyramidal(im, prev, 1, 7, 3, 4, v);
+    UTEST(flow_error(v, 4, dx, dy) > 1.0f);
+}
+
+static bool identical(vs::Mat const& a, vs::Mat const& b) {
+    if (a.w != b.w || a.h != b.h || a.c != b.c)
+        return false;
+    for (int k = 0; k != a.c; ++k)
+        for (int y = 0; y != a.h; ++y)
+            for (int x = 0; x != a.w; ++x)
+                if (a.get(x, y, k) != b.get(x, y, k))
+                    return false;
+    return true;
+}
+
+static void test_streaming_flow() {
+    vs::Mat f0 = vs::rgb2gray(vs::loadImage("data/dog.jpg"));
+    vs::Mat f1 = translated(f0, 2.2f, -1.4f);
+    vs::Mat f2 = translated(f0, 4.1f, -3.0f);
+
+    vs::LucasKanade lk, stream;
+    vs::Mat expected, v;
+
+    // the frames are copied, the caller can reuse its buffer
+    vs::Mat frame = f0.clone();
+    UTEST(!stream.pushFrame(frame, 15, 4, v));
+    frame.copy(f1, 0, 0);
+    UTEST(stream.pushFrame(frame, 15, 4, v));
+    lk.opticalflow(f1, f0, 15, 4, expected);
+    UTEST(identical(v, expected));
+    frame.copy(f2, 0, 0);
+    UTEST(stream.pushFrame(frame, 15, 4, v));
+    lk.opticalflow(f2, f1, 15, 4, expected);
+    UTEST(identical(v, expected));
+
+    // a one shot call starts a new stream
+    stream.opticalflow(f1, f0, 15, 4, v);
+    UTEST(!stream.pushFramePyramidal(f0, 3, 7, 3, 4, v));
+    UTEST(stream.pushFramePyramidal(f1, 3, 7, 3, 4, v));
+    lk.opticalflowPyramidal(f1, f0, 3, 7, 3, 4, expected);
+    UTEST(identical(v, expected));
+    UTEST(stream.pushFramePyramidal(f2, 3, 7, 3, 4, v));
+    lk.opticalflowPyramidal(f2, f1, 3, 7, 3, 4, expected);
+    UTEST(identical(v, expected));
+
+    // the previous frame is made again for other levels
+    UTEST(stream.pushFramePyramidal(f0, 2, 7, 3, 4, v));
+    lk.opticalflowPyramidal(f0, f2, 2, 7, 3, 4, expected);
+    UTEST(identical(v, expected));
+
+    stream.reset();
+    UTEST(!stream.pushFramePyramidal(f1, 2, 7, 3, 4, v));
+}
+
+static void test_one_shot_frames() {
+    vs::Mat rgb = vs::loadImage("data/dog.jpg");
+    vs::Mat rgb_prev = rgb.clone();
+    rgb_prev.add(0.05f);
+    vs::Mat gray = vs::rgb2gray(rgb_prev);
+    vs::Mat gray_prev = vs::rgb2gray(rgb);
+    vs::Mat gray_before = gray.clone();
+    vs::Mat gray_prev_before = gray_prev.clone();
+
+    // gray frames are shared by the one shot calls, the colour frames that follow must not be converted into them
+    vs::LucasKanade lk;
+    vs::Mat v;
+    lk.opticalflow(gray, gray_prev, 15, 4, v);
+    lk.opticalflow(rgb, rgb_prev, 15, 4, v);
+    UTEST(identical(gray, gray_before) && identical(gray_prev, gray_prev_before));
+
+    lk.opticalflowPyramidal(gray, gray_prev, 3, 7, 1, 4, v);
+    lk.opticalflowPyramidal(rgb, rgb_prev, 3, 7, 1, 4, v);
+    UTEST(identical(gray, gray_before) && identical(gray_prev, gray_prev_before));
+
+    // nor the frames of a stream that follows
+    lk.opticalflow(gray, gray_prev, 15, 4, v);
+    lk.pushFrame(rgb, 15, 4, v);
+    lk.pushFrame(rgb_prev, 15, 4, v);
+    UTEST(identical(gray, gray_before) && identical(gray_prev, gray_prev_before));
+}
+
+static void test_klt_tracker() {
+    vs::Mat prev = vs::rgb2gray(vs::loadImage("data/dog.jpg"));
+    const float dx = 3.4f;
+    const float dy = -2.7f;
+    vs::Mat im = translated(prev, dx, dy);
+
+    vs::KLTParams params;
+    vs::KLTTracker tracker(params);
+
+    // the first frame only detects
+    vs::Tracks first = tracker.track(prev);
+    UTEST(int(first.size()) > params.count / 2 && int(first.size()) <= params.count);
+    bool fresh = true;
+    for (size_t i = 0; i != first.size(); ++i)
+        fresh = fresh && first[i].age == 0 && first[i].id == int(i);
+    UTEST(fresh);
+
+    // nearly all the tracks follow the translation, with their ids
+    vs::Tracks second = tracker.track(im);
+    std::vector<float> errors;
+    bool same_ids = true;
+    for (vs::Track const &track : second)
+    {
+        if (track.age == 0)
+            continue;
+        errors.push_back(std::hypot(track.p.x - track.previous.x - dx, track.p.y - track.previous.y - dy));
+        same_ids = same_ids && track.id < int(first.size()) && first[size_t(track.id)].p.x == track.previous.x &&
+                   first[size_t(track.id)].p.y == track.previous.y;
+    }
+    std::sort(errors.begin(), errors.end());
+    UTEST(errors.size() >= first.size() * 9 / 10);
+    UTEST(same_ids);
+    UTEST(errors[errors.size() / 2] < 0.1f);
+
+    // nothing lost, nothing detected
+    vs::Tracks third = tracker.track(im);
+    UTEST(third.size() == second.size());
+    bool kept = true;
+    for (size_t i = 0; i != third.size(); ++i)
+        kept = kept && third[i].id == second[i].id && third[i].age == second[i].age + 1 &&
+               std::hypot(third[i].p.x - second[i].p.x, third[i].p.y - second[i].p.y) < 0.05f;
+    UTEST(kept);
+
+    // the tracks of a region that goes flat are lost, the others keep going
+    vs::Mat flat = im.clone();
+    for (int y = 0; y != flat.h; ++y)
+        for (int x = 0; x != flat.w / 2; ++x)
+            flat.set(x, y, 0, 0.5f);
+
+    vs::Tracks fourth = tracker.track(flat);
+    int survivors = 0;
+    bool left_lost = true;
+    for (vs::Track const &track : fourth)
+    {
+        survivors += (track.age > 0) ? 1 : 0;
+        left_lost = left_lost && !(track.age > 0 && track.p.x < float(flat.w / 2 - params.window));
+    }
+    int right = 0;
+    for (vs::Track const &track : third)
+        right += (track.p.x > float(flat.w / 2 + params.window)) ? 1 : 0;
+    UTEST(left_lost);
+    UTEST(survivors >= right);
+
+    tracker.reset();
+    UTEST(tracker.tracks().empty());
+
+    // a textured region that changes loses its tracks, corners are detected again only in the cells that lost some
+    const int cell_w = (im.w + params.grid - 1) / params.grid;
+    const int cell_h = (im.h + params.grid - 1) / params.grid;
+    auto cell_of = [&](vs::Point const &p) {
+        return vs::clampTo(int(p.y) / cell_h, 0, params.grid - 1) * params.grid +
+               vs::clampTo(int(p.x) / cell_w, 0, params.grid - 1);
+    };
+    // the other cells gain new corners too: a region that was flat gets its texture back while keeping its tracks
+    auto flattened = [&](vs::Mat const &frame) {
+        vs::Mat out = frame.clone();
+        for (int y = 0; y != 2 * cell_h; ++y)
+            for (int x = 5 * cell_w + cell_w / 3; x != 7 * cell_w; ++x)
+                out.set(x, y, 0, 0.5f);
+        return out;
+    };
+
+    tracker.track(flattened(prev));
+    vs::Tracks before = tracker.track(flattened(im));
+
+    vs::Mat changed = im.clone();
+    changed.copy(im, im.w / 2 + cell_w, im.h / 2, 2 * cell_w, 2 * cell_h, cell_w, cell_h);
+    vs::Tracks after = tracker.track(changed);
+
+    std::vector<int> lost(size_t(params.grid * params.grid), 0);
+    for (vs::Track const &track : before)
+    {
+        auto it = std::find_if(after.begin(), after.end(), [&](vs::Track const &t) { return t.id == track.id; });
+        if (it == after.end() || cell_of(it->p) != cell_of(track.p))
+            lost[size_t(cell_of(track.p))] = 1;
+    }
+
+    int fresh_in_lost = 0, fresh_elsewhere = 0, fresh_in_region = 0;
+    for (vs::Track const &track : after)
+    {
+        if (track.age != 0)
+            continue;
+        fresh_in_lost += lost[size_t(cell_of(track.p))];
+        fresh_elsewhere += 1 - lost[size_t(cell_of(track.p))];
+        fresh_in_region += (track.p.x >= cell_w && track.p.x < 3 * cell_w && track.p.y >= cell_h &&
+                            track.p.y < 3 * cell_h) ? 1 : 0;
+    }
+    UTEST(lost[size_t(params.grid + 1)] && lost[size_t(2 * params.grid + 2)]);
+    UTEST(fresh_in_region > 0 && fresh_in_lost >= fresh_in_region);
+    UTEST(fresh_elsewhere == 0);
+}
+
 static void test_images()
 {
     vs::LucasKanade lk;
@@ -131,6 +475,13 @@ int unit_tests_opticalflow(int argc, char **argv)
 {
     test_integral_images();
     test_box_filter();
+    test_velocity_image();
+    test_strided_structure_matrix();
+    test_pyramid();
+    test_pyramidal_flow();
+    test_streaming_flow();
+    test_one_shot_frames();
+    test_klt_tracker();
     test_images();
     return 0;
 }
@@ -25,7 +25,12 @@ void markCorners(Mat &im, Descriptors const &d)
 
 void drawHarrisCorners(Mat &im, const float sigma, const float thresh, const int nms)
 {
-    Descriptors d = harrisCornerDetector(im, sigma, thresh, nms);
+    drawCorners(im, HarrisCorners, sigma, thresh, nms);
+}
+
+void drawCorners(Mat &im, const CornerDetector detector, const float sigma, const float thresh, const int nms)
+{
+    Descriptors d = detectCorners(im, detector, sigma, thresh, nms);
     //std::cout << "Descriptors: " << d.size() << std::endl;
     markCorners(im, d);
 }
@@ -34,15 +39,8 @@ Mat mergeSideBySide(const Mat &a, const Mat &b)
 {
     Mat both(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
 
-    for(int k = 0; k < a.c; ++k)
-        for(int j = 0; j < a.h; ++j)
-            for(int i = 0; i < a.w; ++i)
-                both.set(i, j, k, a.get(i, j, k));
-
-    for(int k = 0; k < b.c; ++k)
-        for(int j = 0; j < b.h; ++j)
-            for(int i = 0; i < b.w; ++i)
-                both.set(i+a.w, j, k, b.get(i, j, k));
+    both.copy(a, 0, 0);
+    both.copy(b, a.w, 0);
 
     return both;
 }
@@ -74,10 +72,10 @@ Mat drawInliers(const Mat &a, const Mat &b, const Matd &H, Matches &m, float thr
     return drawMatches(a, b, m, inliers);
 }
 
-Mat drawMatches(Mat &a, Mat &b, float sigma, float thresh, int nms)
+Mat drawMatches(Mat &a, Mat &b, float sigma, float thresh, int nms, const CornerDetector detector)
 {
-    Descriptors ad = harrisCornerDetector(a, sigma, thresh, nms);
-    Descriptors bd = harrisCornerDetector(b, sigma, thresh, nms);
+    Descriptors ad = detectCorners(a, detector, sigma, thresh, nms);
+    Descriptors bd = detectCorners(b, detector, sigma, thresh, nms);
     Matches m = matchDescriptors(ad, bd);
     //std::cout << "Matched: " << m.size() << std::endl;
     markCorners(a, ad);
@@ -144,4 +142,14 @@ void drawFlow(Mat &im, const Mat &v, float scale)
     }
 }
 
+void drawTracks(Mat &im, Tracks const &tracks, float scale)
+{
+    for (Track const &track : tracks)
+    {
+        float dx = scale * (track.p.x - track.previous.x);
+        float dy = scale * (track.p.y - track.previous.y);
+        drawLine(im, track.p.x, track.p.y, dx, dy);
+    }
+}
+
 } // namespace vs
@@ -27,6 +27,13 @@ Mat mergeSideBySide(Mat const& a, Mat const& b);
 // int nms: distance to look for local-maxes in response map.
 void drawHarrisCorners(Mat &im, float const sigma, float const thresh, int const nms);
 
+// Find and draw corners on an image with the chosen detector.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for the detector.
+// int nms: distance to look for local-maxes in response map.
+void drawCorners(Mat &im, CornerDetector const detector, float const sigma, float const thresh, int const nms);
+
 // Draws lines between matching pixels in two images.
 // image a, b: two images that have matches.
 // match *matches: array of matches between a and b.
@@ -44,7 +51,8 @@ Mat drawInliers(Mat const& a, Mat const& b, Matd const& H, Matches& m, float thr
 // float sigma: gaussian for harris corner detector. Typical: 2
 // float thresh: threshold for corner/no corner. Typical: 1-5
 // int nms: window to perform nms on. Typical: 3
-Mat drawMatches(Mat& a, Mat& b, float sigma, float thresh, int nms);
+// detector: corner detector to use.
+Mat drawMatches(Mat& a, Mat& b, float sigma, float thresh, int nms, CornerDetector const detector = HarrisCorners);
 
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
@@ -58,4 +66,10 @@ void drawLine(Mat &im, float x, float y, float dx, float dy);
 // float scale: scalar to multiply velocity by for drawing
 void drawFlow(Mat& im, Mat const& v, float scale);
 
+// Draw the motion of tracked points
+// image im: image to draw on
+// tracks: points followed by a KLTTracker
+// float scale: scalar to multiply the motion by for drawing
+void drawTracks(Mat& im, Tracks const& tracks, float scale);
+
 } // namespace cv
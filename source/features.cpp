@@ -22,16 +22,14 @@ void Descriptor::reshape(int size)
     }
 }
 
-Descriptor Descriptor::describe(const Mat &im, int i)
+// writes the descriptor for index i of an image into data, 5 * 5 * im.c values.
+// very simple descriptor : its just a patch of neighbors pixels
+static void describePatch(const Mat &im, int i, float *data)
 {
     int x = i % im.w;
     int y = i / im.w;
 
     int w = 5;
-    Descriptor d;
-    d.p.x = float(x);
-    d.p.y = float(y);
-    d.reshape(w * w * im.c);
 
      float mean = 0.0f;
      for (int c = 0; c < im.c; ++c)
@@ -45,7 +43,7 @@ Descriptor Descriptor::describe(const Mat &im, int i)
      for (int c = 0; c < im.c; ++c)
          for (int dx = -w / 2; dx < (w + 1) / 2; ++dx)
              for (int dy = -w / 2; dy < (w + 1) / 2; ++dy)
-                 d.data[count++] = mean - im.getClamp(x + dx, y + dy, c);
+                 data[count++] = mean - im.getClamp(x + dx, y + dy, c);
 /*
     int count = 0;
     // If you want you can experiment with other descriptors
@@ -56,9 +54,20 @@ Descriptor Descriptor::describe(const Mat &im, int i)
         float cval = im.get(x, y, c);
         for (int dx = -w / 2; dx < (w + 1) / 2; ++dx)
             for (int dy = -w / 2; dy < (w + 1) / 2; ++dy)
-                d.data[count++] = cval - im.getClamp(x + dx, y + dy, c);
+                data[count++] = cval - im.getClamp(x + dx, y + dy, c);
     }
 */
+}
+
+Descriptor Descriptor::describe(const Mat &im, int i)
+{
+    int w = 5;
+    Descriptor d;
+    d.p.x = float(i % im.w);
+    d.p.y = float(i / im.w);
+    d.reshape(w * w * im.c);
+
+    describePatch(im, i, d.data);
     return d;
 }
 
@@ -80,49 +89,19 @@ float Descriptor::distance(const Descriptor &a, const Descriptor &b)
     return sum;
 }
 
-Matches matchDescriptors(const Descriptors &a, const Descriptors &b)
+// we want matches to be injective (one-to-one).
+// Sort matches based on distance
+// Then throw out matches to the same element in b. Use seen to keep track.
+// Each point should only be a part of one match.
+// Some points will not be in a match.
+// In practice just bring good matches to front of list
+static Matches uniqueMatches(Matches &output, size_t b_size)
 {
-    assert(!a.empty() && !b.empty());
-
-    Matches output;
-
-    // We will have at most a.size matches.
-    for(size_t ai = 0; ai < a.size(); ++ai) {
-
-        float best_distance = std::numeric_limits<float>::max();
-        size_t best_index = 0;
-
-        for(size_t bi = 0; bi < b.size(); ++bi) {
-            float distance = Descriptor::distance(a[ai], b[bi]);
-            if (distance < best_distance) {
-                best_distance = distance;
-                best_index = bi;
-            }
-        }
-
-        Match m;
-        m.ai = int(ai);
-        m.bi = int(best_index);
-        m.p = a[size_t(m.ai)].p;
-        m.q = b[size_t(m.bi)].p;
-        m.distance = best_distance; // <- should be the smallest L1 distance!
-
-        output.push_back(m);
-    }
-
-
-    // we want matches to be injective (one-to-one).
-    // Sort matches based on distance
-    // Then throw out matches to the same element in b. Use seen to keep track.
-    // Each point should only be a part of one match.
-    // Some points will not be in a match.
-    // In practice just bring good matches to front of list
-
     std::sort(output.begin(), output.end(), [] (Match const& a, Match const&b) { return (a.distance < b.distance); });
 
     Matches filtered;
 
-    std::vector<bool> seen(b.size(), false);
+    std::vector<bool> seen(b_size, false);
     for (size_t i = 0; i != output.size(); ++i) {
         size_t bi = size_t(output[i].bi);
         if (seen[bi])
@@ -135,314 +114,2068 @@ Matches matchDescriptors(const Descriptors &a, const Descriptors &b)
     return filtered;
 }
 
-template<typename T>
-static Point project(const MatT<T> &H, const Point &p) {
-    assert(H.w == 3 && H.h == 3 && H.c == 1);
-
-    MatT<T> pm(1, 3);
-    pm(0,0) = T(p.x);
-    pm(1,0) = T(p.y);
-    pm(2,0) = 1;
+DescriptorSet::DescriptorSet(Descriptors const &d)
+{
+    reshape(int(d.size()), d.empty() ? 0 : d[0].n);
 
-    MatT<T> projected = MatT<T>::mmult(H, pm);
-    return Point(float(projected(0,0) / projected(2,0)),
-                 float(projected(1,0) / projected(2,0)));
+    for (size_t i = 0; i != d.size(); ++i)
+    {
+        assert(d[i].n == dims());
+        std::copy(d[i].data, d[i].data + d[i].n, row(int(i)));
+        points[i] = d[i].p;
+    }
 }
 
-Point projectPoint(const Mat &H, const Point &p)
+void DescriptorSet::reshape(int count, int dims)
 {
-    return project(H, p);
+    values.reshapePadded(dims, count, 1);
+    points.resize(size_t(count));
 }
 
-Point projectPoint(const Matd &H, const Point &p)
+DescriptorSet DescriptorSet::describe(Mat const &im, std::vector<int> const &indexes)
 {
-    return project(H, p);
-}
+    int w = 5;
+    DescriptorSet d;
+    d.reshape(int(indexes.size()), w * w * im.c);
 
-int modelInliers(const Matd &H, Matches &m, float thresh)
-{
-    // count number of matches that are inliers
-    // i.e. distance(H*p, q) < thresh
-    // Also, sort the matches m so the inliers are the first 'count' elements.
+    parallelFor(0, d.size(), [&](int begin, int end) {
+        for (int k = begin; k != end; ++k)
+        {
+            int i = indexes[size_t(k)];
+            d.points[size_t(k)] = Point(float(i % im.w), float(i / im.w));
+            describePatch(im, i, d.row(k));
+        }
+    });
 
-    Matches inliers;
-    Matches outliers;
+    return d;
+}
 
-    for (Match const &current : m)
+Descriptors DescriptorSet::toDescriptors() const
+{
+    Descriptors d(points.size());
+    for (int i = 0; i != size(); ++i)
     {
-        Point projected = projectPoint(H, current.p);
-        float distance = Point::distance(current.q, projected);
-        if (distance < thresh)
-            inliers.push_back(current);
-        else
-            outliers.push_back(current);
+        Descriptor &current = d[size_t(i)];
+        current.p = points[size_t(i)];
+        current.reshape(dims());
+        std::copy(row(i), row(i) + dims(), current.data);
     }
+    return d;
+}
+
+// A binary test, compares the pixel at offset 1 with the pixel at offset 2.
+struct BinaryTest
+{
+    int x1, y1, x2, y2;
+};
 
-    m.assign(inliers.begin(), inliers.end());
-    std::copy(outliers.begin(), outliers.end(), std::back_inserter(m));
+// Radius of the patch used by the binary descriptors.
+static int const BinaryRadius = 12;
 
-    return int(inliers.size());
+// BRIEF sampling pattern, Bits pairs of offsets within BinaryRadius of the center.
+// offsets are the sum of three uniform values, which roughly follows a gaussian around the center,
+// and come from a fixed seed so descriptors of different runs can be compared.
+static std::vector<BinaryTest> const &binaryPattern()
+{
+    static std::vector<BinaryTest> const pattern = [] {
+        std::mt19937 rng(5489u);
+        auto offset = [&rng]() {
+            int value = 0;
+            for (int i = 0; i != 3; ++i)
+                value += int(rng() % 9u) - 4;
+            return value;
+        };
+
+        std::vector<BinaryTest> tests(static_cast<size_t>(BinaryDescriptorSet::Bits));
+        for (BinaryTest &t : tests)
+            do
+            {
+                t.x1 = offset();
+                t.y1 = offset();
+                t.x2 = offset();
+                t.y2 = offset();
+            } while (t.x1 == t.x2 && t.y1 == t.y2);
+        return tests;
+    }();
+
+    return pattern;
 }
 
-void randomizeMatches(Matches& m) {
-    // Fisher-Yates to shuffle the array.
-    for (size_t i = 0; i != m.size() - 2; ++i){
-        size_t j = i + size_t(rand() % int(m.size() - i));
-        std::swap(m[i], m[j]);
-    }
+void BinaryDescriptorSet::reshape(int count)
+{
+    bits.assign(size_t(count) * size_t(Words), 0);
+    points.resize(size_t(count));
 }
 
-//https://math.stackexchange.com/questions/494238/how-to-compute-homography-matrix-h-from-corresponding-points-2d-2d-planar-homog
-Matd computeHomography(Matches const &matches)
+BinaryDescriptorSet BinaryDescriptorSet::describe(Mat const &im, std::vector<int> const &indexes)
 {
-    size_t n = matches.size();
-    Matd M(8, int(n * 2));
-    Matd b(1, int(n * 2));
+    assert(im.c == 1);
 
-    // fill in the matrices M and b.
-    for (size_t i = 0; i < n; ++i)
-    {
-        double x = double(matches[i].p.x);
-        double xp = double(matches[i].q.x);
+    std::vector<BinaryTest> const &pattern = binaryPattern();
+    int const r = BinaryRadius;
 
-        double y = double(matches[i].p.y);
-        double yp = double(matches[i].q.y);
+    BinaryDescriptorSet d;
+    d.reshape(int(indexes.size()));
+
+    parallelFor(0, d.size(), [&](int begin, int end) {
+        for (int k = begin; k != end; ++k)
+        {
+            int const x = indexes[size_t(k)] % im.w;
+            int const y = indexes[size_t(k)] / im.w;
+            d.points[size_t(k)] = Point(float(x), float(y));
+
+            // only patches touching the border need clamping
+            bool const inside = x >= r && y >= r && x < im.w - r && y < im.h - r;
+
+            uint64_t *out = d.row(k);
+            for (int w = 0; w != Words; ++w)
+            {
+                uint64_t word = 0;
+                for (int b = 0; b != 64; ++b)
+                {
+                    BinaryTest const &t = pattern[size_t(w * 64 + b)];
+                    float v1 = inside ? im.row(y + t.y1)[x + t.x1] : im.getClamp(x + t.x1, y + t.y1, 0);
+                    float v2 = inside ? im.row(y + t.y2)[x + t.x2] : im.getClamp(x + t.x2, y + t.y2, 0);
+                    if (v1 < v2)
+                        word |= uint64_t(1) << b;
+                }
+                out[w] = word;
+            }
+        }
+    });
 
-        int r = int(i * 2);
-        M(r, 0) = x;
-        M(r, 1) = y;
-        M(r, 2) = 1;
-        M(r, 3) = 0;
-        M(r, 4) = 0;
-        M(r, 5) = 0;
-        M(r, 6) = -x * xp;
-        M(r, 7) = -y * xp;
-        b(r, 0) = xp;
+    return d;
+}
 
-        r++;
+int BinaryDescriptorSet::distance(const uint64_t *a, const uint64_t *b)
+{
+    static_assert(Words == 4, "the simd paths handle 256 bits");
+
+#if defined(VS_AVX2)
+    // popcount of every nibble with a lookup table, then byte sums
+    __m256i const table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i const low = _mm256_set1_epi8(0x0f);
+    __m256i const x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)),
+                                       _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+    __m256i const counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, low)),
+                                           _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+    __m256i const sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    __m128i const half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+#elif defined(__POPCNT__)
+    return __builtin_popcountll(a[0] ^ b[0]) + __builtin_popcountll(a[1] ^ b[1]) +
+           __builtin_popcountll(a[2] ^ b[2]) + __builtin_popcountll(a[3] ^ b[3]);
+#elif defined(VS_SSE2)
+    // bit counting in parallel (swar) on 128 bits, then byte sums
+    __m128i const m1 = _mm_set1_epi8(0x55);
+    __m128i const m2 = _mm_set1_epi8(0x33);
+    __m128i const m4 = _mm_set1_epi8(0x0f);
+
+    __m128i counts = _mm_setzero_si128();
+    for (int w = 0; w != Words; w += 2)
+    {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + w)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + w)));
+        x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+        x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+        counts = _mm_add_epi8(counts, x);
+    }
 
-        M(r, 0) = 0;
-        M(r, 1) = 0;
-        M(r, 2) = 0;
-        M(r, 3) = x;
-        M(r, 4) = y;
-        M(r, 5) = 1;
-        M(r, 6) = -x * yp;
-        M(r, 7) = -y * yp;
-        b(r, 0) = yp;
+    __m128i const sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+#else
+    int sum = 0;
+    for (int w = 0; w != Words; ++w)
+    {
+        uint64_t v = a[w] ^ b[w];
+        v = v - ((v >> 1) & 0x5555555555555555ull);
+        v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+        v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        sum += int((v * 0x0101010101010101ull) >> 56);
     }
+    return sum;
+#endif
+}
 
-    Matd a = Matd::llsSolve(M, b);
+Matches matchDescriptors(const Descriptors &a, const Descriptors &b)
+{
+    return matchDescriptors(DescriptorSet(a), DescriptorSet(b));
+}
 
-    // If a solution can't be found, return empty matrix;
-    if (a.size() == 0)
-        return a;
+// Brute force matching compares one query against L1Lanes database descriptors at a time,
+// the database is interleaved so for every dimension the values of L1Lanes consecutive
+// descriptors are contiguous. Each lane still adds its terms in dimension order,
+// which gives the exact same distances as Descriptor::distance.
+static int const L1Lanes = 8;
+static int const L1Queries = 4; // queries sharing each loaded block
+static int const L1CheckStep = 16; // dimensions between early exit checks
 
-    // fill in the homography H based on the result in a.
-    Matd H(3, 3);
+static Mat interleaveDescriptors(DescriptorSet const &d)
+{
+    int const blocks = (d.size() + L1Lanes - 1) / L1Lanes;
 
-    H(0,0) = a(0,0); 
-    H(0,1) = a(1,0); 
-    H(0,2) = a(2,0); 
-    
-    H(1,0) = a(3,0);
-    H(1,1) = a(4,0);
-    H(1,2) = a(5,0);
+    Mat packed;
+    packed.reshapePadded(d.dims() * L1Lanes, blocks, 1);
 
-    H(2,0) = a(6,0);
-    H(2,1) = a(7,0);
-    H(2,2) = 1.0;
+    parallelFor(0, blocks, [&](int begin, int end) {
+        for (int block = begin; block != end; ++block)
+        {
+            float *out = packed.row(block);
+            for (int j = 0; j != L1Lanes; ++j)
+            {
+                int index = block * L1Lanes + j;
+                // missing descriptors at the end are infinitely far away
+                for (int i = 0; i != d.dims(); ++i)
+                    out[i * L1Lanes + j] = (index < d.size()) ? d.row(index)[i] : std::numeric_limits<float>::infinity();
+            }
+        }
+    });
 
-    return H;
+    return packed;
 }
 
-Matd RANSAC(Matches &m, float thresh, int k, int cutoff)
+// Computes the l1 distances between count queries and an interleaved block of descriptors.
+// gives up as soon as no lane can beat the best distance of its query,
+// partial sums only grow so that never changes the result.
+// q: count query rows. best: best distance of each query so far.
+// distances: output - count * L1Lanes distances.
+// returns: false when the block was abandoned.
+static bool l1Block(const float *const *q, int count, const float *block, int dims, const float *best, float *distances)
 {
-    assert(m.size() > 4);
-
-    // RANSAC algorithm.
-    // for k iterations:
-    //     shuffle the matches
-    //     compute a homography with a few matches (how many??)
-    //     if new homography is better than old (how can you tell?):
-    //         compute updated homography using all inliers
-    //         remember it and how good it is
-    //         if it's better than the cutoff:
-    //             return it immediately
-    // if we get to the end return the best homography
-
-    //n – minimum number of data points required to estimate model parameters
-    const int n = 4;
-    int best = 0;
-    Matd Hb;
-    Matches subset;
+#if defined(VS_AVX2)
+    __m256 const sign = _mm256_set1_ps(-0.0f);
+    __m256 acc[L1Queries];
+    for (int k = 0; k != count; ++k)
+        acc[k] = _mm256_setzero_ps();
 
-    int current_iteration = 0;
-    while (current_iteration < k) {
-        current_iteration++;
-
-        randomizeMatches(m);
-        subset.assign(m.begin(), m.begin() + n);
-        Matd H = computeHomography(subset);
-        if (H.size() == 0) {
-            //std::cerr << "Homography is empty" << std::endl;
-            continue;
+    for (int i0 = 0; i0 < dims; i0 += L1CheckStep)
+    {
+        int const i1 = minimum(i0 + L1CheckStep, dims);
+        for (int i = i0; i != i1; ++i)
+        {
+            __m256 const v = _mm256_loadu_ps(block + i * L1Lanes);
+            for (int k = 0; k != count; ++k)
+                acc[k] = _mm256_add_ps(acc[k], _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_set1_ps(q[k][i]), v)));
         }
 
-        int inliers = modelInliers(H, m, thresh);
-        if (inliers <= best)
-            continue;
+        int alive = 0;
+        for (int k = 0; k != count; ++k)
+            alive |= _mm256_movemask_ps(_mm256_cmp_ps(acc[k], _mm256_set1_ps(best[k]), _CMP_LT_OQ));
+        if (!alive)
+            return false;
+    }
 
-        subset.assign(m.begin(), m.begin() + inliers);
-        H = computeHomography(subset);
-        if (H.size() == 0) {
-            std::cerr << "Homography is empty on full inliers" << std::endl;
-            continue;
-        }
+    for (int k = 0; k != count; ++k)
+        _mm256_storeu_ps(distances + k * L1Lanes, acc[k]);
+#elif defined(VS_SSE2)
+    __m128 const sign = _mm_set1_ps(-0.0f);
+    __m128 acc[L1Queries][2];
+    for (int k = 0; k != count; ++k)
+        acc[k][0] = acc[k][1] = _mm_setzero_ps();
 
-        best = inliers;
-        Hb = H;
+    for (int i0 = 0; i0 < dims; i0 += L1CheckStep)
+    {
+        int const i1 = minimum(i0 + L1CheckStep, dims);
+        for (int i = i0; i != i1; ++i)
+        {
+            __m128 const v0 = _mm_loadu_ps(block + i * L1Lanes);
+            __m128 const v1 = _mm_loadu_ps(block + i * L1Lanes + 4);
+            for (int k = 0; k != count; ++k)
+            {
+                __m128 const qv = _mm_set1_ps(q[k][i]);
+                acc[k][0] = _mm_add_ps(acc[k][0], _mm_andnot_ps(sign, _mm_sub_ps(qv, v0)));
+                acc[k][1] = _mm_add_ps(acc[k][1], _mm_andnot_ps(sign, _mm_sub_ps(qv, v1)));
+            }
+        }
 
-        if (best > cutoff) {
-            break;
+        int alive = 0;
+        for (int k = 0; k != count; ++k)
+        {
+            __m128 const limit = _mm_set1_ps(best[k]);
+            alive |= _mm_movemask_ps(_mm_cmplt_ps(acc[k][0], limit)) | _mm_movemask_ps(_mm_cmplt_ps(acc[k][1], limit));
         }
+        if (!alive)
+            return false;
     }
 
-   // std::cout << "Matches: " << m.size() << " Inliers: " << best << " Iters: " << current_iteration<<std::endl;
+    for (int k = 0; k != count; ++k)
+    {
+        _mm_storeu_ps(distances + k * L1Lanes, acc[k][0]);
+        _mm_storeu_ps(distances + k * L1Lanes + 4, acc[k][1]);
+    }
+#else
+    for (int k = 0; k != count * L1Lanes; ++k)
+        distances[k] = 0.0f;
 
-    return Hb;
+    for (int i0 = 0; i0 < dims; i0 += L1CheckStep)
+    {
+        int const i1 = minimum(i0 + L1CheckStep, dims);
+        for (int i = i0; i != i1; ++i)
+            for (int k = 0; k != count; ++k)
+                for (int j = 0; j != L1Lanes; ++j)
+                    distances[k * L1Lanes + j] += fabsf(q[k][i] - block[i * L1Lanes + j]);
+
+        bool alive = false;
+        for (int k = 0; k != count; ++k)
+            for (int j = 0; j != L1Lanes; ++j)
+                alive = alive || (distances[k * L1Lanes + j] < best[k]);
+        if (!alive)
+            return false;
+    }
+#endif
+    return true;
 }
 
-void nonMaxSupression(Mat const &im, Mat &dst, int w)
+Matches matchDescriptors(DescriptorSet const &a, DescriptorSet const &b)
 {
-    // image r = copy_image(im);
-    // perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999)
+    assert(!a.empty() && !b.empty());
+    assert(a.dims() == b.dims());
 
-    dst.reshape(im.w, im.h, 1);
-    dst.fill(im, 0, 0);
+    Mat packed = interleaveDescriptors(b);
+    Matches output(size_t(a.size()));
 
-    const float low_response = std::numeric_limits<float>::min();
-    const int c = 0;
+    // We will have at most a.size matches.
+    int const groups = (a.size() + L1Queries - 1) / L1Queries;
+    parallelFor(0, groups, [&](int begin, int end) {
+        float distances[L1Queries * L1Lanes];
 
-    for (int y = 0; y != im.h; ++y)
-        for (int x = 0; x != im.w; ++x)
+        for (int group = begin; group != end; ++group)
         {
-            float value = im.getClamp(x, y, c);
-            for (int ky = -w; ky <= w && (value > low_response); ++ky)
-                for (int kx = -w; kx <= w && (value > low_response); ++kx)
-                    if (im.getClamp(x + kx, y + ky, c) > value)
-                    {
-                        dst.set(x, y, c, low_response);
-                        value = low_response;
-                    }
+            int const first = group * L1Queries;
+            int const count = minimum(L1Queries, a.size() - first);
+
+            const float *q[L1Queries];
+            float best_distance[L1Queries];
+            int best_index[L1Queries];
+            for (int k = 0; k != count; ++k)
+            {
+                q[k] = a.row(first + k);
+                best_distance[k] = std::numeric_limits<float>::max();
+                best_index[k] = 0;
+            }
+
+            for (int block = 0; block != packed.h; ++block)
+            {
+                if (!l1Block(q, count, packed.row(block), a.dims(), best_distance, distances))
+                    continue;
+
+                // lanes in order, the first of equal distances wins like the sequential loop
+                for (int k = 0; k != count; ++k)
+                    for (int j = 0; j != L1Lanes; ++j)
+                        if (distances[k * L1Lanes + j] < best_distance[k])
+                        {
+                            best_distance[k] = distances[k * L1Lanes + j];
+                            best_index[k] = block * L1Lanes + j;
+                        }
+            }
+
+            for (int k = 0; k != count; ++k)
+            {
+                Match &m = output[size_t(first + k)];
+                m.ai = first + k;
+                m.bi = best_index[k];
+                m.p = a.points[size_t(m.ai)];
+                m.q = b.points[size_t(m.bi)];
+                m.distance = best_distance[k]; // <- should be the smallest L1 distance!
+            }
         }
+    });
+
+    return uniqueMatches(output, size_t(b.size()));
 }
 
-void harrisStructureMatrix(Mat const &im, Mat &S, float sigma)
+Matches matchDescriptors(BinaryDescriptorSet const &a, BinaryDescriptorSet const &b)
 {
-    int size = im.w * im.h;
+    assert(!a.empty() && !b.empty());
 
-    Mat I(im.w, im.h, 3);
-    Mat IxIx = I.channelView(0);
-    Mat IyIy = I.channelView(1);
-    Mat IxIy = I.channelView(2);
-    gradient(im, IxIx, IyIy);
+    Matches output(size_t(a.size()));
 
-    float x, y;
-    for (int i = 0; i != size; ++i)
-    {
-        x = IxIx.data[i];
-        y = IyIy.data[i];
+    // We will have at most a.size matches.
+    parallelFor(0, a.size(), [&](int begin, int end) {
+        for (int ai = begin; ai != end; ++ai)
+        {
+            const uint64_t *query = a.row(ai);
+            int best_distance = std::numeric_limits<int>::max();
+            int best_index = 0;
+
+            for (int bi = 0; bi != b.size(); ++bi)
+            {
+                int distance = BinaryDescriptorSet::distance(query, b.row(bi));
+                if (distance < best_distance)
+                {
+                    best_distance = distance;
+                    best_index = bi;
+                }
+            }
 
-        IxIy.data[i] = x * y;
-        IxIx.data[i] = x * x;
-        IyIy.data[i] = y * y;
-    }
+            Match &m = output[size_t(ai)];
+            m.ai = ai;
+            m.bi = best_index;
+            m.p = a.points[size_t(m.ai)];
+            m.q = b.points[size_t(m.bi)];
+            m.distance = float(best_distance);
+        }
+    });
 
-    S.reshape(im.w, im.h, 3);
-    smoothImage(I, S, sigma);
+    return uniqueMatches(output, size_t(b.size()));
 }
 
-void harrisCornernessResponse(Mat const &s, Mat &R)
+DescriptorIndex::DescriptorIndex(DescriptorSet const &d, int trees)
 {
-    float const alpha = 0.06f;
+    build(d, trees);
+}
 
-    // fill in R, "cornerness" for each pixel using the structure matrix.
-    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
-    //
-    // H() [IxIx, IxIy]
-    //     [IxIy, IyIy]
+DescriptorIndex::DescriptorIndex(Descriptors const &d, int trees)
+{
+    build(d, trees);
+}
 
-    R.reshape(s.w, s.h, 1);
-    for(int i = 0; i != s.w * s.h; ++i) {
-        const float xx = s.data[s.w * s.h * 0 + i];
-        const float yy = s.data[s.w * s.h * 1 + i];
-        const float xy = s.data[s.w * s.h * 2 + i];
+void DescriptorIndex::build(Descriptors const &d, int trees)
+{
+    build(DescriptorSet(d), trees);
+}
+
+void DescriptorIndex::build(DescriptorSet const &d, int trees)
+{
+    assert(trees > 0);
 
-        const float trace = xx + yy;
-        const float det = xx * yy - xy * xy;
-        R.data[i] = det - (alpha * trace * trace);
+    // like any Mat copy, the descriptor values are shared with d
+    m_set = d;
+    m_nodes.clear();
+    m_roots.clear();
+
+    int const count = m_set.size();
+    m_indices.resize(size_t(count) * size_t(trees));
+
+    if (count == 0)
+        return;
+
+    // fixed seed, the same descriptors always give the same index
+    std::mt19937 rng(5489u);
+    for (int t = 0; t != trees; ++t)
+    {
+        int begin = t * count;
+        for (int i = 0; i != count; ++i)
+            m_indices[size_t(begin + i)] = i;
+
+        // shuffle so the first entries of every range are a random sample of it
+        std::shuffle(m_indices.begin() + begin, m_indices.begin() + begin + count, rng);
+        m_roots.push_back(buildNode(begin, begin + count, rng));
     }
 }
 
-float minEigenValue2x2(float a, float b, float c, float d)
+int DescriptorIndex::buildNode(int begin, int end, std::mt19937 &rng)
 {
-    float common = powf(((a + d) * (a + d))/4 - (a * d - b * c), 0.5);
-    float ev_one = (a + d)/2 + common;
-    float ev_two = (a + d)/2 - common;
-    return (ev_one >= ev_two) ? ev_two : ev_one;
+    int const leaf_size = 8;
+    int const samples = 128;
+    int const candidates = 5;
+
+    int const dims = m_set.dims();
+    int node = int(m_nodes.size());
+    m_nodes.push_back(Node());
+
+    if (end - begin <= leaf_size)
+    {
+        m_nodes[size_t(node)].left = begin;
+        m_nodes[size_t(node)].right = end;
+        return node;
+    }
+
+    // mean and variance of every dimension over a sample of the range
+    int n = minimum(end - begin, samples);
+    std::vector<double> mean(size_t(dims), 0.0), variance(size_t(dims), 0.0);
+    for (int i = begin; i != begin + n; ++i)
+    {
+        const float *row = m_set.row(m_indices[size_t(i)]);
+        for (int k = 0; k != dims; ++k)
+            mean[size_t(k)] += double(row[k]);
+    }
+    for (double &value : mean)
+        value /= double(n);
+
+    for (int i = begin; i != begin + n; ++i)
+    {
+        const float *row = m_set.row(m_indices[size_t(i)]);
+        for (int k = 0; k != dims; ++k)
+            variance[size_t(k)] += square(double(row[k]) - mean[size_t(k)]);
+    }
+
+    // split on one of the highest variance dimensions, chosen at random
+    std::vector<int> order(static_cast<size_t>(dims));
+    for (int k = 0; k != dims; ++k)
+        order[size_t(k)] = k;
+
+    int top = minimum(candidates, dims);
+    std::partial_sort(order.begin(), order.begin() + top, order.end(),
+                      [&](int l, int r) { return variance[size_t(l)] > variance[size_t(r)]; });
+
+    int dim = order[size_t(std::uniform_int_distribution<int>(0, top - 1)(rng))];
+    float split = float(mean[size_t(dim)]);
+
+    auto value = [&](int i) { return m_set.row(i)[dim]; };
+    auto first = m_indices.begin() + begin;
+    auto last = m_indices.begin() + end;
+    int middle = int(std::partition(first, last, [&](int i) { return value(i) < split; }) - m_indices.begin());
+
+    // the mean didn't separate anything, fall back to the median
+    if (middle == begin || middle == end)
+    {
+        middle = begin + (end - begin) / 2;
+        std::nth_element(first, m_indices.begin() + middle, last, [&](int l, int r) { return value(l) < value(r); });
+        split = value(m_indices[size_t(middle)]);
+    }
+
+    int left = buildNode(begin, middle, rng);
+    int right = buildNode(middle, end, rng);
+
+    Node &current = m_nodes[size_t(node)];
+    current.dim = dim;
+    current.split = split;
+    current.left = left;
+    current.right = right;
+    return node;
 }
 
-float minEigenValue2x2(Mat const& m) {
-    assert(m.w == 2 && m.h == 2 && m.c == 1);
-    return minEigenValue2x2(m.data[0], m.data[1], m.data[2], m.data[3]);
+// l1 distance that gives up once it reaches limit.
+// the partial sums only grow, so stopping early never changes which distance is the smallest.
+static inline float l1Distance(const float *a, const float *b, int n, float limit)
+{
+    float sum = 0.0f;
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (int k = i; k != i + 8; ++k)
+            sum += fabsf(a[k] - b[k]);
+        if (sum >= limit)
+            return sum;
+    }
+    for (; i != n; ++i)
+        sum += fabsf(a[i] - b[i]);
+    return sum;
 }
 
-void shiTomasiCornernessResponse(Mat const &S, Mat &R)
+int DescriptorIndex::nearest(const float *q, int checks, float &distance) const
 {
-    float multiplier = 9.0f; // try to match harris values for thresholds
+    distance = std::numeric_limits<float>::max();
+    int best = -1;
 
-    R.reshape(S.w, S.h, 1);
-    for (int i = 0; i != S.w * S.h; ++i)
+    int const count = size();
+    if (checks <= 0 || checks >= count)
+    {
+        for (int i = 0; i != count; ++i)
+        {
+            float current = l1Distance(q, m_set.row(i), dims(), distance);
+            if (current < distance)
+            {
+                distance = current;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // per thread scratch, a point is visited in the current query when its stamp equals the epoch
+    thread_local std::vector<unsigned> stamps;
+    thread_local unsigned epoch = 0;
+    thread_local std::vector<std::pair<float, int>> heap;
+
+    if (stamps.size() < size_t(count))
+        stamps.resize(size_t(count), 0);
+    if (++epoch == 0)
+    {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        epoch = 1;
+    }
+
+    // branches to explore, closest lower bound first
+    auto closer = [](std::pair<float, int> const &l, std::pair<float, int> const &r) { return l.first > r.first; };
+    heap.clear();
+    for (int root : m_roots)
+        heap.push_back(std::make_pair(0.0f, root));
+
+    int checked = 0;
+    while (!heap.empty() && checked < checks)
     {
-        const float xx = S.data[S.w * S.h * 0 + i];
-        const float yy = S.data[S.w * S.h * 1 + i];
-        const float xy = S.data[S.w * S.h * 2 + i];
+        std::pop_heap(heap.begin(), heap.end(), closer);
+        std::pair<float, int> branch = heap.back();
+        heap.pop_back();
+
+        if (branch.first >= distance)
+            continue;
+
+        // descend to the closest leaf, remembering the other side of every split
+        Node const *node = &m_nodes[size_t(branch.second)];
+        while (node->dim >= 0)
+        {
+            float diff = q[node->dim] - node->split;
+            int near_child = (diff < 0.0f) ? node->left : node->right;
+            int far_child = (diff < 0.0f) ? node->right : node->left;
+
+            heap.push_back(std::make_pair(branch.first + fabsf(diff), far_child));
+            std::push_heap(heap.begin(), heap.end(), closer);
+            node = &m_nodes[size_t(near_child)];
+        }
 
-        R.data[i] = minEigenValue2x2(xx, xy, xy, yy) * multiplier;
+        for (int i = node->left; i != node->right; ++i)
+        {
+            int index = m_indices[size_t(i)];
+            if (stamps[size_t(index)] == epoch)
+                continue;
+            stamps[size_t(index)] = epoch;
+
+            float current = l1Distance(q, m_set.row(index), dims(), distance);
+            if (current < distance)
+            {
+                distance = current;
+                best = index;
+            }
+            ++checked;
+        }
     }
+
+    return best;
 }
 
-Descriptors harrisCornerDetector(Mat const &im, float sigma, float thresh, int nms, bool shi_tomasi)
+Matches matchDescriptors(const Descriptors &a, DescriptorIndex const &b, int checks)
 {
-    Descriptors d;
-    Mat S, R;
+    return matchDescriptors(DescriptorSet(a), b, checks);
+}
 
-    Mat gray = im;
-    if (gray.c > 1)
-        gray = vs::rgb2gray(gray);
+Matches matchDescriptors(DescriptorSet const &a, DescriptorIndex const &b, int checks)
+{
+    assert(!a.empty() && b.size() > 0);
+    assert(a.dims() == b.dims());
 
-    // Calculate structure matrix
-    harrisStructureMatrix(im, S, sigma);
+    Matches output(size_t(a.size()));
 
-    // Estimate cornerness
-    if (shi_tomasi)
-        shiTomasiCornernessResponse(S, R);
-    else
-        harrisCornernessResponse(S, R);
+    parallelFor(0, a.size(), [&](int begin, int end) {
+        for (int ai = begin; ai != end; ++ai)
+        {
+            Match &m = output[size_t(ai)];
+            m.ai = ai;
+            m.bi = b.nearest(a.row(ai), checks, m.distance);
+            m.p = a.points[size_t(ai)];
+            m.q = b.point(m.bi);
+        }
+    });
 
-    // Run NMS on the responses
-    nonMaxSupression(R, S, nms);
+    return uniqueMatches(output, size_t(b.size()));
+}
 
-    for (int i = 0; i != S.w * S.h; ++i)
-        if (S.data[i] > thresh)
-            d.push_back(Descriptor::describe(gray, i));
+Point projectPoint(const Mat &H, const Point &p)
+{
+    return Mat3(H).project(p);
+}
 
-    return d;
+Point projectPoint(const Matd &H, const Point &p)
+{
+    return Mat3d(H).project(p);
+}
+
+void projectPoints(const Mat3d &H, const float *xs, const float *ys, int n, float *px, float *py)
+{
+    // same operations as Mat3d::project, lane by lane
+    int i = 0;
+
+#ifdef VS_AVX2
+    {
+        __m256d h[9];
+        for (int j = 0; j != 9; ++j)
+            h[j] = _mm256_set1_pd(H.m[j]);
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(xs + i));
+            __m256d y = _mm256_cvtps_pd(_mm_loadu_ps(ys + i));
+            __m256d X = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(h[0], x), _mm256_mul_pd(h[1], y)), h[2]);
+            __m256d Y = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(h[3], x), _mm256_mul_pd(h[4], y)), h[5]);
+            __m256d W = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(h[6], x), _mm256_mul_pd(h[7], y)), h[8]);
+            _mm_storeu_ps(px + i, _mm256_cvtpd_ps(_mm256_div_pd(X, W)));
+            _mm_storeu_ps(py + i, _mm256_cvtpd_ps(_mm256_div_pd(Y, W)));
+        }
+    }
+#endif // VS_AVX2
+
+#ifdef VS_SSE2
+    {
+        __m128d h[9];
+        for (int j = 0; j != 9; ++j)
+            h[j] = _mm_set1_pd(H.m[j]);
+
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128d x = _mm_setr_pd(double(xs[i]), double(xs[i + 1]));
+            __m128d y = _mm_setr_pd(double(ys[i]), double(ys[i + 1]));
+            __m128d X = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[0], x), _mm_mul_pd(h[1], y)), h[2]);
+            __m128d Y = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[3], x), _mm_mul_pd(h[4], y)), h[5]);
+            __m128d W = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[6], x), _mm_mul_pd(h[7], y)), h[8]);
+            _mm_storel_pi(reinterpret_cast<__m64 *>(px + i), _mm_cvtpd_ps(_mm_div_pd(X, W)));
+            _mm_storel_pi(reinterpret_cast<__m64 *>(py + i), _mm_cvtpd_ps(_mm_div_pd(Y, W)));
+        }
+    }
+#endif // VS_SSE2
+
+    for (; i < n; ++i)
+    {
+        Point p = H.project(Point(xs[i], ys[i]));
+        px[i] = p.x;
+        py[i] = p.y;
+    }
+}
+
+// Match coordinates kept as separate arrays (structure of arrays) for scoring homographies.
+struct MatchCoordinates
+{
+    std::vector<float> px, py, qx, qy;
+
+    explicit MatchCoordinates(Matches const &m)
+        : px(m.size()), py(m.size()), qx(m.size()), qy(m.size())
+    {
+        for (size_t i = 0; i != m.size(); ++i)
+        {
+            px[i] = m[i].p.x;
+            py[i] = m[i].p.y;
+            qx[i] = m[i].q.x;
+            qy[i] = m[i].q.y;
+        }
+    }
+
+    int size() const { return int(px.size()); }
+};
+
+// matches scored at once, the projections of a block live on the stack
+static const int ScoreBlock = 64;
+
+// Inlier test of the matches [begin, end) against H, distance(H * p, q) < thresh.
+// end - begin <= ScoreBlock.
+// uint8 *flags: output - 1 for the inliers and 0 for the outliers, indexed from begin. can be null.
+// returns: number of inliers.
+static int scoreBlock(Mat3d const &H, MatchCoordinates const &c, int begin, int end, float thresh, uint8_t *flags)
+{
+    assert(end - begin <= ScoreBlock);
+
+    float hx[ScoreBlock], hy[ScoreBlock];
+    const int count = end - begin;
+    projectPoints(H, c.px.data() + begin, c.py.data() + begin, count, hx, hy);
+
+    const float *qx = c.qx.data() + begin;
+    const float *qy = c.qy.data() + begin;
+    int inliers = 0;
+    int i = 0;
+
+#ifdef VS_SSE2
+    {
+        // same math as Point::distance
+        static const int bits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+        const __m128 t = _mm_set1_ps(thresh);
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128 dx = _mm_sub_ps(_mm_loadu_ps(qx + i), _mm_loadu_ps(hx + i));
+            const __m128 dy = _mm_sub_ps(_mm_loadu_ps(qy + i), _mm_loadu_ps(hy + i));
+            const __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+            const int mask = _mm_movemask_ps(_mm_cmplt_ps(d, t));
+            inliers += bits[mask];
+            if (flags)
+                for (int j = 0; j != 4; ++j)
+                    flags[i + j] = uint8_t((mask >> j) & 1);
+        }
+    }
+#endif // VS_SSE2
+
+    for (; i < count; ++i)
+    {
+        const float dx = qx[i] - hx[i];
+        const float dy = qy[i] - hy[i];
+        const bool inlier = sqrtf(dx * dx + dy * dy) < thresh;
+        inliers += inlier ? 1 : 0;
+        if (flags)
+            flags[i] = uint8_t(inlier);
+    }
+
+    return inliers;
+}
+
+// Number of inliers of H.
+// Blocks of matches are scored until the inliers found plus the matches left can't beat to_beat,
+// then the count so far is returned: any result <= to_beat means H can't beat it.
+// This is only an exact upper bound cutoff, not a statistical test, see RansacParams::pretest for that.
+// int to_beat: -1 scores every match.
+static int scoreHomography(Mat3d const &H, MatchCoordinates const &c, float thresh, int to_beat)
+{
+    const int count = c.size();
+    int inliers = 0;
+    for (int begin = 0; begin < count; begin += ScoreBlock)
+    {
+        const int end = minimum(begin + ScoreBlock, count);
+        inliers += scoreBlock(H, c, begin, end, thresh, nullptr);
+        if (inliers + (count - end) <= to_beat)
+            break;
+    }
+    return inliers;
+}
+
+// Flags the inliers of H.
+// uint8 *flags: output - c.size() values, 1 for the inliers.
+// returns: number of inliers.
+static int flagInliers(Mat3d const &H, MatchCoordinates const &c, float thresh, uint8_t *flags)
+{
+    int inliers = 0;
+    for (int begin = 0; begin < c.size(); begin += ScoreBlock)
+        inliers += scoreBlock(H, c, begin, minimum(begin + ScoreBlock, c.size()), thresh, flags + begin);
+    return inliers;
+}
+
+int modelInliers(const Matd &H, Matches &m, float thresh)
+{
+    return modelInliers(Mat3d(H), m, thresh);
+}
+
+int modelInliers(const Mat3d &H, Matches &m, float thresh)
+{
+    // count number of matches that are inliers
+    // i.e. distance(H*p, q) < thresh
+    // Also, sort the matches m so the inliers are the first 'count' elements.
+
+    MatchCoordinates c(m);
+    std::vector<uint8_t> flags(m.size());
+    const int inliers = flagInliers(H, c, thresh, flags.data());
+
+    // stable partition, inliers and outliers keep their order
+    Matches sorted(m.size());
+    size_t in = 0;
+    size_t out = size_t(inliers);
+    for (size_t i = 0; i != m.size(); ++i)
+        sorted[flags[i] ? in++ : out++] = m[i];
+    m.swap(sorted);
+
+    return inliers;
+}
+
+void randomizeMatches(Matches& m) {
+    // Fisher-Yates to shuffle the array.
+    for (size_t i = 0; i != m.size() - 2; ++i){
+        size_t j = i + size_t(rand() % int(m.size() - i));
+        std::swap(m[i], m[j]);
+    }
+}
+
+// true when a, b and c are (nearly) on a line: the sine of the angle at a is tiny or two points coincide
+static bool collinear(Point const &a, Point const &b, Point const &c)
+{
+    const double abx = double(b.x) - double(a.x), aby = double(b.y) - double(a.y);
+    const double acx = double(c.x) - double(a.x), acy = double(c.y) - double(a.y);
+    const double cross = abx * acy - aby * acx;
+    const double sine = 1e-3;
+    return cross * cross <= sine * sine * (abx * abx + aby * aby) * (acx * acx + acy * acy);
+}
+
+// Projective basis of 4 points, the matrix that maps e1, e2, e3 and (1, 1, 1) to them:
+// B = P * diag(l), with P = [p1 p2 p3] and P * l = p4.
+// returns: false when P is singular or a scale is zero.
+static bool projectiveBasis(Point const *p[4], Mat3d &P, double l[3])
+{
+    P = Mat3d(p[0]->x, p[1]->x, p[2]->x,
+              p[0]->y, p[1]->y, p[2]->y,
+              1.0, 1.0, 1.0);
+    Mat3d inv;
+    if (!P.invert(inv))
+        return false;
+
+    for (int i = 0; i != 3; ++i)
+    {
+        l[i] = inv(i, 0) * double(p[3]->x) + inv(i, 1) * double(p[3]->y) + inv(i, 2);
+        if (l[i] == 0.0)
+            return false;
+    }
+    return true;
+}
+
+bool computeHomography4(Match const *sample, Mat3d &H)
+{
+    Point const *p[4] = {&sample[0].p, &sample[1].p, &sample[2].p, &sample[3].p};
+    Point const *q[4] = {&sample[0].q, &sample[1].q, &sample[2].q, &sample[3].q};
+
+    // any 3 points on a line and the homography is not defined
+    for (int i = 0; i != 4; ++i)
+    {
+        const int a = (i + 1) & 3, b = (i + 2) & 3, c = (i + 3) & 3;
+        if (collinear(*p[a], *p[b], *p[c]) || collinear(*q[a], *q[b], *q[c]))
+            return false;
+    }
+
+    // H = Q * diag(lq) * (P * diag(lp))^-1 = Q * diag(lq / lp) * P^-1
+    Mat3d P, Q, P_inv;
+    double lp[3], lq[3];
+    if (!projectiveBasis(p, P, lp) || !projectiveBasis(q, Q, lq) || !P.invert(P_inv))
+        return false;
+
+    for (int row = 0; row != 3; ++row)
+        for (int col = 0; col != 3; ++col)
+            Q(row, col) *= lq[col] / lp[col];
+
+    H = Mat3d::mmult(Q, P_inv);
+    if (H(2, 2) == 0.0)
+        return false;
+
+    const double s = 1.0 / H(2, 2);
+    for (double &v : H.m)
+        v *= s;
+    H(2, 2) = 1.0;
+    return true;
+}
+
+void HomographyAccumulator::reset()
+{
+    std::fill(&m_ata[0][0], &m_ata[0][0] + 64, 0.0);
+    std::fill(m_atb, m_atb + 8, 0.0);
+    m_count = 0;
+}
+
+//https://math.stackexchange.com/questions/494238/how-to-compute-homography-matrix-h-from-corresponding-points-2d-2d-planar-homog
+void HomographyAccumulator::add(Point const &p, Point const &q)
+{
+    const double x = double(p.x);
+    const double xp = double(q.x);
+
+    const double y = double(p.y);
+    const double yp = double(q.y);
+
+    // the two DLT rows of the match, h22 = 1
+    const double rows[2][8] = {{x, y, 1.0, 0.0, 0.0, 0.0, -x * xp, -y * xp},
+                               {0.0, 0.0, 0.0, x, y, 1.0, -x * yp, -y * yp}};
+    const double b[2] = {xp, yp};
+
+    for (int r = 0; r != 2; ++r)
+    {
+        double const *a = rows[r];
+        for (int i = 0; i != 8; ++i)
+        {
+            if (a[i] == 0.0)
+                continue;
+            for (int j = i; j != 8; ++j)
+                m_ata[i][j] += a[i] * a[j];
+            m_atb[i] += a[i] * b[r];
+        }
+    }
+
+    m_count++;
+}
+
+bool HomographyAccumulator::solve(Mat3d &H) const
+{
+    if (m_count < 4)
+        return false;
+
+    // A^T * A = L * D * L^T, L unit lower triangular
+    double L[8][8];
+    double d[8];
+    for (int j = 0; j != 8; ++j)
+    {
+        double v = m_ata[j][j];
+        for (int k = 0; k != j; ++k)
+            v -= L[j][k] * L[j][k] * d[k];
+
+        // not positive definite, the matches don't pin down a homography
+        if (!(v > m_ata[j][j] * 1e-12))
+            return false;
+        d[j] = v;
+
+        for (int i = j + 1; i != 8; ++i)
+        {
+            double u = m_ata[j][i];
+            for (int k = 0; k != j; ++k)
+                u -= L[i][k] * L[j][k] * d[k];
+            L[i][j] = u / v;
+        }
+    }
+
+    // L * z = A^T * b, then D * L^T * a = z
+    double a[8];
+    for (int i = 0; i != 8; ++i)
+    {
+        double v = m_atb[i];
+        for (int k = 0; k != i; ++k)
+            v -= L[i][k] * a[k];
+        a[i] = v;
+    }
+    for (int i = 7; i >= 0; --i)
+    {
+        double v = a[i] / d[i];
+        for (int k = i + 1; k != 8; ++k)
+            v -= L[k][i] * a[k];
+        a[i] = v;
+    }
+
+    H = Mat3d(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], 1.0);
+    return true;
+}
+
+Matd computeHomography(Matches const &matches)
+{
+    // If a solution can't be found, return empty matrix;
+    Mat3d H;
+    if (matches.size() == 4)
+    {
+        if (!computeHomography4(matches.data(), H))
+            return Matd();
+    }
+    else
+    {
+        HomographyAccumulator accumulator;
+        for (Match const &match : matches)
+            accumulator.add(match);
+        if (!accumulator.solve(H))
+            return Matd();
+    }
+
+    return H.toMat();
+}
+
+// iterations needed to draw an all inlier minimal sample with the given confidence
+// double all_inliers: probability that a sample is all inliers.
+static int ransacIterations(double all_inliers, double confidence, int k)
+{
+    if (confidence >= 1.0 || all_inliers <= 0.0)
+        return k;
+    if (all_inliers >= 1.0)
+        return 1;
+
+    const double needed = std::ceil(std::log(1.0 - confidence) / std::log(1.0 - all_inliers));
+    return (needed < double(k)) ? maximum(int(needed), 1) : k;
+}
+
+// PROSAC sampling (Chum, Matas, "Matching with PROSAC - progressive sample consensus", 2005).
+// Samples are drawn from the n best ranked matches, n grows with the iterations following the
+// growth function of the paper, so after T_N iterations the sampling is the same as RANSAC's.
+class ProsacSampler
+{
+  public:
+    // int count: number of matches, sorted from best to worst.
+    // int m: sample size.
+    // int T_N: iterations after which every match can be drawn.
+    ProsacSampler(int count, int m, int T_N)
+        : m_count(count), m_m(m), m_n(m), m_Tn(double(T_N)), m_Tn_prime(1.0)
+    {
+        // T_m = T_N * prod (m - i) / (N - i)
+        for (int i = 0; i != m; ++i)
+            m_Tn *= double(m - i) / double(count - i);
+    }
+
+    // number of best ranked matches samples are drawn from
+    int pool() const { return m_n; }
+
+    // indices of the sample of iteration t (t = 1, 2, ...), the iterations must be sampled in order
+    void sample(int t, CounterRandom &rng, int *indices)
+    {
+        if (double(t) >= m_Tn_prime && m_n < m_count)
+        {
+            const double Tn_next = m_Tn * double(m_n + 1) / double(m_n + 1 - m_m);
+            m_Tn_prime += std::ceil(Tn_next - m_Tn);
+            m_Tn = Tn_next;
+            m_n++;
+        }
+
+        // the newest match of the pool is in every sample until the pool grows again,
+        // once the growth falls behind the samples come from the whole pool
+        int drawn = 0;
+        int pool = m_n;
+        if (m_Tn_prime >= double(t))
+        {
+            indices[drawn++] = m_n - 1;
+            pool = m_n - 1;
+        }
+
+        while (drawn != m_m)
+        {
+            const int candidate = rng.uniform(pool);
+            if (std::find(indices, indices + drawn, candidate) == indices + drawn)
+                indices[drawn++] = candidate;
+        }
+    }
+
+  private:
+    int m_count;
+    int m_m;
+    int m_n;
+    double m_Tn;
+    double m_Tn_prime;
+};
+
+// PROSAC non randomness: for each n, the fewest inliers among the n best ranked matches that a wrong
+// homography only reaches with probability below psi. Besides the m matches it was fitted to, each
+// match agrees with a wrong homography with probability beta, so the extra inliers are binomial.
+static std::vector<int> prosacMinimumInliers(int count, int m)
+{
+    const double beta = 0.05;
+    const double psi = 0.05;
+
+    std::vector<int> minimum_inliers(size_t(count) + 1, count + 1);
+    for (int n = m + 1; n <= count; ++n)
+    {
+        // smallest j with P(extra >= j) < psi, walking the binomial pmf of n - m trials
+        const int trials = n - m;
+        double log_pmf = double(trials) * std::log(1.0 - beta);
+        double cdf = 0.0;
+        for (int j = 0; j <= trials; ++j)
+        {
+            cdf += std::exp(log_pmf);
+            if (1.0 - cdf < psi)
+            {
+                minimum_inliers[size_t(n)] = m + j + 1;
+                break;
+            }
+            log_pmf += std::log(double(trials - j) / double(j + 1) * beta / (1.0 - beta));
+        }
+    }
+    return minimum_inliers;
+}
+
+// PROSAC termination (maximality): for each n, the probability that a sample of the n best ranked
+// matches is all inliers of H, 0 when n has a random number of inliers.
+// Once the sampling pool grows past n the samples are no longer all drawn from the n best, so only
+// the n at least as large as the pool can stop the search, see RANSAC.
+// coordinates c: matches sorted from best to worst.
+// int *minimum_inliers: see prosacMinimumInliers.
+static std::vector<double> prosacAllInliers(MatchCoordinates const &c, std::vector<int> const &minimum_inliers,
+                                            Mat3d const &H, float thresh, int m)
+{
+    const int count = c.size();
+
+    std::vector<uint8_t> flags(static_cast<size_t>(count));
+    flagInliers(H, c, thresh, flags.data());
+
+    std::vector<double> all_inliers(size_t(count) + 1, 0.0);
+    int inliers = 0;
+    for (int n = 1; n <= count; ++n)
+    {
+        inliers += flags[size_t(n - 1)];
+        if (inliers >= minimum_inliers[size_t(n)])
+            all_inliers[size_t(n)] = std::pow(double(inliers) / double(n), m);
+    }
+
+    return all_inliers;
+}
+
+Matd RANSAC(Matches &m, float thresh, int k, int cutoff)
+{
+    RansacParams params;
+    params.thresh = thresh;
+    params.iterations = k;
+    // any cutoff <= 0 has always stopped at the first model with inliers
+    params.cutoff = maximum(cutoff, 0);
+    params.confidence = 1.0f;
+    return RANSAC(m, params, nullptr);
+}
+
+Matd RANSAC(Matches &m, RansacParams const &params, RansacReport *report)
+{
+    assert(m.size() > 4);
+
+    // RANSAC algorithm.
+    // for k iterations:
+    //     draw a few matches
+    //     compute a homography with them
+    //     if new homography is better than old (how can you tell?):
+    //         compute updated homography using all inliers
+    //         remember it and how good it is
+    //         update k from the inlier ratio
+    //         if it's better than the cutoff:
+    //             return it immediately
+    // if we get to the end return the best homography
+    //
+    // The hypotheses are drawn and scored in batches over the thread pool. Iteration t draws from
+    // its own random stream (params.seed, t), and the batch results are taken in iteration order,
+    // exactly like a serial loop would, so the result does not depend on the number of threads.
+    // Hypotheses of a batch past the point where the loop stops are discarded.
+
+    //n – minimum number of data points required to estimate model parameters
+    const int n = 4;
+    const int count = int(m.size());
+    const float thresh = params.thresh;
+    const int cutoff = params.cutoff;
+    const bool prosac = params.sampling == RansacProsac;
+    // the pre-test matches are drawn outside of the sample, which always passes
+    const int pretest = clampTo(params.pretest, 0, minimum(RansacMaxPretest, count - n));
+    const int batch_size = 16 * getConcurrency();
+    int k = params.iterations;
+    int best = 0;
+    double all_inliers = 0.0;
+    Matd Hb;
+    HomographyAccumulator refit;
+
+    // samples are drawn from the matches in their original order, prosac needs it to be the ranking
+    const Matches sorted = m;
+    const MatchCoordinates coordinates(sorted);
+    std::vector<uint8_t> flags(sorted.size());
+
+    std::vector<int> minimum_inliers;
+    std::vector<double> prosac_all_inliers; // per pool size, see prosacAllInliers
+    std::vector<int> prosac_k;              // iterations needed, for any n >= pool size
+    ProsacSampler sampler(count, n, maximum(params.iterations, 1));
+    int pool = sampler.pool();
+    if (prosac)
+    {
+        minimum_inliers = prosacMinimumInliers(count, n);
+        prosac_k.assign(size_t(count) + 2, k);
+    }
+
+    auto limit = [&]() { return prosac ? prosac_k[size_t(pool)] : k; };
+
+    struct Hypothesis
+    {
+        int sample[n];
+        int check[RansacMaxPretest]; // matches of the pre-test
+        int pool = 0;
+        Mat3d H;
+        bool valid = false;
+        int inliers = 0;
+    };
+    std::vector<Hypothesis> batch;
+
+    int current_iteration = 0;
+    bool done = false;
+    while (!done && current_iteration < limit()) {
+        // hypotheses that can't beat the best at the start of the batch stop scoring early,
+        // the ones kept have an exact count so the outcome is the same as a full scoring
+        const int to_beat = best;
+
+        // draw the samples in order, the prosac pool grows with the iterations
+        batch.resize(size_t(minimum(batch_size, limit() - current_iteration)));
+        for (size_t b = 0; b != batch.size(); ++b)
+        {
+            const int t = current_iteration + int(b) + 1;
+            CounterRandom rng(params.seed, uint64_t(t));
+            Hypothesis &h = batch[b];
+            if (prosac)
+            {
+                sampler.sample(t, rng, h.sample);
+                h.pool = sampler.pool();
+            }
+            else
+            {
+                for (int drawn = 0; drawn != n;)
+                {
+                    const int candidate = rng.uniform(count);
+                    if (std::find(h.sample, h.sample + drawn, candidate) == h.sample + drawn)
+                        h.sample[drawn++] = candidate;
+                }
+                h.pool = pool;
+            }
+            for (int drawn = 0; drawn != pretest;)
+            {
+                const int candidate = rng.uniform(count);
+                if (std::find(h.sample, h.sample + n, candidate) == h.sample + n &&
+                    std::find(h.check, h.check + drawn, candidate) == h.check + drawn)
+                    h.check[drawn++] = candidate;
+            }
+        }
+
+        parallelFor(0, int(batch.size()), [&](int b_begin, int b_end) {
+            Match local[n];
+            for (int b = b_begin; b != b_end; ++b)
+            {
+                Hypothesis &h = batch[size_t(b)];
+                for (int i = 0; i != n; ++i)
+                    local[i] = sorted[size_t(h.sample[i])];
+
+                h.valid = computeHomography4(local, h.H);
+                h.inliers = 0;
+                if (!h.valid)
+                    continue;
+
+                // Td,d: most bad hypotheses fail on a few random matches, without scoring all of them
+                bool passed = true;
+                for (int i = 0; i != pretest && passed; ++i)
+                {
+                    Match const &check = sorted[size_t(h.check[i])];
+                    passed = Point::distance(h.H.project(check.p), check.q) < thresh;
+                }
+                if (passed)
+                    h.inliers = scoreHomography(h.H, coordinates, thresh, to_beat);
+            }
+        });
+
+        for (Hypothesis const &h : batch)
+        {
+            if (current_iteration >= limit()) {
+                done = true;
+                break;
+            }
+            current_iteration++;
+            pool = h.pool;
+
+            if (!h.valid || h.inliers <= best)
+                continue;
+
+            const int inliers = flagInliers(h.H, coordinates, thresh, flags.data());
+            refit.reset();
+            for (size_t i = 0; i != sorted.size(); ++i)
+                if (flags[i])
+                    refit.add(sorted[i]);
+            Mat3d H;
+            if (!refit.solve(H)) {
+                std::cerr << "Homography is empty on full inliers" << std::endl;
+                continue;
+            }
+
+            // the refit usually gathers more inliers than the sample it comes from, keep the better one
+            const int refit_inliers = scoreHomography(H, coordinates, thresh, -1);
+            if (refit_inliers >= inliers)
+            {
+                best = refit_inliers;
+                Hb = H.toMat();
+            }
+            else
+            {
+                best = inliers;
+                Hb = h.H.toMat();
+            }
+
+            // a hypothesis of an all inlier sample still has to pass the pre-test
+            const double pretest_pass = std::pow(double(best) / double(count), pretest);
+            if (prosac)
+            {
+                prosac_all_inliers = prosacAllInliers(coordinates, minimum_inliers, Mat3d(Hb), thresh, n);
+                for (double &p : prosac_all_inliers)
+                    p *= pretest_pass;
+                for (int i = count; i >= 0; --i)
+                    prosac_k[size_t(i)] = minimum(prosac_k[size_t(i) + 1],
+                                                  ransacIterations(prosac_all_inliers[size_t(i)], params.confidence, k));
+            }
+            else
+            {
+                all_inliers = std::pow(double(best) / double(count), n) * pretest_pass;
+                k = ransacIterations(all_inliers, params.confidence, params.iterations);
+            }
+
+            if (cutoff >= 0 && best > cutoff) {
+                done = true;
+                break;
+            }
+        }
+    }
+
+    if (prosac)
+        for (size_t i = size_t(pool); i < prosac_all_inliers.size(); ++i)
+            all_inliers = maximum(all_inliers, prosac_all_inliers[i]);
+
+    // bring the inliers of the winner to the front
+    if (Hb.size() != 0)
+        modelInliers(Hb, m, thresh);
+
+    if (report)
+    {
+        report->iterations = current_iteration;
+        report->inliers = best;
+        report->confidence = 1.0 - std::pow(1.0 - all_inliers, double(current_iteration));
+    }
+
+    return Hb;
+}
+
+// Running maximum over windows of 2w + 1 values, truncated at the borders (van Herk / Gil-Werman).
+// The values are split in blocks of 2w + 1, every window covers the tail of one block and the head
+// of the next, so each output is the max of a suffix max and a prefix max: 3 max per value for any w.
+// Each position holds lanes consecutive floats, filtered independently.
+// float *src: n positions, src_step floats apart.
+// float *dst: output - n positions, dst_step floats apart.
+// float *g, *h: scratch, room for (n + 4w) * lanes floats.
+static void runningMax(const float *src, ptrdiff_t src_step, float *dst, ptrdiff_t dst_step,
+                       int n, int lanes, int w, float *g, float *h)
+{
+    const int k = 2 * w + 1;
+    const int size = ((n + 2 * w + k - 1) / k) * k; // padded with w lowest values on both sides
+    const float lowest = -std::numeric_limits<float>::infinity();
+
+    for (int j = 0; j != size; ++j)
+    {
+        const int i = j - w;
+        float *gj = g + ptrdiff_t(j) * lanes;
+        if (i < 0 || i >= n)
+        {
+            if (j % k == 0)
+                std::fill(gj, gj + lanes, lowest);
+            else
+                std::copy(gj - lanes, gj, gj);
+        }
+        else
+        {
+            const float *f = src + i * src_step;
+            if (j % k == 0)
+                std::copy(f, f + lanes, gj);
+            else
+                for (int l = 0; l != lanes; ++l)
+                    gj[l] = std::max(gj[l - lanes], f[l]);
+        }
+    }
+
+    for (int j = size - 1; j >= 0; --j)
+    {
+        const int i = j - w;
+        float *hj = h + ptrdiff_t(j) * lanes;
+        if (i < 0 || i >= n)
+        {
+            if ((j + 1) % k == 0)
+                std::fill(hj, hj + lanes, lowest);
+            else
+                std::copy(hj + lanes, hj + 2 * lanes, hj);
+        }
+        else
+        {
+            const float *f = src + i * src_step;
+            if ((j + 1) % k == 0)
+                std::copy(f, f + lanes, hj);
+            else
+                for (int l = 0; l != lanes; ++l)
+                    hj[l] = std::max(hj[l + lanes], f[l]);
+        }
+    }
+
+    for (int i = 0; i != n; ++i)
+    {
+        const float *hi = h + ptrdiff_t(i) * lanes;
+        const float *gi = g + ptrdiff_t(i + 2 * w) * lanes;
+        float *d = dst + i * dst_step;
+        for (int l = 0; l != lanes; ++l)
+            d[l] = std::max(hi[l], gi[l]);
+    }
+}
+
+void nonMaxSupression(Mat const &im, Mat &dst, int w)
+{
+    // perform NMS on the response map.
+    // for every pixel in the image:
+    //     if a neighbor within w has a greater response:
+    //         set response to be very low
+    //
+    // The window maximum is separable, a running max along the rows followed by a running max
+    // along the columns gives the max of the (2w + 1)^2 window with a cost that does not depend on w.
+    // Clamping at the borders only repeats pixels already inside the window, so the truncated
+    // window has the same maximum.
+
+    assert(&im != &dst);
+    w = std::max(w, 0);
+
+    const float low_response = std::numeric_limits<float>::min();
+    const int strip = 64;
+
+    dst.reshape(im.w, im.h, 1);
+    Mat rows(im.w, im.h, 1);
+
+    parallelFor(0, im.h, [&](int y_begin, int y_end) {
+        std::vector<float> g(size_t(im.w + 4 * w)), h(g.size());
+        for (int y = y_begin; y != y_end; ++y)
+            runningMax(im.row(y, 0), 1, rows.row(y), 1, im.w, 1, w, g.data(), h.data());
+    });
+
+    parallelFor(0, (im.w + strip - 1) / strip, [&](int s_begin, int s_end) {
+        std::vector<float> g(size_t(im.h + 4 * w) * strip), h(g.size());
+        for (int s = s_begin; s != s_end; ++s)
+        {
+            const int x0 = s * strip;
+            const int lanes = std::min(strip, im.w - x0);
+            runningMax(rows.row(0) + x0, rows.stride, dst.row(0) + x0, dst.stride, im.h, lanes, w, g.data(), h.data());
+
+            for (int y = 0; y != im.h; ++y)
+            {
+                const float *value = im.row(y, 0) + x0;
+                float *d = dst.row(y) + x0;
+                for (int x = 0; x != lanes; ++x)
+                    d[x] = (value[x] > low_response && d[x] > value[x]) ? low_response : value[x];
+            }
+        }
+    });
+}
+
+void harrisStructureMatrix(Mat const &im, Mat &S, float sigma)
+{
+    Mat I(im.w, im.h, 3);
+    Mat IxIx = I.channelView(0);
+    Mat IyIy = I.channelView(1);
+    Mat IxIy = I.channelView(2);
+    gradient(im, IxIx, IyIy);
+
+    parallelFor(0, im.h, [&](int y_begin, int y_end) {
+        float x, y;
+        for (int j = y_begin; j != y_end; ++j)
+        {
+            float *xx = IxIx.row(j);
+            float *yy = IyIy.row(j);
+            float *xy = IxIy.row(j);
+            for (int i = 0; i != im.w; ++i)
+            {
+                x = xx[i];
+                y = yy[i];
+
+                xy[i] = x * y;
+                xx[i] = x * x;
+                yy[i] = y * y;
+            }
+        }
+    }, 8);
+
+    S.reshape(im.w, im.h, 3);
+    smoothImage(I, S, sigma);
+}
+
+void harrisCornernessResponse(Mat const &s, Mat &R)
+{
+    float const alpha = 0.06f;
+
+    // fill in R, "cornerness" for each pixel using the structure matrix.
+    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
+    //
+    // H() [IxIx, IxIy]
+    //     [IxIy, IyIy]
+
+    R.reshape(s.w, s.h, 1);
+    for (int y = 0; y != s.h; ++y) {
+        const float *s_xx = s.row(y, 0);
+        const float *s_yy = s.row(y, 1);
+        const float *s_xy = s.row(y, 2);
+        float *r = R.row(y);
+        for (int x = 0; x != s.w; ++x) {
+            const float xx = s_xx[x];
+            const float yy = s_yy[x];
+            const float xy = s_xy[x];
+
+            const float trace = xx + yy;
+            const float det = xx * yy - xy * xy;
+            r[x] = det - (alpha * trace * trace);
+        }
+    }
+}
+
+float minEigenValue2x2(float a, float b, float c, float d)
+{
+    float common = sqrtf(((a + d) * (a + d))/4 - (a * d - b * c));
+    float ev_one = (a + d)/2 + common;
+    float ev_two = (a + d)/2 - common;
+    return (ev_one >= ev_two) ? ev_two : ev_one;
+}
+
+float minEigenValue2x2(Mat const& m) {
+    assert(m.w == 2 && m.h == 2 && m.c == 1);
+    return minEigenValue2x2(m.get(0, 0), m.get(1, 0), m.get(0, 1), m.get(1, 1));
+}
+
+void shiTomasiCornernessResponse(Mat const &S, Mat &R)
+{
+    float multiplier = 9.0f; // try to match harris values for thresholds
+
+    R.reshape(S.w, S.h, 1);
+    for (int y = 0; y != S.h; ++y)
+    {
+        const float *s_xx = S.row(y, 0);
+        const float *s_yy = S.row(y, 1);
+        const float *s_xy = S.row(y, 2);
+        float *r = R.row(y);
+        for (int x = 0; x != S.w; ++x)
+        {
+            const float xx = s_xx[x];
+            const float yy = s_yy[x];
+            const float xy = s_xy[x];
+
+            r[x] = minEigenValue2x2(xx, xy, xy, yy) * multiplier;
+        }
+    }
+}
+
+// sobel gradients of one row, added over all the channels like gradient() does.
+// The taps are added in the same order as convolve, skipping the zero ones, so the values are the same.
+static void sobelRow(Mat const &im, int y, float *gx, float *gy)
+{
+    const int w = im.w;
+
+    std::fill(gx, gx + w, 0.0f);
+    std::fill(gy, gy + w, 0.0f);
+
+    for (int k = 0; k != im.c; ++k)
+    {
+        const float *r0 = im.row(clampTo(y - 1, 0, im.h - 1), k);
+        const float *r1 = im.row(y, k);
+        const float *r2 = im.row(clampTo(y + 1, 0, im.h - 1), k);
+
+        auto pixel = [&](int x, int l, int r) {
+            float vx = gx[x];
+            vx += -r0[l];
+            vx += r0[r];
+            vx += -2.0f * r1[l];
+            vx += 2.0f * r1[r];
+            vx += -r2[l];
+            vx += r2[r];
+            gx[x] = vx;
+
+            float vy = gy[x];
+            vy += -r0[l];
+            vy += -2.0f * r0[x];
+            vy += -r0[r];
+            vy += r2[l];
+            vy += 2.0f * r2[x];
+            vy += r2[r];
+            gy[x] = vy;
+        };
+
+        pixel(0, 0, minimum(1, w - 1));
+        for (int x = 1; x < w - 1; ++x)
+            pixel(x, x - 1, x + 1);
+        if (w > 1)
+            pixel(w - 1, w - 2, w - 1);
+    }
+}
+
+// one row convolved with a 1d filter of k taps, clamped at the borders like convolve.
+static void gaussianRow(const float *src, float *dst, int w, const float *g, int k)
+{
+    const int r = k / 2;
+    const int x_begin = minimum(r, w);
+    const int x_end = maximum(x_begin, w - r);
+
+    auto border = [&](int x) {
+        float value = 0.0f;
+        for (int fx = 0; fx != k; ++fx)
+            value += src[clampTo(x + fx - r, 0, w - 1)] * g[fx];
+        dst[x] = value;
+    };
+
+    for (int x = 0; x != x_begin; ++x)
+        border(x);
+
+    std::fill(dst + x_begin, dst + x_end, 0.0f);
+    for (int fx = 0; fx != k; ++fx)
+    {
+        const float *s = src + fx - r;
+        const float f = g[fx];
+        for (int x = x_begin; x < x_end; ++x)
+            dst[x] += s[x] * f;
+    }
+
+    for (int x = x_end; x < w; ++x)
+        border(x);
+}
+
+void cornernessResponse(Mat const &im, Mat &R, float sigma, bool shi_tomasi)
+{
+    // Each band of output rows keeps a ring of the last k rows of the horizontally smoothed
+    // structure matrix (Ix^2, Iy^2, IxIy). Every new image row goes through gradient, products
+    // and the horizontal gaussian straight into the ring, then the vertical gaussian and the
+    // response are computed for the output row. Only a few rows per thread are ever live.
+    // The operations are the ones of harrisStructureMatrix and the response functions, in the
+    // same order, so the responses are the same.
+
+    const int w = im.w;
+    const int h = im.h;
+    float const alpha = 0.06f;
+    float const multiplier = 9.0f; // see shiTomasiCornernessResponse
+
+    Mat filter = makeGaussianFilter1D(sigma);
+    const int k = filter.w;
+    const int r = k / 2;
+    const float *g = filter.data;
+
+    R.reshape(w, h, 1);
+
+    parallelFor(0, h, [&](int y_begin, int y_end) {
+        const size_t row = size_t(w);
+        std::vector<float> ring(size_t(k) * 3 * row);
+        std::vector<float> gx(row), gy(row), xx(row), yy(row), xy(row);
+
+        // ring slot of a source row, the rows needed by one output row are k consecutive ones
+        auto slot = [&](int y, int c) { return ring.data() + (size_t(y % k) * 3 + size_t(c)) * row; };
+
+        int next = maximum(y_begin - r, 0);
+        for (int y = y_begin; y != y_end; ++y)
+        {
+            for (const int last = minimum(y + r, h - 1); next <= last; ++next)
+            {
+                sobelRow(im, next, gx.data(), gy.data());
+                for (int x = 0; x != w; ++x)
+                {
+                    const float vx = gx[size_t(x)];
+                    const float vy = gy[size_t(x)];
+                    xy[size_t(x)] = vx * vy;
+                    xx[size_t(x)] = vx * vx;
+                    yy[size_t(x)] = vy * vy;
+                }
+                gaussianRow(xx.data(), slot(next, 0), w, g, k);
+                gaussianRow(yy.data(), slot(next, 1), w, g, k);
+                gaussianRow(xy.data(), slot(next, 2), w, g, k);
+            }
+
+            // vertical gaussian, reusing the product rows as accumulators
+            float *sums[3] = {xx.data(), yy.data(), xy.data()};
+            for (int c = 0; c != 3; ++c)
+            {
+                float *acc = sums[c];
+                std::fill(acc, acc + w, 0.0f);
+                for (int fy = 0; fy != k; ++fy)
+                {
+                    const float *src = slot(clampTo(y + fy - r, 0, h - 1), c);
+                    const float f = g[fy];
+                    for (int x = 0; x != w; ++x)
+                        acc[x] += src[x] * f;
+                }
+            }
+
+            float *dst = R.row(y);
+            if (shi_tomasi)
+            {
+                for (int x = 0; x != w; ++x)
+                    dst[x] = minEigenValue2x2(xx[size_t(x)], xy[size_t(x)], xy[size_t(x)], yy[size_t(x)]) * multiplier;
+            }
+            else
+            {
+                for (int x = 0; x != w; ++x)
+                {
+                    const float trace = xx[size_t(x)] + yy[size_t(x)];
+                    const float det = xx[size_t(x)] * yy[size_t(x)] - xy[size_t(x)] * xy[size_t(x)];
+                    dst[x] = det - (alpha * trace * trace);
+                }
+            }
+        }
+    }, 32);
+}
+
+// strongest first, ties in raster order
+static void sortByResponse(Mat const &response, std::vector<int> &indexes)
+{
+    std::sort(indexes.begin(), indexes.end(), [&](int a, int b) {
+        float ra = response.data[a], rb = response.data[b];
+        return ra > rb || (ra == rb && a < b);
+    });
+}
+
+// keeps the strongest corners of each cell, then tops up or trims to the budget with the best of the rest
+static void selectGridCorners(Mat const &response, std::vector<int> &indexes, int count, int grid)
+{
+    grid = maximum(grid, 1);
+    const int cells = grid * grid;
+    const int quota = (count + cells - 1) / cells;
+
+    sortByResponse(response, indexes);
+
+    std::vector<int> used(size_t(cells), 0);
+    std::vector<int> selected, rest;
+    for (int i : indexes)
+    {
+        const int cx = (i % response.w) * grid / response.w;
+        const int cy = (i / response.w) * grid / response.h;
+        int &n = used[size_t(cy * grid + cx)];
+        if (n < quota)
+        {
+            selected.push_back(i);
+            n++;
+        }
+        else
+        {
+            rest.push_back(i);
+        }
+    }
+
+    // both lists are still sorted by response
+    if (int(selected.size()) > count)
+        selected.resize(size_t(count));
+    for (size_t i = 0; i != rest.size() && int(selected.size()) < count; ++i)
+        selected.push_back(rest[i]);
+
+    indexes.swap(selected);
+}
+
+// Adaptive non-maximal suppression (Brown, Szeliski, Winder 2005).
+// The suppression radius of a corner is the distance to the closest stronger corner,
+// the corners with the largest radius are kept. The corners are visited strongest first and
+// inserted in a bucket grid, so finding the closest stronger corner searches rings of buckets
+// around the corner until the ring is farther than the closest one found.
+static void selectAdaptiveCorners(Mat const &response, std::vector<int> &indexes, int count)
+{
+    const int w = response.w;
+    const int n = int(indexes.size());
+
+    sortByResponse(response, indexes);
+
+    // about 2 corners per bucket
+    const int cell = maximum(4, int(std::sqrt(2.0f * float(w) * float(response.h) / float(n))));
+    const int gw = (w + cell - 1) / cell;
+    const int gh = (response.h + cell - 1) / cell;
+    std::vector<std::vector<int>> buckets(size_t(gw * gh));
+
+    const float unbounded = std::numeric_limits<float>::max();
+    std::vector<float> radius(static_cast<size_t>(n));
+    for (int k = 0; k != n; ++k)
+    {
+        const int x = indexes[size_t(k)] % w;
+        const int y = indexes[size_t(k)] / w;
+        const int cx = x / cell;
+        const int cy = y / cell;
+
+        float best = unbounded;
+        const int rings = maximum(cx, gw - 1 - cx, cy, gh - 1 - cy);
+        for (int r = 0; r <= rings; ++r)
+        {
+            // corners of ring r are at least (r - 1) * cell away
+            const float near = float((r - 1) * cell);
+            if (r > 0 && near * near >= best)
+                break;
+
+            for (int by = maximum(cy - r, 0); by <= minimum(cy + r, gh - 1); ++by)
+            {
+                // the first and last rows of the ring are full, the others only have both ends
+                const bool edge = absolute(by - cy) == r;
+                const int step = (edge || r == 0) ? 1 : 2 * r;
+                for (int bx = cx - r; bx <= cx + r; bx += step)
+                {
+                    if (bx < 0 || bx >= gw)
+                        continue;
+                    for (int j : buckets[size_t(by * gw + bx)])
+                    {
+                        const float dx = float(j % w - x);
+                        const float dy = float(j / w - y);
+                        best = minimum(best, dx * dx + dy * dy);
+                    }
+                }
+            }
+        }
+
+        radius[size_t(k)] = best;
+        buckets[size_t(cy * gw + cx)].push_back(indexes[size_t(k)]);
+    }
+
+    // largest radius first, stronger first on ties
+    std::vector<int> order(static_cast<size_t>(n));
+    for (int k = 0; k != n; ++k)
+        order[size_t(k)] = k;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return radius[size_t(a)] > radius[size_t(b)]; });
+
+    std::vector<int> selected(static_cast<size_t>(count));
+    for (int k = 0; k != count; ++k)
+        selected[size_t(k)] = indexes[size_t(order[size_t(k)])];
+    indexes.swap(selected);
+}
+
+void selectCorners(Mat const &response, std::vector<int> &indexes, KeypointBudget const &budget)
+{
+    assert(response.c == 1 && response.stride == response.w);
+
+    if (budget.mode == BudgetNone || budget.count <= 0 || int(indexes.size()) <= budget.count)
+        return;
+
+    if (budget.mode == BudgetGrid)
+        selectGridCorners(response, indexes, budget.count, budget.grid);
+    else
+        selectAdaptiveCorners(response, indexes, budget.count);
+
+    std::sort(indexes.begin(), indexes.end());
+}
+
+// Runs the harris detector and returns the indexes of the corners.
+// gray - output: the image converted to gray, the one to describe.
+static std::vector<int> harrisCornerIndexes(Mat const &im, Mat &gray, float sigma, float thresh, int nms, bool shi_tomasi,
+                                            KeypointBudget const &budget)
+{
+    std::vector<int> indexes;
+    Mat S, R;
+
+    gray = im;
+    if (gray.c > 1)
+        gray = vs::rgb2gray(gray);
+
+    // Estimate cornerness
+    cornernessResponse(im, R, sigma, shi_tomasi);
+
+    // Run NMS on the responses
+    nonMaxSupression(R, S, nms);
+
+    for (int i = 0; i != S.w * S.h; ++i)
+        if (S.data[i] > thresh)
+            indexes.push_back(i);
+
+    selectCorners(S, indexes, budget);
+    return indexes;
+}
+
+static void describeCorners(Mat const &gray, std::vector<int> const &indexes, Descriptors &d)
+{
+    d.clear();
+    for (int i : indexes)
+        d.push_back(Descriptor::describe(gray, i));
+}
+
+static void describeCorners(Mat const &gray, std::vector<int> const &indexes, DescriptorSet &d)
+{
+    d = DescriptorSet::describe(gray, indexes);
+}
+
+static void describeCorners(Mat const &gray, std::vector<int> const &indexes, BinaryDescriptorSet &d)
+{
+    // single pixel comparisons need a smoothed image to be stable
+    d = BinaryDescriptorSet::describe(smoothImage(gray, 2.0f), indexes);
+}
+
+Descriptors harrisCornerDetector(Mat const &im, float sigma, float thresh, int nms, bool shi_tomasi)
+{
+    Descriptors d;
+    Mat gray;
+    std::vector<int> indexes = harrisCornerIndexes(im, gray, sigma, thresh, nms, shi_tomasi, KeypointBudget());
+    describeCorners(gray, indexes, d);
+    return d;
+}
+
+void harrisCornerDetector(Mat const &im, DescriptorSet &d, float sigma, float thresh, int nms, bool shi_tomasi)
+{
+    Mat gray;
+    std::vector<int> indexes = harrisCornerIndexes(im, gray, sigma, thresh, nms, shi_tomasi, KeypointBudget());
+    describeCorners(gray, indexes, d);
+}
+
+void harrisCornerDetector(Mat const &im, BinaryDescriptorSet &d, float sigma, float thresh, int nms, bool shi_tomasi)
+{
+    Mat gray;
+    std::vector<int> indexes = harrisCornerIndexes(im, gray, sigma, thresh, nms, shi_tomasi, KeypointBudget());
+    describeCorners(gray, indexes, d);
+}
+
+// true when mask, a ring of 16 bits, has arc contiguous bits set
+static inline bool hasArc(unsigned mask, int arc)
+{
+    unsigned ring = mask | (mask << 16);
+    unsigned run = ring;
+    for (int k = 1; k != arc; ++k)
+        run &= ring >> k;
+    return run != 0;
+}
+
+void fastCornerScore(Mat const &im, Mat &score, float thresh, int arc)
+{
+    assert(im.c == 1);
+    assert(arc >= 9 && arc <= 12);
+
+    score.reshape(im.w, im.h, 1);
+    score.zero();
+
+    // bresenham circle of radius 3, clockwise from the top
+    static const int cx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+    static const int cy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+    int offsets[16];
+    for (int k = 0; k != 16; ++k)
+        offsets[k] = cy[k] * im.stride + cx[k];
+
+    // any arc covers at least arc / 4 of the compass pixels (0, 4, 8, 12)
+    int const compass = arc / 4;
+
+    parallelFor(3, maximum(im.h - 3, 3), [&](int y_begin, int y_end) {
+        for (int y = y_begin; y != y_end; ++y)
+        {
+            const float *row = im.row(y);
+            float *out = score.row(y);
+
+            for (int x = 3; x < im.w - 3; ++x)
+            {
+                const float *p = row + x;
+                float const hi = p[0] + thresh;
+                float const lo = p[0] - thresh;
+
+                // high speed test
+                float const n = p[offsets[0]], e = p[offsets[4]], s = p[offsets[8]], w = p[offsets[12]];
+                int brighter = int(n > hi) + int(e > hi) + int(s > hi) + int(w > hi);
+                int darker = int(n < lo) + int(e < lo) + int(s < lo) + int(w < lo);
+                if (brighter < compass && darker < compass)
+                    continue;
+
+                // full segment test
+                unsigned bright_mask = 0, dark_mask = 0;
+                float bright_sum = 0.0f, dark_sum = 0.0f;
+                for (int k = 0; k != 16; ++k)
+                {
+                    float v = p[offsets[k]];
+                    if (v > hi)
+                    {
+                        bright_mask |= 1u << k;
+                        bright_sum += v - hi;
+                    }
+                    else if (v < lo)
+                    {
+                        dark_mask |= 1u << k;
+                        dark_sum += lo - v;
+                    }
+                }
+
+                // the score is the sum of the side that forms the arc
+                const bool bright = hasArc(bright_mask, arc);
+                const bool dark = hasArc(dark_mask, arc);
+                if (bright && dark)
+                    out[x] = maximum(bright_sum, dark_sum);
+                else if (bright)
+                    out[x] = bright_sum;
+                else if (dark)
+                    out[x] = dark_sum;
+            }
+        }
+    });
+}
+
+// Runs the FAST detector and returns the indexes of the corners.
+// gray - output: the image converted to gray, the one to describe.
+static std::vector<int> fastCornerIndexes(Mat const &im, Mat &gray, float thresh, int nms, int arc, KeypointBudget const &budget)
+{
+    std::vector<int> indexes;
+    Mat score, S;
+
+    gray = im;
+    if (gray.c > 1)
+        gray = vs::rgb2gray(gray);
+
+    fastCornerScore(gray, score, thresh, arc);
+
+    // Run NMS on the scores, suppressed pixels get the lowest positive value
+    nonMaxSupression(score, S, nms);
+
+    for (int i = 0; i != S.w * S.h; ++i)
+        if (S.data[i] > std::numeric_limits<float>::min())
+            indexes.push_back(i);
+
+    selectCorners(S, indexes, budget);
+    return indexes;
+}
+
+Descriptors fastCornerDetector(Mat const &im, float thresh, int nms, int arc)
+{
+    Descriptors d;
+    Mat gray;
+    std::vector<int> indexes = fastCornerIndexes(im, gray, thresh, nms, arc, KeypointBudget());
+    describeCorners(gray, indexes, d);
+    return d;
+}
+
+template <typename Set>
+static void detectCornersInto(Mat const &im, Set &d, CornerDetector detector, float sigma, float thresh, int nms,
+                              KeypointBudget const &budget)
+{
+    Mat gray;
+    std::vector<int> indexes = (detector == FastCorners) ? fastCornerIndexes(im, gray, thresh, nms, 9, budget)
+                                                         : harrisCornerIndexes(im, gray, sigma, thresh, nms, true, budget);
+    describeCorners(gray, indexes, d);
+}
+
+Descriptors detectCorners(Mat const &im, CornerDetector detector, float sigma, float thresh, int nms, KeypointBudget const &budget)
+{
+    Descriptors d;
+    detectCornersInto(im, d, detector, sigma, thresh, nms, budget);
+    return d;
+}
+
+void detectCorners(Mat const &im, DescriptorSet &d, CornerDetector detector, float sigma, float thresh, int nms,
+                   KeypointBudget const &budget)
+{
+    detectCornersInto(im, d, detector, sigma, thresh, nms, budget);
+}
+
+void detectCorners(Mat const &im, BinaryDescriptorSet &d, CornerDetector detector, float sigma, float thresh, int nms,
+                   KeypointBudget const &budget)
+{
+    detectCornersInto(im, d, detector, sigma, thresh, nms, budget);
 }
 
 } // namespace vs
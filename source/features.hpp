@@ -30,6 +30,70 @@ struct Descriptor
 };
 using Descriptors = std::vector<Descriptor>;
 
+// The descriptors of an image stored together (structure of arrays).
+// matrix values: one row per descriptor. rows are padded so each one starts on an aligned boundary
+//                and the padding is zero.
+// point *points: x,y coordinates of each descriptor.
+struct DescriptorSet
+{
+    Mat values;
+    std::vector<Point> points;
+
+    DescriptorSet() = default;
+    // copies a descriptor array, all descriptors must have the same size
+    explicit DescriptorSet(Descriptors const& d);
+
+    // allocates room for count descriptors of dims values
+    void reshape(int count, int dims);
+
+    int size() const { return int(points.size()); }
+    int dims() const { return values.w; }
+    bool empty() const { return points.empty(); }
+
+    float* row(int i) { return values.row(i); }
+    const float* row(int i) const { return values.row(i); }
+
+    // Create feature descriptors for a list of indexes in an image, see Descriptor::describe.
+    // image im: source image.
+    // int *indexes: indexes in image for the pixels we want to describe.
+    // returns: descriptors for those indexes.
+    static DescriptorSet describe(Mat const& im, std::vector<int> const& indexes);
+
+    // converts back to a descriptor array
+    Descriptors toDescriptors() const;
+};
+
+// Binary descriptors of an image (BRIEF style).
+// Each descriptor is 256 intensity comparisons between pairs of pixels of a smoothed patch,
+// one bit per comparison. They are compared with the hamming distance (xor + popcount).
+// uint64 *bits: Words 64 bit words per descriptor.
+// point *points: x,y coordinates of each descriptor.
+struct BinaryDescriptorSet
+{
+    static const int Bits = 256;
+    static const int Words = Bits / 64;
+
+    std::vector<uint64_t> bits;
+    std::vector<Point> points;
+
+    void reshape(int count);
+
+    int size() const { return int(points.size()); }
+    bool empty() const { return points.empty(); }
+
+    uint64_t* row(int i) { return bits.data() + size_t(i) * Words; }
+    const uint64_t* row(int i) const { return bits.data() + size_t(i) * Words; }
+
+    // Create binary descriptors for a list of indexes in an image.
+    // image im: 1 channel image, already smoothed (the tests are very sensitive to noise).
+    // int *indexes: indexes in image for the pixels we want to describe.
+    // returns: descriptors for those indexes.
+    static BinaryDescriptorSet describe(Mat const& im, std::vector<int> const& indexes);
+
+    // number of different bits between two descriptors
+    static int distance(const uint64_t* a, const uint64_t* b);
+};
+
 // A match between two points in an image.
 // point p, q: x,y coordinates of the two matching pixels.
 // int ai, bi: indexes in the descriptor array. For eliminating duplicates.
@@ -48,6 +112,66 @@ using Matches = std::vector<Match>;
 // returns: best matches found. each descriptor in a should match with at most
 //          one other descriptor in b.
 Matches matchDescriptors(Descriptors const& a, Descriptors const& b);
+Matches matchDescriptors(DescriptorSet const& a, DescriptorSet const& b);
+Matches matchDescriptors(BinaryDescriptorSet const& a, BinaryDescriptorSet const& b);
+
+// Approximate nearest neighbour index over the descriptors of one image.
+// Randomized kd-forest: each tree splits on one of the highest variance dimensions picked at random,
+// queries descend all the trees together and visit the closest unexplored branches first.
+// Build it once per image and query it with the descriptors of any number of other images.
+class DescriptorIndex
+{
+  public:
+    DescriptorIndex() = default;
+    explicit DescriptorIndex(DescriptorSet const& d, int trees = 4);
+    explicit DescriptorIndex(Descriptors const& d, int trees = 4);
+
+    // Builds the index. A DescriptorSet is shared, like a Mat copy, and must not change while the index is used.
+    // Descriptors are first gathered into a set of their own.
+    // descriptor *d: descriptors to index, all with the same size.
+    // int trees: number of randomized trees. more trees find the true neighbour more often.
+    void build(DescriptorSet const& d, int trees = 4);
+    void build(Descriptors const& d, int trees = 4);
+
+    // Finds the approximate nearest neighbour of a descriptor using l1 distance.
+    // float *q: query values, dims() floats.
+    // int checks: maximum number of descriptors to compare against. this is the recall/speed knob.
+    //             checks <= 0 compares against every descriptor (exact search).
+    // float distance: output - l1 distance to the neighbour.
+    // returns: index of the neighbour in the indexed descriptors, -1 if the index is empty.
+    int nearest(const float* q, int checks, float& distance) const;
+
+    int size() const { return m_set.size(); }
+    int dims() const { return m_set.dims(); }
+    Point const& point(int i) const { return m_set.points[size_t(i)]; }
+
+  private:
+    // inner nodes split on dim, leaves have dim = -1 and index the range [left, right) of m_indices
+    struct Node
+    {
+        int dim = -1;
+        float split = 0.0f;
+        int left = 0;
+        int right = 0;
+    };
+
+    int buildNode(int begin, int end, std::mt19937& rng);
+
+    DescriptorSet m_set;
+    std::vector<Node> m_nodes;
+    std::vector<int> m_roots;
+    std::vector<int> m_indices;
+};
+
+// Finds approximate best matches between descriptors and an index built over another image.
+// descriptor *a: descriptors to match.
+// index b: index over the descriptors of the other image.
+// int checks: maximum number of distances evaluated per descriptor, see DescriptorIndex::nearest.
+//             checks <= 0 gives the same result as the brute force matchDescriptors.
+// returns: best matches found. each descriptor in a should match with at most
+//          one other descriptor in b.
+Matches matchDescriptors(Descriptors const& a, DescriptorIndex const& b, int checks = 128);
+Matches matchDescriptors(DescriptorSet const& a, DescriptorIndex const& b, int checks = 128);
 
 // Count number of inliers in a set of matches. Should also bring inliers to the front of the array.
 // matrix H: homography between coordinate systems.
@@ -57,6 +181,7 @@ Matches matchDescriptors(Descriptors const& a, Descriptors const& b);
 //          their match in the other image. Should also rearrange matches
 //          so that the inliers are first in the array. For drawing.
 int modelInliers(Matd const& H, Matches& m, float thresh);
+int modelInliers(Mat3d const& H, Matches& m, float thresh);
 
 // Randomly shuffle matches for RANSAC.
 // Fisher-Yate
@@ -69,14 +194,91 @@ void randomizeMatches(Matches& m);
 // returns: matrix representing homography H that maps image a to image b.
 Matd computeHomography(Matches const& matches);
 
+// Computes the homography of a minimal sample of 4 matches, without allocating.
+// Maps the 4 points of each image to the canonical projective basis, H = Bq * Bp^-1.
+// match *sample: the 4 matches.
+// homography H: output - homography that maps image a to image b, H(2,2) = 1.
+// returns: false when the sample is degenerate, 3 of the points are (nearly) collinear in either image.
+bool computeHomography4(Match const* sample, Mat3d& H);
+
+// Least squares homography over any number of matches, without allocating.
+// Each match adds its two DLT rows to the fixed 8x8 normal equations, solve() factors them with LDL^T.
+class HomographyAccumulator
+{
+  public:
+    HomographyAccumulator() { reset(); }
+
+    void reset();
+
+    // point p, q: a match, p in image a and q in image b.
+    void add(Point const& p, Point const& q);
+    void add(Match const& m) { add(m.p, m.q); }
+
+    int count() const { return m_count; }
+
+    // homography H: output - least squares homography, H(2,2) = 1.
+    // returns: false with less than 4 matches or when the system is singular.
+    bool solve(Mat3d& H) const;
+
+  private:
+    double m_ata[8][8]; // upper triangle of A^T * A
+    double m_atb[8];
+    int m_count;
+};
+
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
 // match *m: set of matches.
 // float thresh: inlier/outlier distance threshold.
 // int k: number of iterations to run.
-// int cutoff: inlier cutoff to exit early.
+// int cutoff: inlier cutoff to exit early, <= 0 stops at the first model with inliers.
 // returns: matrix representing most common homography between matches.
 Matd RANSAC(Matches& m, float thresh, int k, int cutoff);
 
+// How RANSAC draws its samples.
+enum RansacSampling
+{
+    RansacUniform, // uniformly from all the matches
+    RansacProsac   // PROSAC: from a pool of the best ranked matches that grows with the iterations.
+                   // the matches must be sorted from best to worst, like matchDescriptors returns them.
+};
+
+// Settings of a RANSAC run.
+struct RansacParams
+{
+    float thresh = 2.0f;      // inlier/outlier distance threshold
+    int iterations = 10000;   // maximum number of iterations
+    int cutoff = -1;          // exit as soon as a homography has more inliers than cutoff, < 0 disables it
+    float confidence = 0.99f; // exit once an all inlier sample was drawn with this probability, >= 1 disables it
+    RansacSampling sampling = RansacUniform;
+    int pretest = 0;          // Td,d pre-test: a hypothesis is only scored when this many random matches outside
+                              // its sample are all its inliers. clamped to [0, RansacMaxPretest]. 0 disables it. Typical: 1
+    uint64_t seed = 10;       // the same seed gives the same result, whatever the number of threads
+};
+
+static const int RansacMaxPretest = 4;
+
+// What a RANSAC run did.
+struct RansacReport
+{
+    int iterations = 0;      // iterations used
+    int inliers = 0;         // inliers of the returned homography
+    double confidence = 0.0; // probability that one of the samples drawn was all inliers, for the inlier ratio found
+};
+
+// RANSAC with adaptive termination.
+// Hypotheses are drawn and scored in parallel. Each iteration has its own random stream derived
+// from params.seed, so runs are reproducible and several can run at the same time.
+// Each time a better homography is found the number of iterations needed is updated from its inlier
+// ratio w: an all inlier sample of 4 matches is drawn with probability w^4, so after
+// N = log(1 - confidence) / log(1 - w^4) iterations one was drawn with the given confidence.
+// params.iterations stays an upper bound.
+// With PROSAC sampling w is taken over the n best ranked matches, for the n that needs the fewest
+// iterations among the ones with more inliers than a wrong homography would find by chance.
+// match *m: set of matches. returned with the inliers of the homography first.
+// report: output - iterations used, inliers and confidence reached. can be null.
+// returns: matrix representing most common homography between matches, empty if none was found.
+Matd RANSAC(Matches& m, RansacParams const& params, RansacReport* report = nullptr);
+
 // Apply a projective transformation to a point.
 // matrix H: homography to project point.
 // point p: point to project.
@@ -84,6 +286,13 @@ Matd RANSAC(Matches& m, float thresh, int k, int cutoff);
 Point projectPoint(Mat const& H, Point const& p);
 Point projectPoint(Matd const& H, Point const& p);
 
+// Apply a projective transformation to many points at once.
+// Coordinates are kept in separate x and y arrays (structure of arrays) so the math vectorizes.
+// matrix H: homography to project the points.
+// xs, ys: n input coordinates.
+// px, py: output - n projected coordinates, they can be the same arrays as xs, ys.
+void projectPoints(Mat3d const& H, const float* xs, const float* ys, int n, float* px, float* py);
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
@@ -112,6 +321,16 @@ void harrisCornernessResponse(Mat const& S, Mat& R);
 // image r: output - a response map of cornerness calculations.
 void shiTomasiCornernessResponse(Mat const& S, Mat& R);
 
+// Calculate the cornerness of each pixel in a single pass over the image.
+// Same result as harrisStructureMatrix followed by harrisCornernessResponse or shiTomasiCornernessResponse,
+// but gradients, products, gaussian window and response are computed for a few rows at a time
+// and the structure matrix is never stored.
+// image im: the input image, the gradients of all channels are added.
+// image R: output - a response map of cornerness calculations.
+// float sigma: std dev. to use for weighted sum.
+// shi_tomasi : use shi tomasi variant
+void cornernessResponse(Mat const& im, Mat& R, float sigma, bool shi_tomasi = true);
+
 // Perform harris corner detection and extract features from the corners.
 // image im: input image.
 // float sigma: std. dev for harris.
@@ -120,5 +339,70 @@ void shiTomasiCornernessResponse(Mat const& S, Mat& R);
 // shi_tomasi : use shi tomasi variant
 // returns: array of descriptors of the corners in the image.
 Descriptors harrisCornerDetector(Mat const& im, float sigma, float thresh, int nms, bool shi_tomasi = true);
+// same as above, writing the descriptors straight into a descriptor set.
+void harrisCornerDetector(Mat const& im, DescriptorSet& d, float sigma, float thresh, int nms, bool shi_tomasi = true);
+// same as above, describing the corners with binary descriptors.
+void harrisCornerDetector(Mat const& im, BinaryDescriptorSet& d, float sigma, float thresh, int nms, bool shi_tomasi = true);
+
+// How the corners are limited when there are too many of them.
+enum BudgetMode
+{
+    BudgetNone,    // keep every corner
+    BudgetGrid,    // split the image in grid x grid cells and keep the strongest corners of each cell
+    BudgetAdaptive // adaptive non-maximal suppression: keep the corners that are the strongest over the largest radius
+};
+
+// A keypoint budget: bounds the number of corners and spreads them over the image,
+// so the cost of matching and RANSAC does not depend on the texture of the image.
+struct KeypointBudget
+{
+    BudgetMode mode = BudgetNone;
+    int count = 0; // maximum number of corners, <= 0 keeps every corner
+    int grid = 8;  // cells per side for BudgetGrid
+};
+
+// Reduces a set of corners to a keypoint budget.
+// image response: 1 channel response map, larger is stronger.
+// int *indexes: input/output - pixel indexes of the corners, returned in increasing order.
+// budget: maximum number of corners and how to choose them.
+void selectCorners(Mat const& response, std::vector<int>& indexes, KeypointBudget const& budget);
+
+// Calculate the FAST corner score of each pixel (features from accelerated segment test).
+// A pixel is a corner when arc contiguous pixels of the 16 pixel circle of radius 3 around it
+// are all brighter than center + thresh or all darker than center - thresh.
+// The 4 compass pixels of the circle are tested first, that rejects most pixels.
+// image im: 1 channel image.
+// float thresh: intensity difference, images are in [0, 1]. Typical: 0.05-0.15
+// int arc: number of contiguous pixels, 9 (FAST-9) to 12 (FAST-12).
+// image score: output - sum of the differences beyond thresh on the corner side, 0 for non corners.
+void fastCornerScore(Mat const& im, Mat& score, float thresh, int arc = 9);
+
+// Perform FAST corner detection and extract features from the corners.
+// image im: input image.
+// float thresh: intensity difference for the segment test. Typical: 0.05-0.15
+// int nms: distance to look for larger scores.
+// int arc: number of contiguous pixels, 9 (FAST-9) to 12 (FAST-12).
+// returns: array of descriptors of the corners in the image.
+Descriptors fastCornerDetector(Mat const& im, float thresh, int nms, int arc = 9);
+
+// Corner detectors that produce features.
+enum CornerDetector
+{
+    HarrisCorners, // harrisCornerDetector, thresh is the cornerness threshold
+    FastCorners    // fastCornerDetector (FAST-9), thresh is the intensity difference, sigma is not used
+};
+
+// Detects corners with the chosen detector and describes them.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for the detector.
+// int nms: distance to look for local-maxes in the response map.
+// budget: limits the number of corners, see selectCorners.
+Descriptors detectCorners(Mat const& im, CornerDetector detector, float sigma, float thresh, int nms,
+                          KeypointBudget const& budget = KeypointBudget());
+void detectCorners(Mat const& im, DescriptorSet& d, CornerDetector detector, float sigma, float thresh, int nms,
+                   KeypointBudget const& budget = KeypointBudget());
+void detectCorners(Mat const& im, BinaryDescriptorSet& d, CornerDetector detector, float sigma, float thresh, int nms,
+                   KeypointBudget const& budget = KeypointBudget());
 
 } // namespace vs
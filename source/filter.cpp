@@ -98,30 +98,270 @@ Mat makeGaussianFilter1D(float sigma)
     return dst;
 }
 
-void smoothImage(vs::Mat const& src, vs::Mat& dst, vs::Mat& tmp, float sigma) {
+//
+// Recursive gaussian
+// I. T. Young, L. J. van Vliet, "Recursive implementation of the Gaussian filter", 1995
+//
+// A causal 3rd order filter runs forward and the same filter runs backwards over its output:
+// w[n] = B x[n] + b1 w[n-1] + b2 w[n-2] + b3 w[n-3]
+// y[n] = B w[n] + b1 y[n+1] + b2 y[n+2] + b3 y[n+3]
+//
+// Borders replicate the edge value like the clamped convolution does.
+// The forward pass starts from the steady state of the first value, the backward pass
+// starts from the exact state given by B. Triggs, M. Sdika,
+// "Boundary conditions for Young - van Vliet recursive filtering", 2006
+//
+struct RecursiveGaussian
+{
+    float B;
+    float b1;
+    float b2;
+    float b3;
+    float M[9]; // backward pass initialization
+};
+
+static RecursiveGaussian makeRecursiveGaussian(float sigma)
+{
+    assert(sigma >= 0.5f);
+
+    double const s = double(sigma);
+    double const q = (s >= 2.5) ? 0.98711 * s - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * s);
+    double const q2 = q * q;
+    double const q3 = q2 * q;
+
+    double const b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double const a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    double const a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    double const a3 = (0.422205 * q3) / b0;
+    double const B = 1.0 - (a1 + a2 + a3);
+
+    RecursiveGaussian g;
+    g.B = float(B);
+    g.b1 = float(a1);
+    g.b2 = float(a2);
+    g.b3 = float(a3);
+
+    // the scale by B is folded in, since our causal pass already includes it
+    double const m = B / ((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3));
+    g.M[0] = float(m * (-a3 * a1 + 1.0 - a3 * a3 - a2));
+    g.M[1] = float(m * (a3 + a1) * (a2 + a3 * a1));
+    g.M[2] = float(m * a3 * (a1 + a3 * a2));
+    g.M[3] = float(m * (a1 + a3 * a2));
+    g.M[4] = float(-m * (a2 - 1.0) * (a2 + a3 * a1));
+    g.M[5] = float(-m * a3 * (a3 * a1 + a3 * a3 + a2 - 1.0));
+    g.M[6] = float(m * (a3 * a1 + a2 + a1 * a1 - a2 * a2));
+    g.M[7] = float(m * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3));
+    g.M[8] = float(m * a3 * (a1 + a3 * a2));
+    return g;
+}
+
+// backward pass state at the end of a signal of length n: y[n-1], y[n], y[n+1]
+// w1, w2, w3: last forward values w[n-1], w[n-2], w[n-3]. last: the last input value x[n-1]
+static inline void recursiveGaussianEnd(RecursiveGaussian const &g, float w1, float w2, float w3, float last,
+                                        float &y1, float &y2, float &y3)
+{
+    float const u1 = w1 - last;
+    float const u2 = w2 - last;
+    float const u3 = w3 - last;
+    y1 = g.M[0] * u1 + g.M[1] * u2 + g.M[2] * u3 + last;
+    y2 = g.M[3] * u1 + g.M[4] * u2 + g.M[5] * u3 + last;
+    y3 = g.M[6] * u1 + g.M[7] * u2 + g.M[8] * u3 + last;
+}
+
+// filters a single row
+static void recursiveGaussianRow(const float *in, float *out, int w, RecursiveGaussian const &g)
+{
+    float w1 = in[0], w2 = in[0], w3 = in[0];
+    for (int x = 0; x != w; ++x)
+    {
+        float v = g.B * in[x] + g.b1 * w1 + g.b2 * w2 + g.b3 * w3;
+        w3 = w2;
+        w2 = w1;
+        w1 = v;
+        out[x] = v;
+    }
+
+    float y1, y2, y3;
+    recursiveGaussianEnd(g, out[w - 1], out[w - 2], out[w - 3], in[w - 1], y1, y2, y3);
+    out[w - 1] = y1;
+
+    for (int x = w - 2; x >= 0; --x)
+    {
+        float v = g.B * out[x] + g.b1 * y1 + g.b2 * y2 + g.b3 * y3;
+        y3 = y2;
+        y2 = y1;
+        y1 = v;
+        out[x] = v;
+    }
+}
+
+#ifdef VS_SSE2
+// filters 4 rows at once, one per simd lane. same operations as recursiveGaussianRow
+static void recursiveGaussianRow4(const float *const *in, float *const *out, int w, RecursiveGaussian const &g)
+{
+    const __m128 B = _mm_set1_ps(g.B);
+    const __m128 b1 = _mm_set1_ps(g.b1);
+    const __m128 b2 = _mm_set1_ps(g.b2);
+    const __m128 b3 = _mm_set1_ps(g.b3);
+
+    float lanes[4];
+
+    __m128 w1 = _mm_setr_ps(in[0][0], in[1][0], in[2][0], in[3][0]);
+    __m128 w2 = w1;
+    __m128 w3 = w1;
+    for (int x = 0; x != w; ++x)
+    {
+        __m128 v = _mm_setr_ps(in[0][x], in[1][x], in[2][x], in[3][x]);
+        v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(B, v), _mm_mul_ps(b1, w1)), _mm_mul_ps(b2, w2)), _mm_mul_ps(b3, w3));
+        w3 = w2;
+        w2 = w1;
+        w1 = v;
+
+        _mm_storeu_ps(lanes, v);
+        out[0][x] = lanes[0];
+        out[1][x] = lanes[1];
+        out[2][x] = lanes[2];
+        out[3][x] = lanes[3];
+    }
+
+    float e1[4], e2[4], e3[4];
+    for (int i = 0; i != 4; ++i)
+    {
+        recursiveGaussianEnd(g, out[i][w - 1], out[i][w - 2], out[i][w - 3], in[i][w - 1], e1[i], e2[i], e3[i]);
+        out[i][w - 1] = e1[i];
+    }
+
+    __m128 y1 = _mm_loadu_ps(e1);
+    __m128 y2 = _mm_loadu_ps(e2);
+    __m128 y3 = _mm_loadu_ps(e3);
+    for (int x = w - 2; x >= 0; --x)
+    {
+        __m128 v = _mm_setr_ps(out[0][x], out[1][x], out[2][x], out[3][x]);
+        v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(B, v), _mm_mul_ps(b1, y1)), _mm_mul_ps(b2, y2)), _mm_mul_ps(b3, y3));
+        y3 = y2;
+        y2 = y1;
+        y1 = v;
+
+        _mm_storeu_ps(lanes, v);
+        out[0][x] = lanes[0];
+        out[1][x] = lanes[1];
+        out[2][x] = lanes[2];
+        out[3][x] = lanes[3];
+    }
+}
+#endif // VS_SSE2
+
+// filters every row, rows are independent
+static void recursiveGaussianRows(Mat const &src, Mat &dst, RecursiveGaussian const &g)
+{
+    assert(src.w >= 3);
+    dst.reshape(src.w, src.h, src.c);
+
+    parallelFor(0, src.h, [&](int y_begin, int y_end) {
+        for (int k = 0; k != src.c; ++k)
+        {
+            int y = y_begin;
+
+#ifdef VS_SSE2
+            for (; y + 4 <= y_end; y += 4)
+            {
+                const float *in[4] = {src.row(y, k), src.row(y + 1, k), src.row(y + 2, k), src.row(y + 3, k)};
+                float *out[4] = {dst.row(y, k), dst.row(y + 1, k), dst.row(y + 2, k), dst.row(y + 3, k)};
+                recursiveGaussianRow4(in, out, src.w, g);
+            }
+#endif // VS_SSE2
+
+            for (; y != y_end; ++y)
+                recursiveGaussianRow(src.row(y, k), dst.row(y, k), src.w, g);
+        }
+    });
+}
+
+// filters every column, a band of columns is processed together walking down the rows
+// so the loops over x are contiguous and vectorize
+static void recursiveGaussianColumns(Mat const &src, Mat &dst, RecursiveGaussian const &g)
+{
+    assert(src.h >= 3);
+    dst.reshape(src.w, src.h, src.c);
+
+    parallelFor(0, src.w, [&](int x_begin, int x_end) {
+        int const h = src.h;
+        int const n = x_end - x_begin;
+
+        // backward state for the two rows below the image
+        std::vector<float> below1(static_cast<size_t>(n));
+        std::vector<float> below2(static_cast<size_t>(n));
+
+        for (int k = 0; k != src.c; ++k)
+        {
+            // forward, rows above the image repeat the first row
+            const float *first = src.row(0, k) + x_begin;
+            for (int y = 0; y != h; ++y)
+            {
+                const float *in = src.row(y, k) + x_begin;
+                const float *w1 = (y >= 1) ? dst.row(y - 1, k) + x_begin : first;
+                const float *w2 = (y >= 2) ? dst.row(y - 2, k) + x_begin : first;
+                const float *w3 = (y >= 3) ? dst.row(y - 3, k) + x_begin : first;
+                float *out = dst.row(y, k) + x_begin;
+
+                for (int x = 0; x != n; ++x)
+                    out[x] = g.B * in[x] + g.b1 * w1[x] + g.b2 * w2[x] + g.b3 * w3[x];
+            }
+
+            // backward
+            const float *last = src.row(h - 1, k) + x_begin;
+            float *w1 = dst.row(h - 1, k) + x_begin;
+            const float *w2 = dst.row(h - 2, k) + x_begin;
+            const float *w3 = dst.row(h - 3, k) + x_begin;
+            for (int x = 0; x != n; ++x)
+                recursiveGaussianEnd(g, w1[x], w2[x], w3[x], last[x], w1[x], below1[size_t(x)], below2[size_t(x)]);
+
+            for (int y = h - 2; y >= 0; --y)
+            {
+                const float *y1 = dst.row(y + 1, k) + x_begin;
+                const float *y2 = (y + 2 < h) ? dst.row(y + 2, k) + x_begin : below1.data();
+                const float *y3 = (y + 3 < h) ? dst.row(y + 3, k) + x_begin : (y + 3 == h) ? below1.data() : below2.data();
+                float *out = dst.row(y, k) + x_begin;
+
+                for (int x = 0; x != n; ++x)
+                    out[x] = g.B * out[x] + g.b1 * y1[x] + g.b2 * y2[x] + g.b3 * y3[x];
+            }
+        }
+    }, 64);
+}
+
+void smoothImage(vs::Mat const& src, vs::Mat& dst, vs::Mat& tmp, float sigma, SmoothMode const mode) {
     //
     // expensive way, convolve with 2d gaussian filter
     //
     //Mat f = vs::makeGaussianFilter(sigma);
     //convolve(src, dst, f);
 
+    if (mode == GaussianIIR && sigma >= 0.5f && src.w >= 3 && src.h >= 3)
+    {
+        RecursiveGaussian g = makeRecursiveGaussian(sigma);
+        recursiveGaussianRows(src, tmp, g);
+        recursiveGaussianColumns(tmp, dst, g);
+        return;
+    }
+
     //
     // faster convolve with 1d horizontal filter and then with the vertical filter
     //
     Mat f = makeGaussianFilter1D(sigma);
     convolve(src, tmp, f);
-    std::swap(f.w, f.h);
-    convolve(tmp, dst, f);
+    Mat fv(f.h, f.w, 1, f.data); // same values as a column
+    convolve(tmp, dst, fv);
 }
 
-void smoothImage(vs::Mat const& src, vs::Mat& dst, float sigma) {
+void smoothImage(vs::Mat const& src, vs::Mat& dst, float sigma, SmoothMode const mode) {
     Mat tmp;
-    smoothImage(src, dst, tmp, sigma);
+    smoothImage(src, dst, tmp, sigma, mode);
 }
 
-vs::Mat smoothImage(vs::Mat const& src, float sigma) {
+vs::Mat smoothImage(vs::Mat const& src, float sigma, SmoothMode const mode) {
     Mat output;
-    smoothImage(src, output, sigma);
+    smoothImage(src, output, sigma, mode);
     return output;
 }
 
@@ -148,33 +388,31 @@ void gradientSingleChannel(const Mat &src, Mat &gx, Mat &gy)
     assert(src.c == 1);
 
     float* f;
-    Mat filter(3, 1, 1);
+    Mat horizontal(3, 1, 1);
+    Mat vertical(1, 3, 1);
     Mat tmp;
 
     //
-    // gy
+    // gx
     //
-    f = filter.data;
+    f = horizontal.data;
     (*f++) = -1.0f; (*f++) =  0.0f; (*f++) =  1.0f;
-    convolve(src, tmp, filter);
+    convolve(src, tmp, horizontal);
 
-    std::swap(filter.w, filter.h);
-    f = filter.data;
+    f = vertical.data;
     (*f++) =  1.0f; (*f++) =  2.0f; (*f++) =  1.0f;
-    convolve(tmp, gx, filter);
+    convolve(tmp, gx, vertical);
 
     //
     // gy
     //
-    std::swap(filter.w, filter.h);
-    f = filter.data;
+    f = horizontal.data;
     (*f++) =  1.0f; (*f++) =  2.0f; (*f++) =  1.0f;
-    convolve(src, tmp, filter);
+    convolve(src, tmp, horizontal);
 
-    std::swap(filter.w, filter.h);
-    f = filter.data;
+    f = vertical.data;
     (*f++) = -1.0f; (*f++) =  0.0f; (*f++) =  1.0f;
-    convolve(tmp, gy, filter);
+    convolve(tmp, gy, vertical);
 }
 
 void gradient(vs::Mat const& src, vs::Mat& gx, vs::Mat& gy) {
@@ -198,63 +436,178 @@ void gradientMagnitudeAngle(const Mat &src, Mat &mag, Mat &theta)
     mag.reshape(src.w, src.h, 1);
     theta.reshape(src.w, src.h, 1);
 
-    for (int i = 0; i != gx.w * gx.h; ++i)
+    for (int y = 0; y != gx.h; ++y)
     {
-        float gx_v = gx.data[i];
-        float gy_v = gy.data[i];
-        mag.data[i] = std ::hypotf(gx_v, gy_v);
-        theta.data[i] = atan2(gy_v, gx_v);
+        const float *gx_row = gx.row(y);
+        const float *gy_row = gy.row(y);
+        float *mag_row = mag.row(y);
+        float *theta_row = theta.row(y);
+        for (int x = 0; x != gx.w; ++x)
+        {
+            float gx_v = gx_row[x];
+            float gy_v = gy_row[x];
+            mag_row[x] = std ::hypotf(gx_v, gy_v);
+            theta_row[x] = atan2(gy_v, gx_v);
+        }
     }
 }
 
-static inline void convolve(
-    int const &src_x, int const &src_y, int const &fx_offset, int const &fy_offset,
-    const Mat &src, Mat &dst, const Mat &filter,
-    bool const &preserve)
+//
+// Convolution engine
+//
+// Each output row is accumulated in a row buffer, one filter row at a time.
+// Columns where the filter fits inside the image (the interior) run without any clamping
+// in loops the compiler vectorizes across x, only the thin left and right borders clamp
+// the column index. Rows are clamped once per filter row by picking the source row pointer.
+// Taps are always added in the same order as the straightforward per pixel convolution,
+// so the result is identical to it.
+//
+
+// interior columns, the filter always fits inside the source rows.
+// FW, FH are the filter size when known at compile time (0 when only known at runtime),
+// so the tap loops of the common small filters are fully unrolled.
+// a block of columns is kept in registers while all the taps are applied.
+template <int FW, int FH>
+static void convolveInterior(const float *const *rows, const float *taps, int fw, int fh,
+                             int fx_offset, int x_begin, int x_end, float *acc)
 {
+    if (FW > 0)
+        fw = FW;
+    if (FH > 0)
+        fh = FH;
 
-    float value = 0.0f;
+    int x = x_begin;
 
-    for (int k = 0; k != src.c; ++k)
+#ifdef VS_SSE2
+    for (; x + 16 <= x_end; x += 16)
     {
-        int filter_channel = (src.c == filter.c) ? k : 0;
-        
-        for (int y = 0; y != filter.h; ++y)
-        {
-            for (int x = 0; x != filter.w; ++x)
+        __m128 v0 = _mm_loadu_ps(acc + x);
+        __m128 v1 = _mm_loadu_ps(acc + x + 4);
+        __m128 v2 = _mm_loadu_ps(acc + x + 8);
+        __m128 v3 = _mm_loadu_ps(acc + x + 12);
+
+        for (int fy = 0; fy != fh; ++fy)
+            for (int fx = 0; fx != fw; ++fx)
             {
-                const float fv = filter.get(x, y, filter_channel);
-                const int sx = src_x + x - fx_offset;
-                const int sy = src_y + y - fy_offset;
-                const float sv = src.getClamp(sx, sy, k);
-                value += sv * fv;
+                const __m128 f = _mm_set1_ps(taps[fy * fw + fx]);
+                const float *src = rows[fy] + x + fx - fx_offset;
+                v0 = _mm_add_ps(v0, _mm_mul_ps(_mm_loadu_ps(src), f));
+                v1 = _mm_add_ps(v1, _mm_mul_ps(_mm_loadu_ps(src + 4), f));
+                v2 = _mm_add_ps(v2, _mm_mul_ps(_mm_loadu_ps(src + 8), f));
+                v3 = _mm_add_ps(v3, _mm_mul_ps(_mm_loadu_ps(src + 12), f));
             }
-        }
 
-        if (preserve)
-        {
-            dst.set(src_x, src_y, k, value);
-            value = 0.0f;
-        }
+        _mm_storeu_ps(acc + x, v0);
+        _mm_storeu_ps(acc + x + 4, v1);
+        _mm_storeu_ps(acc + x + 8, v2);
+        _mm_storeu_ps(acc + x + 12, v3);
+    }
+
+    for (; x + 4 <= x_end; x += 4)
+    {
+        __m128 v = _mm_loadu_ps(acc + x);
+        for (int fy = 0; fy != fh; ++fy)
+            for (int fx = 0; fx != fw; ++fx)
+                v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(rows[fy] + x + fx - fx_offset), _mm_set1_ps(taps[fy * fw + fx])));
+        _mm_storeu_ps(acc + x, v);
     }
+#endif // VS_SSE2
 
-    if (!preserve)
+    for (; x < x_end; ++x)
     {
-        dst.set(src_x, src_y, 0, value);
+        float value = acc[x];
+        for (int fy = 0; fy != fh; ++fy)
+            for (int fx = 0; fx != fw; ++fx)
+                value += rows[fy][x + fx - fx_offset] * taps[fy * fw + fx];
+        acc[x] = value;
     }
 }
 
+// slow path for the columns where the filter falls outside the image
+static void convolveBorder(const float *const *rows, const float *taps, int fw, int fh,
+                           int fx_offset, int x_begin, int x_end, int w, float *acc)
+{
+    for (int x = x_begin; x < x_end; ++x)
+    {
+        float value = acc[x];
+        for (int fy = 0; fy != fh; ++fy)
+            for (int fx = 0; fx != fw; ++fx)
+                value += rows[fy][clampTo(x + fx - fx_offset, 0, w - 1)] * taps[fy * fw + fx];
+        acc[x] = value;
+    }
+}
+
+static void convolveRow(const float *const *rows, const float *taps, int fw, int fh,
+                        int fx_offset, int w, float *acc)
+{
+    // interior columns: [x_begin, x_end)
+    int const x_begin = minimum(fx_offset, w);
+    int const x_end = maximum(x_begin, w - (fw - 1 - fx_offset));
+
+    convolveBorder(rows, taps, fw, fh, fx_offset, 0, x_begin, w, acc);
+
+    if (fw == 3 && fh == 3)
+        convolveInterior<3, 3>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc);
+    else if (fw == 5 && fh == 5)
+        convolveInterior<5, 5>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc);
+    else if (fw == 3 && fh == 1)
+        convolveInterior<3, 1>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc);
+    else if (fw == 1 && fh == 3)
+        convolveInterior<1, 3>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc);
+    else if (fh == 1)
+        convolveInterior<0, 1>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc); // 1xN
+    else if (fw == 1)
+        convolveInterior<1, 0>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc); // Nx1
+    else
+        convolveInterior<0, 0>(rows, taps, fw, fh, fx_offset, x_begin, x_end, acc);
+
+    convolveBorder(rows, taps, fw, fh, fx_offset, x_end, w, w, acc);
+}
+
 void convolve(const Mat &src, Mat &dst, const Mat &filter, bool const preserve)
 {
     assert((preserve && dst.c == filter.c) || filter.c == 1);
 
     dst.reshape(src.w, src.h, preserve ? src.c : 1);
 
-    int fx_offset = filter.w / 2;
-    int fy_offset = filter.h / 2;
-    for (int y = 0; y != src.h; ++y)
-        for (int x = 0; x != src.w; ++x)
-            convolve(x, y, fx_offset, fy_offset, src, dst, filter, preserve);
+    int const fx_offset = filter.w / 2;
+    int const fy_offset = filter.h / 2;
+
+    // continuous copy of the taps, one block per filter channel
+    std::vector<float> taps(size_t(filter.w * filter.h * filter.c));
+    for (int k = 0; k != filter.c; ++k)
+        for (int y = 0; y != filter.h; ++y)
+            std::copy(filter.row(y, k), filter.row(y, k) + filter.w, taps.begin() + (k * filter.h + y) * filter.w);
+
+    parallelFor(0, src.h, [&](int y_begin, int y_end) {
+        std::vector<float> acc(size_t(src.w));
+        std::vector<const float *> rows(size_t(filter.h));
+
+        for (int y = y_begin; y != y_end; ++y)
+        {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+
+            for (int k = 0; k != src.c; ++k)
+            {
+                int filter_channel = (src.c == filter.c) ? k : 0;
+
+                for (int fy = 0; fy != filter.h; ++fy)
+                    rows[size_t(fy)] = src.row(clampTo(y + fy - fy_offset, 0, src.h - 1), k);
+
+                convolveRow(rows.data(), taps.data() + filter_channel * filter.w * filter.h,
+                            filter.w, filter.h, fx_offset, src.w, acc.data());
+
+                if (preserve)
+                {
+                    std::copy(acc.begin(), acc.end(), dst.row(y, k));
+                    std::fill(acc.begin(), acc.end(), 0.0f);
+                }
+            }
+
+            if (!preserve)
+                std::copy(acc.begin(), acc.end(), dst.row(y, 0));
+        }
+    });
 }
 
 Mat convolve(const Mat &src, const Mat &filter, bool preserve)
@@ -271,10 +624,12 @@ void canny(const Mat &src, Mat &dst, const float tmin, const float tmax, const f
     assert(src.c == 1);
     dst.reshape(src.w, src.h, 1);
 
-    smoothImage(src, dst, sigma);
+    // the pixels are indexed as a plain w * h array, dst can be a view or padded
+    Mat out(src.w, src.h, 1);
+    smoothImage(src, out, sigma);
 
     Mat mag, angle;
-    gradientMagnitudeAngle(dst, mag, angle);
+    gradientMagnitudeAngle(out, mag, angle);
 
     // Non-maximum suppression, straightforward implementation.
     const float pi = float(M_PI);
@@ -315,18 +670,18 @@ void canny(const Mat &src, Mat &dst, const float tmin, const float tmax, const f
     // Reuse memory, used as a stack. nx*ny/2 elements should be enough.
     Mat edges = mag;
     edges.zero();
-    dst.zero();
+    out.zero();
 
     // Tracing edges with hysteresis . Non-recursive implementation.
     const float max_brightness = 1.0f;
     size_t c = 1;
-    for (int y = 1; y < dst.h - 1; y++)
-        for (int x = 1; x < dst.w - 1; x++)
+    for (int y = 1; y < out.h - 1; y++)
+        for (int x = 1; x < out.w - 1; x++)
         {
-            if (nms.data[c] >= tmax && vs::equivalent(dst.data[c], 0.0f))
+            if (nms.data[c] >= tmax && vs::equivalent(out.data[c], 0.0f))
             { // trace edges
 
-                dst.data[c] = max_brightness;
+                out.data[c] = max_brightness;
                 int nedges = 1;
                 edges.data[0] = c;
 
@@ -346,9 +701,9 @@ void canny(const Mat &src, Mat &dst, const float tmin, const float tmax, const f
                     nbs[7] = nbs[1] - 1; // se
 
                     for (int k = 0; k < 8; k++)
-                        if (nms.data[nbs[k]] >= tmin && vs::equivalent(dst.data[nbs[k]], 0.0f))
+                        if (nms.data[nbs[k]] >= tmin && vs::equivalent(out.data[nbs[k]], 0.0f))
                         {
-                            dst.data[nbs[k]] = max_brightness;
+                            out.data[nbs[k]] = max_brightness;
                             edges.data[nedges] = nbs[k];
                             nedges++;
                         }    
@@ -356,6 +711,8 @@ void canny(const Mat &src, Mat &dst, const float tmin, const float tmax, const f
             }
             c++;
         }
+
+    dst.copy(out, 0, 0);
 }
 
 
@@ -12,9 +12,15 @@ Mat makeEmbossFilter();
 Mat makeBoxFilter(int w);
 Mat makeGaussianFilter(float sigma);
 Mat makeGaussianFilter1D(float sigma);
-void smoothImage(vs::Mat const& src, vs::Mat& dst, vs::Mat& tmp, float sigma);
-void smoothImage(vs::Mat const& src, vs::Mat& dst, float sigma);
-vs::Mat smoothImage(vs::Mat const& src, float sigma);
+
+enum SmoothMode
+{
+    GaussianFIR, // separable convolution with a sampled gaussian, cost grows with sigma
+    GaussianIIR  // recursive gaussian (Young - van Vliet), constant cost per pixel. sigma >= 0.5
+};
+void smoothImage(vs::Mat const& src, vs::Mat& dst, vs::Mat& tmp, float sigma, SmoothMode const mode = GaussianFIR);
+void smoothImage(vs::Mat const& src, vs::Mat& dst, float sigma, SmoothMode const mode = GaussianFIR);
+vs::Mat smoothImage(vs::Mat const& src, float sigma, SmoothMode const mode = GaussianFIR);
 
 // sobel gradient
 Mat makeSobelFilter(bool horizontal);
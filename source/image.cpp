@@ -54,9 +54,11 @@ bool saveImage(std::string path, Mat const &im)
 
     for (int k = 0; k < im.c; ++k)
     {
-        for (int i = 0; i < im.w * im.h; ++i)
+        for (int y = 0; y < im.h; ++y)
         {
-            data[i * im.c + k] = static_cast<unsigned char>(255 * im.data[i + k * im.w * im.h]);
+            const float *row = im.row(y, k);
+            for (int x = 0; x < im.w; ++x)
+                data[(y * im.w + x) * im.c + k] = static_cast<unsigned char>(255 * row[x]);
         }
     }
 
@@ -88,19 +90,22 @@ void rgb2gray(Mat const &src, Mat &dst)
 {
     assert(src.w >= 0 && src.h >= 0 && ((src.c == 3) || (src.c == 4)));
     dst.reshape(src.w, src.h, 1);
-    dst.zero();
 
     static float scale[] = {0.299f, 0.587f, 0.114f};
-    for (int k = 0; k < 3; ++k)
-    {
-        for (int j = 0; j < src.h; ++j)
+    parallelFor(0, src.h, [&](int j_begin, int j_end) {
+        for (int j = j_begin; j < j_end; ++j)
         {
+            float *d = dst.row(j);
             for (int i = 0; i < src.w; ++i)
             {
-                dst.data[i + dst.w * j] += scale[k] * src.get(i, j, k);
+                float value = 0.0f;
+                for (int k = 0; k < 3; ++k)
+                    value += scale[k] * src.get(i, j, k);
+
+                d[i] = value;
             }
         }
-    }
+    });
 }
 
 void rgb2hsv(Mat const &src, Mat &dst)
@@ -108,53 +113,54 @@ void rgb2hsv(Mat const &src, Mat &dst)
     assert(src.w >= 0 && src.h >= 0 && src.c == 3);
     dst.reshape(src.w, src.h, 3);
 
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    for (j = 0; j < src.h; ++j)
-    {
-        for (i = 0; i < src.w; ++i)
+    parallelFor(0, src.h, [&](int j_begin, int j_end) {
+        float r, g, b;
+        float h, s, v;
+        for (int j = j_begin; j < j_end; ++j)
         {
-            r = src.get(i, j, 0);
-            g = src.get(i, j, 1);
-            b = src.get(i, j, 2);
-            float max = maximum(r, g, b);
-            float min = minimum(r, g, b);
-            float delta = max - min;
-            v = max;
-
-            if (equivalent(delta, 0.0f))
-            {
-                s = 0.0f;
-                h = 0.0f;
-            }
-            else
+            for (int i = 0; i < src.w; ++i)
             {
-                s = delta / max;
-
-                if (equivalent(r, max))
+                r = src.get(i, j, 0);
+                g = src.get(i, j, 1);
+                b = src.get(i, j, 2);
+                float max = maximum(r, g, b);
+                float min = minimum(r, g, b);
+                float delta = max - min;
+                v = max;
+
+                if (equivalent(delta, 0.0f))
                 {
-                    h = (g - b) / delta;
-                }
-                else if (equivalent(g, max))
-                {
-                    h = 2 + (b - r) / delta;
+                    s = 0.0f;
+                    h = 0.0f;
                 }
                 else
                 {
-                    h = 4 + (r - g) / delta;
+                    s = delta / max;
+
+                    if (equivalent(r, max))
+                    {
+                        h = (g - b) / delta;
+                    }
+                    else if (equivalent(g, max))
+                    {
+                        h = 2 + (b - r) / delta;
+                    }
+                    else
+                    {
+                        h = 4 + (r - g) / delta;
+                    }
+
+                    if (h < 0)
+                        h += 6.0;
+                    h = h / 6.0f;
                 }
 
-                if (h < 0)
-                    h += 6.0;
-                h = h / 6.0f;
+                dst.set(i, j, 0, h);
+                dst.set(i, j, 1, s);
+                dst.set(i, j, 2, v);
             }
-
-            dst.set(i, j, 0, h);
-            dst.set(i, j, 1, s);
-            dst.set(i, j, 2, v);
         }
-    }
+    });
 }
 
 void hsv2rgb(Mat const &src, Mat &dst)
@@ -162,70 +168,71 @@ void hsv2rgb(Mat const &src, Mat &dst)
     assert(src.w >= 0 && src.h >= 0 && src.c == 3);
     dst.reshape(src.w, src.h, 3);
 
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    float f, p, q, t;
-    for (j = 0; j < src.h; ++j)
-    {
-        for (i = 0; i < src.w; ++i)
+    parallelFor(0, src.h, [&](int j_begin, int j_end) {
+        float r, g, b;
+        float h, s, v;
+        float f, p, q, t;
+        for (int j = j_begin; j < j_end; ++j)
         {
-            h = src.get(i, j, 0) * 6.0f;
-            s = src.get(i, j, 1);
-            v = src.get(i, j, 2);
-            if (equivalent(s, 0.0f))
-            {
-                r = g = b = v;
-            }
-            else
+            for (int i = 0; i < src.w; ++i)
             {
-                int index = int(floor(h));
-                f = h - index;
-                p = v * (1 - s);
-                q = v * (1 - s * f);
-                t = v * (1 - s * (1 - f));
-                if (index == 0)
+                h = src.get(i, j, 0) * 6.0f;
+                s = src.get(i, j, 1);
+                v = src.get(i, j, 2);
+                if (equivalent(s, 0.0f))
                 {
-                    r = v;
-                    g = t;
-                    b = p;
-                }
-                else if (index == 1)
-                {
-                    r = q;
-                    g = v;
-                    b = p;
-                }
-                else if (index == 2)
-                {
-                    r = p;
-                    g = v;
-                    b = t;
-                }
-                else if (index == 3)
-                {
-                    r = p;
-                    g = q;
-                    b = v;
-                }
-                else if (index == 4)
-                {
-                    r = t;
-                    g = p;
-                    b = v;
+                    r = g = b = v;
                 }
                 else
                 {
-                    r = v;
-                    g = p;
-                    b = q;
+                    int index = int(floor(h));
+                    f = h - index;
+                    p = v * (1 - s);
+                    q = v * (1 - s * f);
+                    t = v * (1 - s * (1 - f));
+                    if (index == 0)
+                    {
+                        r = v;
+                        g = t;
+                        b = p;
+                    }
+                    else if (index == 1)
+                    {
+                        r = q;
+                        g = v;
+                        b = p;
+                    }
+                    else if (index == 2)
+                    {
+                        r = p;
+                        g = v;
+                        b = t;
+                    }
+                    else if (index == 3)
+                    {
+                        r = p;
+                        g = q;
+                        b = v;
+                    }
+                    else if (index == 4)
+                    {
+                        r = t;
+                        g = p;
+                        b = v;
+                    }
+                    else
+                    {
+                        r = v;
+                        g = p;
+                        b = q;
+                    }
                 }
+                dst.set(i, j, 0, r);
+                dst.set(i, j, 1, g);
+                dst.set(i, j, 2, b);
             }
-            dst.set(i, j, 0, r);
-            dst.set(i, j, 1, g);
-            dst.set(i, j, 2, b);
         }
-    }
+    });
 }
 
 Mat rgb2gray(Mat const &src)
@@ -264,15 +271,25 @@ void rgb2bgr(Mat const &src, Mat &dst)
     assert(src.c == 3);
     dst.reshape(src.w, src.h, 3);
 
-    for (int i = 0; i < src.w * src.h; ++i)
+    for (int y = 0; y < src.h; ++y)
     {
-        float r = src.data[i + src.w * src.h * 0];
-        float g = src.data[i + src.w * src.h * 1];
-        float b = src.data[i + src.w * src.h * 2];
+        const float *src_r = src.row(y, 0);
+        const float *src_g = src.row(y, 1);
+        const float *src_b = src.row(y, 2);
+        float *dst_b = dst.row(y, 0);
+        float *dst_g = dst.row(y, 1);
+        float *dst_r = dst.row(y, 2);
+
+        for (int i = 0; i < src.w; ++i)
+        {
+            float r = src_r[i];
+            float g = src_g[i];
+            float b = src_b[i];
 
-        dst.data[i + src.w * src.h * 0] = b;
-        dst.data[i + src.w * src.h * 1] = g;
-        dst.data[i + src.w * src.h * 2] = r;
+            dst_b[i] = b;
+            dst_g[i] = g;
+            dst_r[i] = r;
+        }
     }
 }
 
@@ -303,9 +320,12 @@ Mat::Type thresholdOtsu(const Mat &src, Mat &dst, const ThresholdMode mode, cons
     float const bin_size = 1.0f / bins;
 
     // compute the histogram
-    for (int i = 0; i < src.channelSize(); ++i) {
-        int bin = clampTo(int(src.data[i] / bin_size), 0, bins - 1);
-        histogram[bin] += 1.0;
+    for (int y = 0; y < src.h; ++y) {
+        const float *s = src.row(y);
+        for (int x = 0; x < src.w; ++x) {
+            int bin = clampTo(int(s[x] / bin_size), 0, bins - 1);
+            histogram[bin] += 1.0;
+        }
     }
 
     for(int i = 0; i <= 255; i++) {
@@ -356,30 +376,35 @@ Mat::Type threshold(const Mat &src, Mat &dst, const ThresholdMode mode, const Ma
 
     dst.reshape(src.w, src.h, src.c);
 
-    if (mode == ThresholdMode::Binary) {
+    for (int y = 0; y < src.h; ++y) {
+        const Mat::Type *s = src.row(y);
+        Mat::Type *d = dst.row(y);
+
+        if (mode == ThresholdMode::Binary) {
 
-        for (int i = 0; i < src.channelSize(); ++i)
-            dst.data[i] = src.data[i] > value ? max : 0;
+            for (int x = 0; x < src.w; ++x)
+                d[x] = s[x] > value ? max : 0;
 
-    } else if (mode == ThresholdMode::BinaryInverted) {
+        } else if (mode == ThresholdMode::BinaryInverted) {
 
-        for (int i = 0; i < src.channelSize(); ++i)
-            dst.data[i] = src.data[i] > value ? 0 : max;
+            for (int x = 0; x < src.w; ++x)
+                d[x] = s[x] > value ? 0 : max;
 
-    } else if (mode == ThresholdMode::Truncate) {
+        } else if (mode == ThresholdMode::Truncate) {
 
-        for (int i = 0; i < src.channelSize(); ++i)
-            dst.data[i] = src.data[i] > value ? max : src.data[i];
+            for (int x = 0; x < src.w; ++x)
+                d[x] = s[x] > value ? max : s[x];
 
-    } else if (mode == ThresholdMode::ToZero) {
+        } else if (mode == ThresholdMode::ToZero) {
 
-        for (int i = 0; i < src.channelSize(); ++i)
-            dst.data[i] = src.data[i] > value ? src.data[i] : 0;
+            for (int x = 0; x < src.w; ++x)
+                d[x] = s[x] > value ? s[x] : 0;
 
-    } else if (mode == ThresholdMode::ToZeroInverted) {
+        } else if (mode == ThresholdMode::ToZeroInverted) {
 
-        for (int i = 0; i < src.channelSize(); ++i)
-            dst.data[i] = src.data[i] > value ? 0 : src.data[i];
+            for (int x = 0; x < src.w; ++x)
+                d[x] = s[x] > value ? 0 : s[x];
+        }
     }
 
     return value;
@@ -426,20 +451,22 @@ void resize(Mat const &src, Mat &dst, int nw, int nh, const ResizeMode mode)
 
     float x_ratio = float(src.w) / float(dst.w);
     float y_ratio = float(src.h) / float(dst.h);
-    for (int k = 0; k < dst.c; ++k)
-    {
-        for (int y = 0; y < nh; ++y)
+    parallelFor(0, nh, [&](int y_begin, int y_end) {
+        for (int k = 0; k < dst.c; ++k)
         {
-            for (int x = 0; x < nw; ++x)
+            for (int y = y_begin; y < y_end; ++y)
             {
-                float px = (x + 0.5f) * x_ratio;
-                float py = (y + 0.5f) * y_ratio;
+                for (int x = 0; x < nw; ++x)
+                {
+                    float px = (x + 0.5f) * x_ratio;
+                    float py = (y + 0.5f) * y_ratio;
 
-                float value = interpolate(src, px, py, k);
-                dst.set(x, y, k, value);
+                    float value = interpolate(src, px, py, k);
+                    dst.set(x, y, k, value);
+                }
             }
         }
-    }
+    });
 }
 
 Mat resize(Mat const &src, int nw, int nh, const ResizeMode mode)
@@ -449,6 +476,138 @@ Mat resize(Mat const &src, int nw, int nh, const ResizeMode mode)
     return dst;
 }
 
+void makePyramid(Mat const &im, int levels, std::vector<Mat> &pyramid)
+{
+    assert(levels > 0);
+
+    int count = 1;
+    for (int w = im.w, h = im.h; count < levels && (w + 1) / 2 >= 8 && (h + 1) / 2 >= 8; ++count)
+    {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    pyramid.resize(size_t(count));
+    pyramid[0] = im;
+
+    for (size_t level = 1; level != pyramid.size(); ++level)
+    {
+        Mat const &src = pyramid[level - 1];
+        Mat &dst = pyramid[level];
+        dst.reshape((src.w + 1) / 2, (src.h + 1) / 2, src.c);
+
+        parallelFor(0, dst.h, [&](int y_begin, int y_end) {
+            for (int k = 0; k != dst.c; ++k)
+                for (int y = y_begin; y != y_end; ++y)
+                {
+                    const float *r0 = src.row(maximum(2 * y - 1, 0), k);
+                    const float *r1 = src.row(2 * y, k);
+                    const float *r2 = src.row(minimum(2 * y + 1, src.h - 1), k);
+                    float *out = dst.row(y, k);
+
+                    for (int x = 0; x != dst.w; ++x)
+                    {
+                        const int x0 = maximum(2 * x - 1, 0);
+                        const int x1 = 2 * x;
+                        const int x2 = minimum(2 * x + 1, src.w - 1);
+
+                        const float v0 = 0.25f * r0[x0] + 0.5f * r0[x1] + 0.25f * r0[x2];
+                        const float v1 = 0.25f * r1[x0] + 0.5f * r1[x1] + 0.25f * r1[x2];
+                        const float v2 = 0.25f * r2[x0] + 0.5f * r2[x1] + 0.25f * r2[x2];
+                        out[x] = 0.25f * v0 + 0.5f * v1 + 0.25f * v2;
+                    }
+                }
+        }, 8);
+    }
+}
+
+void warpPerspective(Mat const &src, Mat &dst, Mat3d const &H, ResizeMode const mode,
+                     BorderMode const border, Mat const &src_mask)
+{
+    assert(src.c == dst.c && src.w > 0 && src.h > 0);
+    assert(src_mask.size() == 0 || (src_mask.w == src.w && src_mask.h == src.h && (src_mask.c == 1 || src_mask.c == src.c)));
+
+    bool const masked = src_mask.size() > 0;
+    int const c = src.c;
+    int const wi = src.w - 1;
+    int const hi = src.h - 1;
+
+    parallelFor(0, dst.h, [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; ++y)
+        {
+            // homogeneous source coordinates of the first pixel in the row,
+            // moving one pixel right only adds the first column of H
+            double sx = H(0, 1) * y + H(0, 2);
+            double sy = H(1, 1) * y + H(1, 2);
+            double sw = H(2, 1) * y + H(2, 2);
+
+            for (int x = 0; x < dst.w; ++x, sx += H(0, 0), sy += H(1, 0), sw += H(2, 0))
+            {
+                float px = float(sx / sw);
+                float py = float(sy / sw);
+
+                bool inside = px >= 0.0f && px < src.w && py >= 0.0f && py < src.h;
+                if (!inside && border != BorderReplicate)
+                {
+                    if (border == BorderConstant)
+                        for (int k = 0; k < c; ++k)
+                            dst.row(y, k)[x] = 0.0f;
+                    continue;
+                }
+
+                if (mode == NearestNeighbor)
+                {
+                    int const ix = clampTo(int(floorf(px)), 0, wi);
+                    int const iy = clampTo(int(floorf(py)), 0, hi);
+
+                    for (int k = 0; k < c; ++k)
+                        if (!masked || src_mask.row(iy, src_mask.c == 1 ? 0 : k)[ix] != 0.0f)
+                            dst.row(y, k)[x] = src.row(iy, k)[ix];
+                        else if (border == BorderConstant)
+                            dst.row(y, k)[x] = 0.0f;
+                    continue;
+                }
+
+                // same math as interpolateBL, the weights are shared by all channels
+                float const bx = px - 0.5f;
+                float const by = py - 0.5f;
+                int const ix = int(floorf(bx));
+                int const iy = int(floorf(by));
+
+                float const d1 = bx - ix;
+                float const d2 = 1.0f - d1;
+                float const d3 = by - iy;
+                float const d4 = 1.0f - d3;
+
+                int const x0 = clampTo(ix, 0, wi);
+                int const x1 = clampTo(ix + 1, 0, wi);
+                int const y0 = clampTo(iy, 0, hi);
+                int const y1 = clampTo(iy + 1, 0, hi);
+
+                int const mx = clampTo(int(px), 0, wi);
+                int const my = clampTo(int(py), 0, hi);
+
+                for (int k = 0; k < c; ++k)
+                {
+                    if (masked && src_mask.row(my, src_mask.c == 1 ? 0 : k)[mx] == 0.0f)
+                    {
+                        if (border == BorderConstant)
+                            dst.row(y, k)[x] = 0.0f;
+                        continue;
+                    }
+
+                    const float *r0 = src.row(y0, k);
+                    const float *r1 = src.row(y1, k);
+
+                    const float q1 = r0[x0] * d2 + r0[x1] * d1;
+                    const float q2 = r1[x0] * d2 + r1[x1] * d1;
+                    dst.row(y, k)[x] = q1 * d4 + q2 * d3;
+                }
+            }
+        }
+    });
+}
+
 vs::Mat cylindricalProject(vs::Mat const &im, float f)
 {
     vs::Mat out(im.w, im.h, im.c);
@@ -542,26 +701,46 @@ void extractImage4points(Mat const &im, Mat &dst, const std::array<Pointi, 4> &p
     matches[3].q = points[size_t(assignment[3])];
 
 
-    Matd H = computeHomography(matches);
-    if (H.size() == 0) {
+    Matd Hm = computeHomography(matches);
+    if (Hm.size() == 0) {
         return;
     }
+    Mat3d H(Hm);
+
+    // same incremental walk as warpPerspective, but this function has always sampled
+    // at the truncated projected position, which is a 2x2 average with fixed weights
+    int const wi = im.w - 1;
+    int const hi = im.h - 1;
 
-    // warp image
-    for (int k = 0; k < dst.c; ++k)
-        for (int y = 0; y < dst.h; ++y)
-            for (int x = 0; x < dst.w; ++x)
+    parallelFor(0, dst.h, [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; ++y)
+        {
+            double sx = H(0, 1) * y + H(0, 2);
+            double sy = H(1, 1) * y + H(1, 2);
+            double sw = H(2, 1) * y + H(2, 2);
+
+            for (int x = 0; x < dst.w; ++x, sx += H(0, 0), sy += H(1, 0), sw += H(2, 0))
             {
-                vs::Point p = vs::projectPoint(H, vs::Point(x, y));
-                int px = int(p.x);
-                int py = int(p.y);
+                int px = int(float(sx / sw));
+                int py = int(float(sy / sw));
                 if (px < 0 || px >= im.w || py < 0 || py >= im.h)
                     continue;
 
-                float value = vs::interpolateBL(im, px, py, k);
-                dst.set(x, y, k, value);
-            }
+                int const x0 = clampTo(px - 1, 0, wi);
+                int const y0 = clampTo(py - 1, 0, hi);
 
+                for (int k = 0; k < dst.c; ++k)
+                {
+                    const float *r0 = im.row(y0, k);
+                    const float *r1 = im.row(py, k);
+
+                    const float q1 = r0[x0] * 0.5f + r0[px] * 0.5f;
+                    const float q2 = r1[x0] * 0.5f + r1[px] * 0.5f;
+                    dst.row(y, k)[x] = q1 * 0.5f + q2 * 0.5f;
+                }
+            }
+        }
+    });
 }
 
 } // namespace vs
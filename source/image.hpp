@@ -45,6 +45,31 @@ float interpolateBL(Mat const& im, float x, float y, int c);
 void resize(Mat const& src, Mat &dst, int nw, int nh, ResizeMode const mode = Bilinear);
 Mat resize(Mat const& src, int nw, int nh, ResizeMode const mode = Bilinear);
 
+// Builds an image pyramid, each level half the size of the one below it.
+// Levels are low passed with [1/4 1/2 1/4] on both axes and pixel (x, y) of a level sits on (2x, 2y) of the one below.
+// image im: level 0, it is shared, not copied.
+// int levels: number of levels wanted, fewer are built when a level would get under 8 pixels wide or high.
+// pyramid: output - the levels, existing levels of the right size are reused.
+void makePyramid(Mat const& im, int levels, std::vector<Mat>& pyramid);
+
+
+
+enum BorderMode
+{
+    BorderTransparent, // dst pixels that map outside of src are left untouched
+    BorderConstant,    // dst pixels that map outside of src are set to 0
+    BorderReplicate    // src is extended with its edge pixels
+};
+// Warps an image with a projective transformation.
+// H maps dst pixel coordinates to src coordinates, every dst pixel is sampled from src.
+// dst must be allocated with the same channels as src, views can be used to warp into a region.
+// mode: NearestNeighbor or Bilinear sampling.
+// border: what to do with dst pixels that map outside of src.
+// src_mask: optional, same size as src with 1 or src.c channels.
+//           samples where the mask is 0 are treated as outside of src: set to 0 with BorderConstant,
+//           left untouched otherwise, there is no edge to replicate.
+void warpPerspective(Mat const& src, Mat& dst, Mat3d const& H, ResizeMode const mode = Bilinear,
+                     BorderMode const border = BorderTransparent, Mat const& src_mask = Mat());
 
 vs::Mat cylindricalProject(vs::Mat const &im, float f);
 
@@ -3,9 +3,29 @@
 namespace vs
 {
 
+// calloc with the result aligned to MatT::Alignment.
+// the original pointer is kept right before the aligned block.
+static void *alignedCalloc(size_t bytes, size_t alignment)
+{
+    size_t const extra = alignment + sizeof(void *);
+    void *raw = calloc(bytes + extra, 1);
+    if (!raw)
+        return nullptr;
+
+    uintptr_t aligned = (uintptr_t(raw) + extra) & ~uintptr_t(alignment - 1);
+    reinterpret_cast<void **>(aligned)[-1] = raw;
+    return reinterpret_cast<void *>(aligned);
+}
+
+static void alignedFree(void *aligned)
+{
+    if (aligned)
+        free(reinterpret_cast<void **>(aligned)[-1]);
+}
+
 template <typename T>
 MatT<T>::MatT()
-    : w(0), h(0), c(0), data(nullptr)
+    : w(0), h(0), c(0), stride(0), plane(0), data(nullptr)
 {
 }
 
@@ -25,6 +45,8 @@ MatT<T>::MatT(int w, int h, int c, T *ext)
     this->w = w;
     this->h = h;
     this->c = c;
+    this->stride = w;
+    this->plane = w * h;
     this->data = ext;
 }
 
@@ -32,19 +54,41 @@ template <typename T>
 MatT<T> MatT<T>::clone() const
 {
     MatT<T> output(w, h, c);
-    memcpy(output.data, data, size_t(size()) * sizeof(T));
+    output.copy(*this, 0, 0);
     return output;
 }
 
+template <typename T>
+bool MatT<T>::isContinuous() const
+{
+    return stride == w && plane == w * h;
+}
+
+template <typename T>
+T *MatT<T>::row(int y, int c)
+{
+    return data + c * plane + y * stride;
+}
+
+template <typename T>
+const T *MatT<T>::row(int y, int c) const
+{
+    return data + c * plane + y * stride;
+}
+
 template <typename T>
 template <typename TO>
 void MatT<T>::convert(MatT<TO> &out)
 {
     out.reshape(w, h, c);
-    for (int i = 0; i != size(); ++i)
-    {
-        out.data[i] = TO(data[i]);
-    }
+    for (int k = 0; k != c; ++k)
+        for (int y = 0; y != h; ++y)
+        {
+            const T *src = row(y, k);
+            TO *dst = out.row(y, k);
+            for (int x = 0; x != w; ++x)
+                dst[x] = TO(src[x]);
+        }
 }
 
 template <typename T>
@@ -61,7 +105,24 @@ MatT<T> MatT<T>::channelView(int c, int count)
 {
     assert(this->c > (c + count - 1));
 
-    MatT<T> output(w, h, count, data + c * channelSize());
+    MatT<T> output(w, h, count, row(0, c));
+    output.stride = stride;
+    output.plane = plane;
+    // share the data across mat objets
+    output.shared_data = shared_data;
+
+    return output;
+}
+
+template <typename T>
+MatT<T> MatT<T>::roiView(int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && w > 0 && h > 0);
+    assert(x + w <= this->w && y + h <= this->h);
+
+    MatT<T> output(w, h, c, row(y) + x);
+    output.stride = stride;
+    output.plane = plane;
     // share the data across mat objets
     output.shared_data = shared_data;
 
@@ -71,7 +132,16 @@ MatT<T> MatT<T>::channelView(int c, int count)
 template <typename T>
 MatT<T> &MatT<T>::zero()
 {
-    memset(data, 0, size_t(size()) * sizeof(T));
+    if (isContinuous())
+    {
+        memset(data, 0, size_t(size()) * sizeof(T));
+        return *this;
+    }
+
+    for (int k = 0; k != c; ++k)
+        for (int y = 0; y != h; ++y)
+            memset(row(y, k), 0, size_t(w) * sizeof(T));
+
     return *this;
 }
 
@@ -80,8 +150,8 @@ MatT<T> &MatT<T>::fill(int c, T v)
 {
     assert(c >= 0 && c < this->c);
 
-    for (int i = 0; i != w * h; ++i)
-        data[c * h * w + i] = v;
+    for (int y = 0; y != h; ++y)
+        std::fill(row(y, c), row(y, c) + w, v);
 
     return *this;
 }
@@ -100,8 +170,8 @@ MatT<T> &MatT<T>::fill(MatT<T> const &src, int src_c, int dst_c)
 {
     assert(src.w == w && src.h == h && src.c > src_c && c > dst_c);
 
-    for (int i = 0; i != w * h; ++i)
-        data[dst_c * w * h + i] = src.data[src_c * w * h + i];
+    for (int y = 0; y != h; ++y)
+        std::copy(src.row(y, src_c), src.row(y, src_c) + w, row(y, dst_c));
 
     return *this;
 }
@@ -111,11 +181,14 @@ MatT<T> &MatT<T>::copy(MatT<T> const &src, int src_x, int src_y, int src_w, int
 {
     assert(src_w >= 0 && src_h >= 0 && src_w <= (src.w - src_x)  && src_h <= (src.h - src_y));
     assert(src_w <= (w - dst_x) && src_h <= (h - dst_y));
+    assert(dst_x >= 0 && dst_y >= 0 && src.c <= c);
 
     for (int k = 0; k < src.c; ++k)
         for (int y = 0; y < src_h; ++y)
-            for (int x = 0; x < src_w; ++x)
-                set(dst_x + x, dst_y + y, k, src.get(src_x + x, src_y + y, k));
+        {
+            const T *from = src.row(src_y + y, k) + src_x;
+            std::copy(from, from + src_w, row(dst_y + y, k) + dst_x);
+        }
 
     return *this;
 }
@@ -150,7 +223,7 @@ T MatT<T>::get(int x, int y, int c) const
 
     assert(c >= 0);
     assert(c < this->c);
-    return data[c * h * w + y * w + x];
+    return data[c * plane + y * stride + x];
 }
 
 template <typename T>
@@ -159,7 +232,7 @@ T MatT<T>::getClamp(int x, int y, int c) const
     x = vs::clampTo(x, 0, this->w - 1);
     y = vs::clampTo(y, 0, this->h - 1);
     c = vs::clampTo(c, 0, this->c - 1);
-    return data[c * h * w + y * w + x];
+    return data[c * plane + y * stride + x];
 }
 
 template <typename T>
@@ -168,7 +241,7 @@ T MatT<T>::getZero(int x, int y, int c) const
     if (x < 0 || x >= this->w || y < 0 || y >= this->h || c < 0 || c >= this->c)
         return 0;
 
-    return data[c * h * w + y * w + x];
+    return data[c * plane + y * stride + x];
 }
 
 template <typename T>
@@ -179,7 +252,7 @@ MatT<T> &MatT<T>::set(int x, int y, int c, T v)
     assert(c >= 0);
     assert(x < w && y < h && c < this->c);
 
-    data[c * h * w + y * w + x] = v;
+    data[c * plane + y * stride + x] = v;
 
     return *this;
 }
@@ -190,7 +263,7 @@ MatT<T> &MatT<T>::setClamp(int x, int y, int c, T v)
     x = vs::clampTo(x, 0, this->w - 1);
     y = vs::clampTo(y, 0, this->h - 1);
     c = vs::clampTo(c, 0, this->c - 1);
-    data[c * h * w + y * w + x] = v;
+    data[c * plane + y * stride + x] = v;
     return *this;
 }
 
@@ -199,8 +272,12 @@ MatT<T> &MatT<T>::add(int c, T v)
 {
     assert(c >= 0 && c < this->c);
 
-    for (int i = 0; i != w * h; ++i)
-        data[c * h * w + i] += v;
+    for (int y = 0; y != h; ++y)
+    {
+        T *r = row(y, c);
+        for (int x = 0; x != w; ++x)
+            r[x] += v;
+    }
 
     return *this;
 }
@@ -219,8 +296,14 @@ MatT<T> &MatT<T>::add(const MatT<T> &v)
 {
     assert(c == v.c && w == v.w && h == v.h);
 
-    for (int i = 0; i != c * w * h; ++i)
-        data[i] += v.data[i];
+    for (int k = 0; k != c; ++k)
+        for (int y = 0; y != h; ++y)
+        {
+            T *r = row(y, k);
+            const T *vr = v.row(y, k);
+            for (int x = 0; x != w; ++x)
+                r[x] += vr[x];
+        }
 
     return *this;
 }
@@ -238,8 +321,14 @@ MatT<T> &MatT<T>::sub(const MatT<T> &v)
 {
     assert(c == v.c && w == v.w && h == v.h);
 
-    for (int i = 0; i != c * w * h; ++i)
-        data[i] -= v.data[i];
+    for (int k = 0; k != c; ++k)
+        for (int y = 0; y != h; ++y)
+        {
+            T *r = row(y, k);
+            const T *vr = v.row(y, k);
+            for (int x = 0; x != w; ++x)
+                r[x] -= vr[x];
+        }
 
     return *this;
 }
@@ -257,8 +346,12 @@ MatT<T> &MatT<T>::mult(int c, T v)
 {
     assert(c >= 0 && c < this->c);
 
-    for (int i = 0; i != w * h; ++i)
-        data[c * h * w + i] *= v;
+    for (int y = 0; y != h; ++y)
+    {
+        T *r = row(y, c);
+        for (int x = 0; x != w; ++x)
+            r[x] *= v;
+    }
 
     return *this;
 }
@@ -290,8 +383,12 @@ T MatT<T>::sum(int c)
 {
     T value = 0.0;
 
-    for (int i = 0; i != w * h; ++i)
-        value += data[c * h * w + i];
+    for (int y = 0; y != h; ++y)
+    {
+        const T *r = row(y, c);
+        for (int x = 0; x != w; ++x)
+            value += r[x];
+    }
 
     return value;
 }
@@ -301,14 +398,15 @@ T MatT<T>::max(int c)
 {
     T value = std::numeric_limits<T>::min();
 
-    for (int i = 0; i != w * h; ++i)
-    {
-        T current = data[c * h * w + i];
-        if (current > value)
+    for (int y = 0; y != h; ++y)
+        for (int x = 0; x != w; ++x)
         {
-            value = current;
+            T current = row(y, c)[x];
+            if (current > value)
+            {
+                value = current;
+            }
         }
-    }
 
     return value;
 }
@@ -318,14 +416,15 @@ T MatT<T>::min(int c)
 {
     T value = std::numeric_limits<T>::max();
 
-    for (int i = 0; i != w * h; ++i)
-    {
-        T current = data[c * h * w + i];
-        if (current < value)
+    for (int y = 0; y != h; ++y)
+        for (int x = 0; x != w; ++x)
         {
-            value = current;
+            T current = row(y, c)[x];
+            if (current < value)
+            {
+                value = current;
+            }
         }
-    }
 
     return value;
 }
@@ -336,19 +435,20 @@ void MatT<T>::minNmax(int c, T &minv, T &maxv)
     minv = std::numeric_limits<T>::max();
     maxv = std::numeric_limits<T>::min();
 
-    for (int i = 0; i != w * h; ++i)
-    {
-        T current = data[c * h * w + i];
-        if (current < minv)
+    for (int y = 0; y != h; ++y)
+        for (int x = 0; x != w; ++x)
         {
-            minv = current;
-        }
+            T current = row(y, c)[x];
+            if (current < minv)
+            {
+                minv = current;
+            }
 
-        if (current > maxv)
-        {
-            maxv = current;
+            if (current > maxv)
+            {
+                maxv = current;
+            }
         }
-    }
 }
 
 template <typename T>
@@ -363,8 +463,12 @@ MatT<T> &MatT<T>::featureNormalize(int c)
     if (equivalent(delta, T(0.0)))
         return zero();
 
-    for (int i = 0; i != w * h; ++i)
-        data[c * h * w + i] = (data[c * h * w + i] - min_v) / delta;
+    for (int y = 0; y != h; ++y)
+    {
+        T *r = row(y, c);
+        for (int x = 0; x != w; ++x)
+            r[x] = (r[x] - min_v) / delta;
+    }
 
     return *this;
 }
@@ -398,8 +502,12 @@ MatT<T> &MatT<T>::l1Normalize()
 template <typename T>
 MatT<T> &MatT<T>::clamp(int c, T min, T max)
 {
-    for (int i = 0; i != w * h; ++i)
-        data[c * h * w + i] = vs::clampTo(data[c * h * w + i], min, max);
+    for (int y = 0; y != h; ++y)
+    {
+        T *r = row(y, c);
+        for (int x = 0; x != w; ++x)
+            r[x] = vs::clampTo(r[x], min, max);
+    }
 
     return *this;
 }
@@ -447,22 +555,46 @@ void MatT<T>::reshape(int w, int h, int c)
         return;
     }
 
+    allocate(w, h, c, w);
+}
+
+template <typename T>
+void MatT<T>::reshapePadded(int w, int h, int c)
+{
+    int const step = Alignment / int(sizeof(T));
+    int const stride = ((w + step - 1) / step) * step;
+
+    if (this->w == w && this->h == h && this->c == c && this->stride == stride)
+    {
+        return;
+    }
+
+    allocate(w, h, c, stride);
+}
+
+template <typename T>
+void MatT<T>::allocate(int w, int h, int c, int stride)
+{
     shared_data.reset();
     data = nullptr;
     this->w = 0;
     this->h = 0;
     this->c = 0;
+    this->stride = 0;
+    this->plane = 0;
 
     if (w > 0 && h > 0 && c > 0)
     {
         this->w = w;
         this->h = h;
         this->c = c;
+        this->stride = stride;
+        this->plane = stride * h;
 
-        data = static_cast<T *>(calloc(size_t(size()), sizeof(T)));
+        data = static_cast<T *>(alignedCalloc(size_t(plane) * size_t(c) * sizeof(T), size_t(Alignment)));
         if (data)
         {
-            shared_data = std::shared_ptr<T>(data, free);
+            shared_data = std::shared_ptr<T>(data, [](T *p) { alignedFree(p); });
         }
     }
 }
@@ -475,13 +607,13 @@ void MatT<T>::reshape(int w, int h, int c)
 template <typename T>
 const T &MatT<T>::operator()(const int row, const int col) const
 {
-    return data[row * w + col];
+    return data[row * stride + col];
 }
 
 template <typename T>
 T &MatT<T>::operator()(const int row, const int col)
 {
-    return data[row * w + col];
+    return data[row * stride + col];
 }
 
 template <typename T>
@@ -693,6 +825,62 @@ T PointT<T>::distance(const PointT<T> &p, const PointT<T> &q) {
     return T(sqrtf(float(x * x + y * y)));
 }
 
+//
+// Mat3
+//
+template <typename T>
+Mat3T<T>::Mat3T(MatT<T> const &H)
+{
+    assert(H.w == 3 && H.h == 3 && H.c == 1);
+
+    for (int row = 0; row != 3; ++row)
+        for (int col = 0; col != 3; ++col)
+            m[row * 3 + col] = H(row, col);
+}
+
+template <typename T>
+MatT<T> Mat3T<T>::toMat() const
+{
+    MatT<T> H(3, 3);
+    for (int row = 0; row != 3; ++row)
+        for (int col = 0; col != 3; ++col)
+            H(row, col) = m[row * 3 + col];
+    return H;
+}
+
+template <typename T>
+T Mat3T<T>::determinant() const
+{
+    return m[0] * (m[4] * m[8] - m[5] * m[7]) -
+           m[1] * (m[3] * m[8] - m[5] * m[6]) +
+           m[2] * (m[3] * m[7] - m[4] * m[6]);
+}
+
+template <typename T>
+bool Mat3T<T>::invert(Mat3T<T> &inv) const
+{
+    T const det = determinant();
+    if (det == T(0))
+        return false;
+
+    // adjugate / determinant
+    T const s = T(1) / det;
+    inv = Mat3T<T>((m[4] * m[8] - m[5] * m[7]) * s, (m[2] * m[7] - m[1] * m[8]) * s, (m[1] * m[5] - m[2] * m[4]) * s,
+                   (m[5] * m[6] - m[3] * m[8]) * s, (m[0] * m[8] - m[2] * m[6]) * s, (m[2] * m[3] - m[0] * m[5]) * s,
+                   (m[3] * m[7] - m[4] * m[6]) * s, (m[1] * m[6] - m[0] * m[7]) * s, (m[0] * m[4] - m[1] * m[3]) * s);
+    return true;
+}
+
+template <typename T>
+Mat3T<T> Mat3T<T>::mmult(Mat3T<T> const &a, Mat3T<T> const &b)
+{
+    Mat3T<T> p;
+    for (int row = 0; row != 3; ++row)
+        for (int col = 0; col != 3; ++col)
+            p(row, col) = a(row, 0) * b(0, col) + a(row, 1) * b(1, col) + a(row, 2) * b(2, col);
+    return p;
+}
+
 
 //
 // force template instantiation
@@ -715,6 +903,9 @@ template PointT<float>::operator PointT<int>() const;
 template class PointT<int>;
 template PointT<int>::operator PointT<float>() const;
 
+template struct Mat3T<float>;
+template struct Mat3T<double>;
+
 
 
 
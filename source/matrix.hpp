@@ -11,14 +11,27 @@ class MatT
 public:
     using Type = T;
 
+    // allocations start on this boundary (bytes)
+    static const int Alignment = 64;
+
     MatT();
     explicit MatT(int w, int h = 1, int c = 1);
     explicit MatT(int w, int h, int c, T* ext); // external memory pointer
 
     void reshape(int w, int h, int c);
+    // same as reshape but rows are padded so that every row starts on an Alignment boundary
+    void reshapePadded(int w, int h, int c);
     int size() const;
     int channelSize() const;
-    MatT clone() const;
+    MatT clone() const; // the clone is always continuous
+
+    // true when there is no padding between rows and channels,
+    // only then data can be accessed as a plain w * h * c array
+    bool isContinuous() const;
+
+    // pointer to the first element of a row
+    T *row(int y, int c = 0);
+    const T *row(int y, int c = 0) const;
 
     template<typename TO> void convert(MatT<TO>& out);
     template<typename TO> MatT<TO> convert();
@@ -27,6 +40,7 @@ public:
     // these are virtual view on a Mat data, they will point to the parent memory
     // thus they don't allocate new memory
     MatT channelView(int c, int count = 1);
+    MatT roiView(int x, int y, int w, int h);
 
     MatT &zero();
     MatT &fill(int c, T v); // fills a channel with v value
@@ -120,8 +134,12 @@ public:
     int w;    // width
     int h;    // height
     int c;    // channels;
+    int stride; // elements between the start of two rows
+    int plane;  // elements between the start of two channels
     T *data;
 private:
+    void allocate(int w, int h, int c, int stride);
+
     std::shared_ptr<T> shared_data;
 };
 
@@ -156,4 +174,54 @@ struct PointT
 using Point = PointT<float>;
 using Pointi = PointT<int>;
 
+
+// A fixed size 3x3 matrix, row major and stored inline (no heap).
+// Meant for homographies, where a MatT would allocate for every projected point.
+template<typename T>
+struct Mat3T
+{
+    using Type = T;
+
+    // identity
+    constexpr Mat3T()
+        : m{1, 0, 0, 0, 1, 0, 0, 0, 1} {}
+
+    constexpr Mat3T(T m00, T m01, T m02, T m10, T m11, T m12, T m20, T m21, T m22)
+        : m{m00, m01, m02, m10, m11, m12, m20, m21, m22} {}
+
+    // from a 3x3 MatT
+    explicit Mat3T(MatT<T> const& H);
+    MatT<T> toMat() const;
+
+    constexpr T operator()(int const row, int const col) const { return m[row * 3 + col]; }
+    T &operator()(int const row, int const col) { return m[row * 3 + col]; }
+
+    static constexpr Mat3T makeTranslation(T dx, T dy) { return Mat3T(1, 0, dx, 0, 1, dy, 0, 0, 1); }
+
+    T determinant() const;
+
+    // inv = this^-1. returns false when the matrix is singular
+    bool invert(Mat3T& inv) const;
+
+    // p = a * b
+    static Mat3T mmult(Mat3T const& a, Mat3T const& b);
+
+    // Apply the projective transformation to a point.
+    // computed in T, the result is converted back to float
+    Point project(Point const& p) const
+    {
+        T const x = T(p.x);
+        T const y = T(p.y);
+        T const px = m[0] * x + m[1] * y + m[2];
+        T const py = m[3] * x + m[4] * y + m[5];
+        T const pw = m[6] * x + m[7] * y + m[8];
+        return Point(float(px / pw), float(py / pw));
+    }
+
+    T m[9];
+};
+using Mat3 = Mat3T<float>;
+using Mat3d = Mat3T<double>;
+using Homography = Mat3d;
+
 } // namespace vs
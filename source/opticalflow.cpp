@@ -3,27 +3,60 @@
 namespace vs
 {
 
-void makeIntegralImage(const Mat &im, Mat &out)
+static void makeIntegralImageTile(const Mat &im, Mat &out, int k, int x_begin, int x_end, int y_begin, int y_end)
 {
-    out.reshape(im.w, im.h, im.c);
+    for (int y = y_begin; y != y_end; ++y)
+    {
+        const float *src = im.row(y, k);
+        const float *above = (y > 0) ? out.row(y - 1, k) : nullptr;
+        float *dst = out.row(y, k);
 
-    for (int k = 0; k != im.c; ++k)
-        for (int y = 0; y != im.h; ++y)
-            for (int x = 0; x != im.w; ++x)
-            {
-                float v = im.get(x, y, k);
+        for (int x = x_begin; x != x_end; ++x)
+        {
+            float v = src[x];
+
+            if (y > 0)
+                v += above[x];
 
-                if (y > 0)
-                    v += out.get(x, y - 1, k);
+            if (x > 0)
+                v += dst[x - 1];
 
-                if (x > 0)
-                    v += out.get(x - 1, y, k);
+            if (x > 0 && y > 0)
+                v -= above[x - 1];
 
-                if (x > 0 && y > 0)
-                    v -= out.get(x - 1, y - 1, k);
+            dst[x] = v;
+        }
+    }
+}
+
+void makeIntegralImage(const Mat &im, Mat &out)
+{
+    out.reshape(im.w, im.h, im.c);
 
-                out.set(x, y, k, v);
+    // each tile only depends on the tiles above and to the left of it,
+    // so the tiles on the same anti-diagonal can be computed in parallel.
+    int const tile = 64;
+    int const tiles_x = (im.w + tile - 1) / tile;
+    int const tiles_y = (im.h + tile - 1) / tile;
+
+    for (int d = 0; d < tiles_x + tiles_y - 1; ++d)
+    {
+        int const ty_begin = maximum(0, d - tiles_x + 1);
+        int const ty_end = minimum(d, tiles_y - 1) + 1;
+        int const count = ty_end - ty_begin;
+
+        parallelFor(0, im.c * count, [&](int i_begin, int i_end) {
+            for (int i = i_begin; i != i_end; ++i)
+            {
+                int const k = i / count;
+                int const ty = ty_begin + i % count;
+                int const tx = d - ty;
+                makeIntegralImageTile(im, out, k,
+                                      tx * tile, minimum((tx + 1) * tile, im.w),
+                                      ty * tile, minimum((ty + 1) * tile, im.h));
             }
+        });
+    }
 }
 
 
@@ -69,29 +102,60 @@ void boxfilterIntegralImage(const Mat &im, int smooth, Mat &out)
     int wi = im.w - 1;
     int hi = im.h - 1;
 
-    for (int k = 0; k != im.c; ++k)
-        for (int y = 0; y != im.h; ++y)
-            for (int x = 0; x != im.w; ++x)
+    parallelFor(0, im.h, [&](int y_begin, int y_end) {
+        for (int k = 0; k != im.c; ++k)
+            for (int y = y_begin; y != y_end; ++y)
+                for (int x = 0; x != im.w; ++x)
+                {
+                    int l = x - offset;
+                    int t = y - offset;
+                    int r = x + offset;
+                    int b = y + offset;
+
+                    float sum;
+                    int count;
+                    getIntegralImageRegion(im, k, l, t, r, b, sum, count);
+                    out.set(x, y, k, sum / float(count));
+                }
+    });
+}
+
+void boxfilterIntegralImage(const Mat &im, int smooth, int stride, Mat &out)
+{
+    out.reshape(im.w / stride, im.h / stride, im.c);
+
+    int offset = int(smooth / 2);
+    int first = (stride - 1) / 2;
+
+    parallelFor(0, out.h, [&](int ty_begin, int ty_end) {
+        for (int k = 0; k != im.c; ++k)
+            for (int ty = ty_begin; ty != ty_end; ++ty)
             {
-                int l = x - offset;
-                int t = y - offset;
-                int r = x + offset;
-                int b = y + offset;
-
-                float sum;
-                int count;
-                getIntegralImageRegion(im, k, l, t, r, b, sum, count);
-                out.set(x, y, k, sum / float(count));
+                const int y = first + ty * stride;
+                float *row = out.row(ty, k);
+                for (int tx = 0; tx != out.w; ++tx)
+                {
+                    const int x = first + tx * stride;
+
+                    float sum;
+                    int count;
+                    getIntegralImageRegion(im, k, x - offset, y - offset, x + offset, y + offset, sum, count);
+                    row[tx] = sum / float(count);
+                }
             }
+    });
 }
 
 void LucasKanade::timeStructureMatrix(const Mat &im, const Mat &prev, int smooth, Mat &S)
+{
+    timeStructureMatrix(im, prev, smooth, 1, S);
+}
+
+void LucasKanade::timeStructureMatrix(const Mat &im, const Mat &prev, int smooth, int stride, Mat &S)
 {
     // returns: structure matrix. 1st channel is Ix^2, 2nd channel is Iy^2,
     //          3rd channel is IxIy, 4th channel is IxIt, 5th channel is IyIt.
 
-    S.reshape(im.w, im.h, 5);
-
     m_I.reshape(im.w, im.h, 5);
     Mat IxIx = m_I.channelView(0);
     Mat IyIy = m_I.channelView(1);
@@ -100,22 +164,95 @@ void LucasKanade::timeStructureMatrix(const Mat &im, const Mat &prev, int smooth
     Mat IyIt = m_I.channelView(4);
     gradient(im, IxIx, IyIy);
 
-    float x, y, t;
-    for (int i = 0; i != im.size(); ++i)
-    {
-        x = IxIx.data[i];
-        y = IyIy.data[i];
-        t = im.data[i] - prev.data[i];
+    parallelFor(0, im.h, [&](int y_begin, int y_end) {
+        float x, y, t;
+        for (int j = y_begin; j != y_end; ++j)
+        {
+            const float *im_row = im.row(j);
+            const float *prev_row = prev.row(j);
+            float *xx = IxIx.row(j);
+            float *yy = IyIy.row(j);
+            float *xy = IxIy.row(j);
+            float *xt = IxIt.row(j);
+            float *yt = IyIt.row(j);
+            for (int i = 0; i != im.w; ++i)
+            {
+                x = xx[i];
+                y = yy[i];
+                t = im_row[i] - prev_row[i];
+
+                xy[i] = x * y;
+                xx[i] = x * x;
+                yy[i] = y * y;
+                xt[i] = x * t;
+                yt[i] = y * t;
+            }
+        }
+    }, 8);
+
+    makeIntegralImage(m_I, m_Ii);
+    if (stride == 1)
+        boxfilterIntegralImage(m_Ii, smooth, S);
+    else
+        boxfilterIntegralImage(m_Ii, smooth, stride, S);
+}
+
+// Solves A * v = -b for a run of pixels, A = [xx xy; xy yy] and b = [xt; yt].
+// Pixels where the smallest eigenvalue of A is not above eigen_threshold get v = 0.
+// float *xx, *yy, *xy, *xt, *yt: the structure matrix of n pixels, one array per channel.
+// float *vx, *vy: output - n velocities.
+static void solveVelocities(const float *xx, const float *yy, const float *xy, const float *xt, const float *yt,
+                            int n, float eigen_threshold, float *vx, float *vy)
+{
+    int i = 0;
 
-        IxIy.data[i] = x * y;
-        IxIx.data[i] = x * x;
-        IyIy.data[i] = y * y;
-        IxIt.data[i] = x * t;
-        IyIt.data[i] = y * t;
+#ifdef VS_SSE2
+    {
+        const __m128 threshold = _mm_set1_ps(eigen_threshold);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 quarter = _mm_set1_ps(0.25f);
+        const __m128 zero = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4)
+        {
+            const __m128 a = _mm_loadu_ps(xx + i);
+            const __m128 b = _mm_loadu_ps(xy + i);
+            const __m128 c = _mm_loadu_ps(yy + i);
+            const __m128 t0 = _mm_loadu_ps(xt + i);
+            const __m128 t1 = _mm_loadu_ps(yt + i);
+
+            // same math as minEigenValue2x2
+            const __m128 trace = _mm_add_ps(a, c);
+            const __m128 det = _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b));
+            const __m128 common = _mm_sqrt_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(trace, trace), quarter), det));
+            const __m128 eigen = _mm_sub_ps(_mm_mul_ps(trace, half), common);
+            const __m128 solvable = _mm_and_ps(_mm_cmpgt_ps(eigen, threshold), _mm_cmpneq_ps(det, zero));
+
+            // cramer's rule
+            const __m128 x = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(b, t1), _mm_mul_ps(c, t0)), det);
+            const __m128 y = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(b, t0), _mm_mul_ps(a, t1)), det);
+            _mm_storeu_ps(vx + i, _mm_and_ps(solvable, x));
+            _mm_storeu_ps(vy + i, _mm_and_ps(solvable, y));
+        }
     }
+#endif // VS_SSE2
 
-    makeIntegralImage(m_I, m_Ii);
-    boxfilterIntegralImage(m_Ii, smooth, S);
+    for (; i < n; ++i)
+    {
+        const float a = xx[i];
+        const float b = xy[i];
+        const float c = yy[i];
+        const float det = a * c - b * b;
+        if (minEigenValue2x2(a, b, b, c) > eigen_threshold && det != 0.0f)
+        {
+            vx[i] = (b * yt[i] - c * xt[i]) / det;
+            vy[i] = (b * xt[i] - a * yt[i]) / det;
+        }
+        else
+        {
+            vx[i] = 0.0f;
+            vy[i] = 0.0f;
+        }
+    }
 }
 
 void LucasKanade::velocityImage(const Mat &S, int stride, Mat &v)
@@ -125,69 +262,608 @@ void LucasKanade::velocityImage(const Mat &S, int stride, Mat &v)
     v.reshape(S.w/stride, S.h/stride, 3);
     v.zero();
 
-    Mat A(2,2);
-    Mat B(1, 2);
-    Mat P(1, 2);
+    // pixel (tx, ty) of v samples S at (offset + tx * stride, offset + ty * stride)
+    const int offset = (stride - 1) / 2;
 
-    for (int y = (stride - 1) / 2; y < S.h; y += stride)
-    {
-        int ty = y / stride;
-        if (ty >= v.h)
-            continue;
+    parallelFor(0, v.h, [&](int ty_begin, int ty_end) {
+        // strided samples are gathered in blocks, so the solver always reads contiguous channels
+        const int block = 64;
+        float gathered[5][block];
+        const float *channels[5];
 
-        for (int x = (stride - 1) / 2; x < S.w; x += stride)
+        for (int ty = ty_begin; ty != ty_end; ++ty)
         {
+            const int y = offset + ty * stride;
+            for (int tx = 0; tx < v.w; tx += block)
+            {
+                const int n = minimum(block, v.w - tx);
+                for (int k = 0; k != 5; ++k)
+                {
+                    const float *row = S.row(y, k) + offset + tx * stride;
+                    if (stride == 1)
+                    {
+                        channels[k] = row;
+                        continue;
+                    }
+
+                    for (int i = 0; i != n; ++i)
+                        gathered[k][i] = row[i * stride];
+                    channels[k] = gathered[k];
+                }
+
+                solveVelocities(channels[0], channels[1], channels[2], channels[3], channels[4],
+                                n, eigen_threshold, v.row(ty, 0) + tx, v.row(ty, 1) + tx);
+            }
+        }
+    }, 8);
+}
 
-            int tx = x / stride;
-            if (tx >= v.w)
-                break;
+void LucasKanade::makeGray(const Mat &im, bool copy, Frame &frame)
+{
+    frame.levels = 0;
 
-            A(0, 0) = S.get(x, y, 0); // Ixx
-            A(0, 1) = S.get(x, y, 2); // Ixy
-            A(1, 0) = S.get(x, y, 2); // Ixy
-            A(1, 1) = S.get(x, y, 1); // Iyy
+    // a shared gray keeps its buffer through reshape, rgb2gray or copy would write into the caller's image
+    if (frame.shared)
+    {
+        frame.gray = Mat();
+        frame.shared = false;
+    }
 
-            B(0, 0) = -S.get(x, y, 3); //Ixt
-            B(1, 0) = -S.get(x, y, 4); //Iyt
+    if (im.c != 1)
+    {
+        rgb2gray(im, frame.gray);
+    }
+    else if (copy)
+    {
+        frame.gray.reshape(im.w, im.h, 1);
+        frame.gray.copy(im, 0, 0);
+    }
+    else
+    {
+        frame.gray = im;
+        frame.shared = true;
+    }
+}
 
-            // check for invertability
-            if (minEigenValue2x2(A) > eigen_threshold)
-            {
-                Mat Ai = A.invert();
-                if (Ai.size() == 0)
-                    continue;
+void LucasKanade::opticalflow(const Mat &im, const Mat &prev, int smooth, int stride, Mat &vs)
+{
+    assert(im.w == prev.w && im.h == prev.h);
+
+    // the frames are shared, they can't be kept for a stream
+    m_streaming = false;
+    makeGray(im, false, m_curr);
+    makeGray(prev, false, m_prev);
+
+    // S is only needed at the samples of v
+    timeStructureMatrix(m_curr.gray, m_prev.gray, smooth, stride, m_S);
+    velocityImage(m_S, 1, m_V);
+
+    m_V.constrain(6.0f);
+    vs::smoothImage(m_V, vs, 2.0);
+}
+
+void LucasKanade::reset()
+{
+    m_streaming = false;
+}
+
+bool LucasKanade::nextFrame(const Mat &im)
+{
+    // the frame of the last call becomes the previous one, its buffers are reused for the next frame
+    std::swap(m_curr, m_prev);
+    makeGray(im, true, m_curr);
+
+    const bool flow = m_streaming && m_prev.gray.w == im.w && m_prev.gray.h == im.h;
+    m_streaming = true;
+    return flow;
+}
+
+bool LucasKanade::pushFrame(const Mat &im, int smooth, int stride, Mat &vs)
+{
+    if (!nextFrame(im))
+        return false;
+
+    timeStructureMatrix(m_curr.gray, m_prev.gray, smooth, stride, m_S);
+    velocityImage(m_S, 1, m_V);
+
+    m_V.constrain(6.0f);
+    vs::smoothImage(m_V, vs, 2.0);
+    return true;
+}
+
+// Bilinear sample of a 1 channel image at pixel coordinates, pixel (x, y) is at (x, y).
+// Samples that need the pixels past the border go through interpolateBL, that clamps them.
+static inline float samplePixel(Mat const &im, float x, float y)
+{
+    const int ix = int(floorf(x));
+    const int iy = int(floorf(y));
+    if (ix < 0 || iy < 0 || ix >= im.w - 1 || iy >= im.h - 1)
+        return interpolateBL(im, x + 0.5f, y + 0.5f, 0);
+
+    const float ax = x - float(ix);
+    const float ay = y - float(iy);
+    const float *r0 = im.row(iy) + ix;
+    const float *r1 = im.row(iy + 1) + ix;
+    const float q0 = r0[0] * (1.0f - ax) + r0[1] * ax;
+    const float q1 = r1[0] * (1.0f - ax) + r1[1] * ax;
+    return q0 * (1.0f - ay) + q1 * ay;
+}
+
+void LucasKanade::makeFramePyramid(int levels, bool gradients, Frame &frame)
+{
+    makePyramid(frame.gray, levels, frame.pyramid);
+    if (!gradients)
+        return;
+    frame.levels = levels;
+
+    frame.gradients.resize(frame.pyramid.size());
+    for (size_t level = 0; level != frame.pyramid.size(); ++level)
+    {
+        Mat const &im = frame.pyramid[level];
+        Mat &g = frame.gradients[level];
+        g.reshape(im.w, im.h, 2);
+        Mat Ix = g.channelView(0);
+        Mat Iy = g.channelView(1);
+        gradient(im, Ix, Iy);
+    }
+}
 
-                Mat::vmult(Ai, B, P);
-                v.set(tx, ty, 0, P(0, 0));
-                v.set(tx, ty, 1, P(1, 0));
+void LucasKanade::refineFlow(const Mat &im, const Mat &prev, Mat &gradient, int smooth, int iterations, Mat &flow)
+{
+    const int w = prev.w;
+    const int h = prev.h;
+
+    // the sobel taps add up to 8 on each side, velocityImage solves in 1/8 of a pixel
+    const float sobel_gain = 8.0f;
+
+    // the gradients are taken on prev, they and the first three channels of S don't change with the warp
+    assert(gradient.w == w && gradient.h == h && gradient.c == 2);
+    Mat Ix = gradient.channelView(0);
+    Mat Iy = gradient.channelView(1);
+
+    m_I.reshape(w, h, 5);
+    m_Ii.reshape(w, h, 5);
+    m_S.reshape(w, h, 5);
+
+    parallelFor(0, h, [&](int y_begin, int y_end) {
+        for (int y = y_begin; y != y_end; ++y)
+        {
+            const float *x_row = Ix.row(y);
+            const float *y_row = Iy.row(y);
+            float *xx = m_I.row(y, 0);
+            float *yy = m_I.row(y, 1);
+            float *xy = m_I.row(y, 2);
+            for (int x = 0; x != w; ++x)
+            {
+                xx[x] = x_row[x] * x_row[x];
+                yy[x] = y_row[x] * y_row[x];
+                xy[x] = x_row[x] * y_row[x];
             }
         }
+    }, 8);
+
+    Mat I = m_I.channelView(0, 3);
+    Mat Ii = m_Ii.channelView(0, 3);
+    Mat S = m_S.channelView(0, 3);
+    makeIntegralImage(I, Ii);
+    boxfilterIntegralImage(Ii, smooth, S);
+
+    I = m_I.channelView(3, 2);
+    Ii = m_Ii.channelView(3, 2);
+    S = m_S.channelView(3, 2);
+    for (int iteration = 0; iteration != iterations; ++iteration)
+    {
+        // It = im(x + flow) - prev(x)
+        parallelFor(0, h, [&](int y_begin, int y_end) {
+            for (int y = y_begin; y != y_end; ++y)
+            {
+                const float *x_row = Ix.row(y);
+                const float *y_row = Iy.row(y);
+                const float *p_row = prev.row(y);
+                const float *fx = flow.row(y, 0);
+                const float *fy = flow.row(y, 1);
+                float *xt = m_I.row(y, 3);
+                float *yt = m_I.row(y, 4);
+                for (int x = 0; x != w; ++x)
+                {
+                    const float t = samplePixel(im, float(x) + fx[x], float(y) + fy[x]) - p_row[x];
+                    xt[x] = x_row[x] * t;
+                    yt[x] = y_row[x] * t;
+                }
+            }
+        }, 8);
+
+        makeIntegralImage(I, Ii);
+        boxfilterIntegralImage(Ii, smooth, S);
+        velocityImage(m_S, 1, m_V);
+
+        for (int k = 0; k != 2; ++k)
+            for (int y = 0; y != h; ++y)
+            {
+                const float *d = m_V.row(y, k);
+                float *f = flow.row(y, k);
+                for (int x = 0; x != w; ++x)
+                    f[x] += sobel_gain * d[x];
+            }
+
+        // each window is warped with the flow of all its pixels, keep neighbours consistent or noise feeds back
+        smoothImage(flow, m_smoothed, m_tmp, 1.0f);
+        std::swap(flow, m_smoothed);
     }
 }
 
-void LucasKanade::opticalflow(const Mat &im, const Mat &prev, int smooth, int stride, Mat &vs)
+void LucasKanade::opticalflowPyramidal(const Mat &im, const Mat &prev, int levels, int smooth, int iterations,
+                                       int stride, Mat &vs)
 {
     assert(im.w == prev.w && im.h == prev.h);
 
-    if (im.c == 1) 
-        m_curr_gray = im;
-    else    
-        rgb2gray(im, m_curr_gray); 
+    // the frames are shared, they can't be kept for a stream
+    m_streaming = false;
+    makeGray(im, false, m_curr);
+    makeGray(prev, false, m_prev);
+    makeFramePyramid(levels, false, m_curr);
+    makeFramePyramid(levels, true, m_prev);
 
-    if (prev.c == 1) 
-        m_prev_gray = prev;
-    else    
-        rgb2gray(prev, m_prev_gray);        
-    
-    timeStructureMatrix(m_curr_gray, m_prev_gray, smooth, m_S);
-    velocityImage(m_S, stride, m_V);
+    pyramidalFlow(m_curr, m_prev, smooth, iterations, stride, vs);
+}
 
-    m_V.constrain(6.0f);
-    vs::smoothImage(m_V, vs, 2.0);
+bool LucasKanade::pushFramePyramidal(const Mat &im, int levels, int smooth, int iterations, int stride, Mat &vs)
+{
+    // the gradients of the new frame are only needed by the next call, when it is prev
+    const bool flow = nextFrame(im);
+    makeFramePyramid(levels, true, m_curr);
+    if (!flow)
+        return false;
+
+    // levels changed since the previous frame was pushed, or it came from pushFrame
+    if (m_prev.levels != levels)
+        makeFramePyramid(levels, true, m_prev);
+
+    pyramidalFlow(m_curr, m_prev, smooth, iterations, stride, vs);
+    return true;
+}
+
+void LucasKanade::pyramidalFlow(Frame &curr, Frame &prev, int smooth, int iterations, int stride, Mat &vs)
+{
+    const int top = int(prev.pyramid.size()) - 1;
+    m_flow.reshape(prev.pyramid[size_t(top)].w, prev.pyramid[size_t(top)].h, 2);
+    m_flow.zero();
+
+    for (int level = top; level >= 0; --level)
+    {
+        Mat const &prev_level = prev.pyramid[size_t(level)];
+
+        // pixel (x, y) sits on (x / 2, y / 2) of the coarser level, where the motion is half as large
+        if (level != top)
+        {
+            m_upsampled.reshape(prev_level.w, prev_level.h, 2);
+            parallelFor(0, prev_level.h, [&](int y_begin, int y_end) {
+                for (int k = 0; k != 2; ++k)
+                    for (int y = y_begin; y != y_end; ++y)
+                    {
+                        float *f = m_upsampled.row(y, k);
+                        for (int x = 0; x != prev_level.w; ++x)
+                            f[x] = 2.0f * interpolateBL(m_flow, 0.5f * float(x) + 0.5f, 0.5f * float(y) + 0.5f, k);
+                    }
+            }, 8);
+            std::swap(m_flow, m_upsampled);
+        }
+
+        refineFlow(curr.pyramid[size_t(level)], prev_level, prev.gradients[size_t(level)], smooth, iterations, m_flow);
+    }
+
+    vs.reshape(curr.gray.w / stride, curr.gray.h / stride, 3);
+    vs.zero();
+
+    const int offset = (stride - 1) / 2;
+    for (int k = 0; k != 2; ++k)
+        for (int ty = 0; ty != vs.h; ++ty)
+        {
+            const float *f = m_flow.row(offset + ty * stride, k) + offset;
+            float *v = vs.row(ty, k);
+            for (int tx = 0; tx != vs.w; ++tx)
+                v[tx] = f[tx * stride];
+        }
+}
+
+// Samples the window of a point with its central difference gradients.
+// image im: 1 channel image.
+// float px, py: center of the window, pixel coordinates.
+// int r: radius of the window, side = 2r + 1, up to KLTMaxWindow.
+// float *t, *gx, *gy: output - values and gradients, side * side each.
+// returns: smallest eigenvalue of the structure matrix per pixel, a, b and c are the matrix [a b; b c].
+static float sampleWindow(Mat const &im, float px, float py, int r, float *t, float *gx, float *gy,
+                          float &a, float &b, float &c)
+{
+    const int side = 2 * r + 1;
+    const int padded = side + 2;
+    float patch[(KLTMaxWindow + 2) * (KLTMaxWindow + 2)];
+    for (int j = 0; j != padded; ++j)
+        for (int i = 0; i != padded; ++i)
+            patch[j * padded + i] = samplePixel(im, px + float(i - r - 1), py + float(j - r - 1));
+
+    a = 0.0f;
+    b = 0.0f;
+    c = 0.0f;
+    for (int j = 0; j != side; ++j)
+        for (int i = 0; i != side; ++i)
+        {
+            const float *center = patch + (j + 1) * padded + i + 1;
+            const int k = j * side + i;
+            t[k] = center[0];
+            gx[k] = 0.5f * (center[1] - center[-1]);
+            gy[k] = 0.5f * (center[padded] - center[-padded]);
+            a += gx[k] * gx[k];
+            b += gx[k] * gy[k];
+            c += gy[k] * gy[k];
+        }
+
+    return minEigenValue2x2(a, b, b, c) / float(side * side);
+}
+
+// Tracks one point from prev to next, coarse to fine.
+// The window of prev is sampled once per level with a border of 1 for its central difference gradients,
+// then the motion is refined with Gauss-Newton steps against the window of next.
+// prev, next: pyramids of the two frames.
+// point p: position in prev.
+// point q: output - position in next.
+// returns: false when the track is lost.
+static bool trackPoint(std::vector<Mat> const &prev, std::vector<Mat> const &next, Point const &p,
+                       KLTParams const &params, Point &q)
+{
+    const int r = params.window / 2;
+    const int side = 2 * r + 1;
+    const int n = side * side;
+
+    float t[KLTMaxWindow * KLTMaxWindow];
+    float gx[KLTMaxWindow * KLTMaxWindow];
+    float gy[KLTMaxWindow * KLTMaxWindow];
+
+    // motion guessed by the coarser levels and refined at this one, in pixels of the level
+    float guess_x = 0.0f;
+    float guess_y = 0.0f;
+    float dx = 0.0f;
+    float dy = 0.0f;
+
+    for (int level = int(prev.size()) - 1; level >= 0; --level)
+    {
+        Mat const &I = prev[size_t(level)];
+        Mat const &J = next[size_t(level)];
+        const float scale = 1.0f / float(1 << level);
+        const float px = p.x * scale;
+        const float py = p.y * scale;
+
+        // a window without enough texture loses the track at level 0, a coarser level just passes its guess on
+        float a, b, c;
+        const float eigen = sampleWindow(I, px, py, r, t, gx, gy, a, b, c);
+        const float det = a * c - b * b;
+        const bool textured = eigen >= params.min_eigen && det != 0.0f;
+        if (!textured && level == 0)
+            return false;
+
+        dx = 0.0f;
+        dy = 0.0f;
+        for (int iteration = 0; iteration != (textured ? params.iterations : 0); ++iteration)
+        {
+            const float x = px + guess_x + dx;
+            const float y = py + guess_y + dy;
+            if (x < -float(r) || y < -float(r) || x > float(J.w - 1 + r) || y > float(J.h - 1 + r))
+                return false;
+
+            // b = sum (I - J) * gradient, the step solves G * step = b
+            float bx = 0.0f, by = 0.0f;
+            for (int j = 0; j != side; ++j)
+                for (int i = 0; i != side; ++i)
+                {
+                    const int k = j * side + i;
+                    const float diff = t[k] - samplePixel(J, x + float(i - r), y + float(j - r));
+                    bx += diff * gx[k];
+                    by += diff * gy[k];
+                }
+
+            const float step_x = (c * bx - b * by) / det;
+            const float step_y = (a * by - b * bx) / det;
+            dx += step_x;
+            dy += step_y;
+            if (step_x * step_x + step_y * step_y < params.epsilon * params.epsilon)
+                break;
+        }
+
+        if (level != 0)
+        {
+            guess_x = 2.0f * (guess_x + dx);
+            guess_y = 2.0f * (guess_y + dy);
+        }
+    }
+
+    q = Point(p.x + guess_x + dx, p.y + guess_y + dy);
+    Mat const &J = next[0];
+    if (!(q.x >= 0.0f && q.y >= 0.0f && q.x <= float(J.w - 1) && q.y <= float(J.h - 1)))
+        return false;
+
+    // the window must still look the same and have texture in next, points that slide into a flat
+    // region can match a low contrast window well enough
+    float u[KLTMaxWindow * KLTMaxWindow];
+    float a, b, c;
+    if (!(sampleWindow(J, q.x, q.y, r, u, gx, gy, a, b, c) >= params.min_eigen))
+        return false;
+
+    // t is still the window of level 0
+    float residual = 0.0f;
+    for (int k = 0; k != n; ++k)
+        residual += std::fabs(t[k] - u[k]);
+
+    return residual / float(n) <= params.max_residual;
 }
 
+KLTTracker::KLTTracker(KLTParams const &params)
+    : m_params(params)
+{
+    assert(params.window > 0 && params.window % 2 == 1 && params.window <= KLTMaxWindow);
+    assert(params.grid > 0 && params.levels > 0);
+}
 
+void KLTTracker::reset()
+{
+    m_tracks.clear();
+    m_prev_pyramid.clear();
+    m_pyramid.clear();
+}
 
+Tracks const &KLTTracker::track(Mat const &im)
+{
+    // the frame of the last call becomes the previous one, its buffers are reused for the next frame
+    std::swap(m_gray, m_prev_gray);
+    std::swap(m_pyramid, m_prev_pyramid);
+
+    if (im.c == 1)
+    {
+        m_gray.reshape(im.w, im.h, 1);
+        m_gray.copy(im, 0, 0);
+    }
+    else
+    {
+        rgb2gray(im, m_gray);
+    }
+    makePyramid(m_gray, m_params.levels, m_pyramid);
 
+    const bool tracking = !m_prev_pyramid.empty() && m_prev_pyramid.size() == m_pyramid.size() &&
+                          m_prev_gray.w == m_gray.w && m_prev_gray.h == m_gray.h;
+    if (!tracking)
+        m_tracks.clear();
+
+    // corners are only detected again where tracks were lost or moved out, every cell on the first frame
+    m_detect.assign(size_t(m_params.grid * m_params.grid), tracking ? 0 : 1);
+
+    m_lost.assign(m_tracks.size(), 0);
+    parallelFor(0, int(m_tracks.size()), [&](int begin, int end) {
+        for (int i = begin; i != end; ++i)
+        {
+            Track &track = m_tracks[size_t(i)];
+            Point q;
+            m_lost[size_t(i)] = trackPoint(m_prev_pyramid, m_pyramid, track.p, m_params, q) ? 0 : 1;
+            track.previous = track.p;
+            track.p = q;
+            track.age++;
+        }
+    }, 16);
+
+    size_t kept = 0;
+    for (size_t i = 0; i != m_tracks.size(); ++i)
+    {
+        Track const &track = m_tracks[i];
+        const int from = cell(track.previous);
+        if (m_lost[i] || cell(track.p) != from)
+            m_detect[size_t(from)] = 1;
+        if (!m_lost[i])
+            m_tracks[kept++] = track;
+    }
+    m_tracks.resize(kept);
+
+    detect();
+    return m_tracks;
+}
+
+int KLTTracker::cell(Point const &p) const
+{
+    const int grid = m_params.grid;
+    const int cx = clampTo(int(p.x) / ((m_gray.w + grid - 1) / grid), 0, grid - 1);
+    const int cy = clampTo(int(p.y) / ((m_gray.h + grid - 1) / grid), 0, grid - 1);
+    return cy * grid + cx;
+}
+
+void KLTTracker::detect()
+{
+    const int grid = m_params.grid;
+    const int w = m_gray.w;
+    const int h = m_gray.h;
+    const int cell_w = (w + grid - 1) / grid;
+    const int cell_h = (h + grid - 1) / grid;
+    const int quota = (m_params.count + grid * grid - 1) / (grid * grid);
+
+    std::vector<std::vector<int>> cells(size_t(grid * grid));
+    for (size_t i = 0; i != m_tracks.size(); ++i)
+        cells[size_t(cell(m_tracks[i].p))].push_back(int(i));
+
+    // the response is computed on the cell and a margin, so the cell itself does not see the clamped borders
+    const int margin = int(std::ceil(3.0f * m_params.sigma)) + m_params.nms + 2;
+    const float min_distance = float(m_params.min_distance);
+
+    struct Candidate
+    {
+        float response;
+        Point p;
+    };
+    std::vector<Candidate> candidates;
+
+    const bool everywhere = std::find(m_detect.begin(), m_detect.end(), 0) == m_detect.end();
+    bool computed = false;
+
+    for (int cy = 0; cy != grid; ++cy)
+        for (int cx = 0; cx != grid; ++cx)
+        {
+            std::vector<int> &bucket = cells[size_t(cy * grid + cx)];
+            if (!m_detect[size_t(cy * grid + cx)] || int(bucket.size()) >= quota ||
+                int(m_tracks.size()) >= m_params.count)
+                continue;
+
+            const int x0 = cx * cell_w;
+            const int y0 = cy * cell_h;
+            const int x1 = minimum(x0 + cell_w, w);
+            const int y1 = minimum(y0 + cell_h, h);
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+
+            // when every cell is searched the response of the whole frame is computed once
+            const int rx0 = everywhere ? 0 : maximum(x0 - margin, 0);
+            const int ry0 = everywhere ? 0 : maximum(y0 - margin, 0);
+            if (!everywhere || !computed)
+            {
+                const int rx1 = everywhere ? w : minimum(x1 + margin, w);
+                const int ry1 = everywhere ? h : minimum(y1 + margin, h);
+                Mat roi = m_gray.roiView(rx0, ry0, rx1 - rx0, ry1 - ry0);
+                cornernessResponse(roi, m_response, m_params.sigma, m_params.shi_tomasi);
+                nonMaxSupression(m_response, m_suppressed, m_params.nms);
+                computed = true;
+            }
+
+            candidates.clear();
+            for (int y = y0; y != y1; ++y)
+            {
+                const float *row = m_suppressed.row(y - ry0) - rx0;
+                for (int x = x0; x != x1; ++x)
+                    if (row[x] > m_params.thresh)
+                        candidates.push_back({row[x], Point(float(x), float(y))});
+            }
+            std::stable_sort(candidates.begin(), candidates.end(),
+                             [](Candidate const &l, Candidate const &r) { return l.response > r.response; });
+
+            for (Candidate const &candidate : candidates)
+            {
+                if (int(bucket.size()) >= quota || int(m_tracks.size()) >= m_params.count)
+                    break;
+
+                // the tracks close enough are in this cell or its neighbours
+                bool close = false;
+                for (int ny = maximum(cy - 1, 0); ny <= minimum(cy + 1, grid - 1) && !close; ++ny)
+                    for (int nx = maximum(cx - 1, 0); nx <= minimum(cx + 1, grid - 1) && !close; ++nx)
+                        for (int i : cells[size_t(ny * grid + nx)])
+                            if (Point::distance(m_tracks[size_t(i)].p, candidate.p) < min_distance)
+                            {
+                                close = true;
+                                break;
+                            }
+                if (close)
+                    continue;
+
+                Track track;
+                track.p = candidate.p;
+                track.previous = candidate.p;
+                track.id = m_next_id++;
+                bucket.push_back(int(m_tracks.size()));
+                m_tracks.push_back(track);
+            }
+        }
+}
 
 } // namespace vs
@@ -26,6 +26,13 @@ void getIntegralImageRegion(Mat const& im, int c,
 // returns: smoothed image
 void boxfilterIntegralImage(Mat const& im, int smooth, Mat& out);
 
+// Apply a box filter to an image using an integral image, only at the pixels of a sample grid
+// image im: integral image
+// int s: window size for box filter
+// int stride: spacing of the grid, pixel (tx, ty) of out is pixel ((stride - 1) / 2 + tx * stride, ...) of im
+// returns: smoothed samples, im.w / stride by im.h / stride. the same values boxfilterIntegralImage has there
+void boxfilterIntegralImage(Mat const& im, int smooth, int stride, Mat& out);
+
 struct LucasKanade
 {
     // Calculate the time-structure matrix of an image pair.
@@ -36,6 +43,12 @@ struct LucasKanade
     //          3rd channel is IxIy, 4th channel is IxIt, 5th channel is IyIt.
     void timeStructureMatrix(Mat const &im, Mat const &prev, int smooth, Mat &S);
 
+    // Same as above, only at the pixels of the sample grid of velocityImage.
+    // The box filter is evaluated from the integral image at the samples, the full resolution S is never built.
+    // int stride: spacing of the samples.
+    // returns: structure matrix of the samples, im.w / stride by im.h / stride.
+    void timeStructureMatrix(Mat const &im, Mat const &prev, int smooth, int stride, Mat &S);
+
     // Calculate the velocity given a structure image
     // image S: time-structure image
     // int stride: only calculate subset of pixels for speed
@@ -51,12 +64,131 @@ struct LucasKanade
     // returns: velocity matrix
     void opticalflow(Mat const &im, Mat const &prev, int smooth, int stride, Mat &vs);
 
+    // Pyramidal Lucas–Kanade optical flow
+    // Calculate the optical flow between two images coarse to fine. The flow of each level is upsampled
+    // to the next one, where im is warped by it and the remaining motion is refined with a small window.
+    // Tracks motions much larger than the window, at full resolution.
+    // image im: current image
+    // image prev: previous image
+    // int levels: pyramid levels, see makePyramid. 1 is a single scale, with warping.
+    // int smooth: window size for smoothing, at every level
+    // int iterations: warp and refine steps per level
+    // int stride: downsampling for velocity matrix
+    // returns: velocity matrix, in pixels. prev(x) matches im(x + v(x))
+    void opticalflowPyramidal(Mat const &im, Mat const &prev, int levels, int smooth, int iterations, int stride, Mat &vs);
+
+    // Streaming versions of the above, the frames of a sequence are pushed one at a time.
+    // The gray image (and the pyramid and its gradients) of a frame is made once, when it is pushed,
+    // and kept for the next call, so each call only processes the new frame.
+    // The one shot calls above share the same buffers and start a new stream.
+    // image im: next frame, it is copied.
+    // returns: false on the first frame or when the size changes, vs is not set then.
+    //          otherwise true, vs is the flow from the previous frame to im.
+    bool pushFrame(Mat const &im, int smooth, int stride, Mat &vs);
+    bool pushFramePyramidal(Mat const &im, int levels, int smooth, int iterations, int stride, Mat &vs);
+
+    // forgets the previous frame
+    void reset();
+
   private:
-    Mat m_curr_gray;
-    Mat m_prev_gray;
+    struct Frame
+    {
+        Mat gray;
+        std::vector<Mat> pyramid;
+        std::vector<Mat> gradients; // Ix and Iy of each pyramid level
+        int levels = 0;             // levels asked for the pyramid and the gradients, 0 until both are made
+        bool shared = false;        // gray is the caller's image, it must not be written to
+    };
+
+    // makes m_curr from the next frame of a stream, m_prev is the last one.
+    // returns: true when there is a previous frame of the same size to take the flow from
+    bool nextFrame(Mat const &im);
+    // gray image of a frame, copied when it is already gray and copy is set
+    static void makeGray(Mat const &im, bool copy, Frame &frame);
+    // pyramid of the gray image, and the gradients of its levels when gradients is set
+    static void makeFramePyramid(int levels, bool gradients, Frame &frame);
+
+    // coarse to fine flow of opticalflowPyramidal, the gradients of prev must be made
+    void pyramidalFlow(Frame &curr, Frame &prev, int smooth, int iterations, int stride, Mat &vs);
+    // refines the flow of one pyramid level, flow is in the pixels of the level
+    // image gradient: Ix and Iy of prev
+    void refineFlow(Mat const &im, Mat const &prev, Mat &gradient, int smooth, int iterations, Mat &flow);
+
+    // m_curr is the newest frame, m_prev the one before when m_streaming
+    Frame m_curr, m_prev;
+    bool m_streaming = false;
 
     Mat m_I, m_Ii, m_S;
     Mat m_V;
+
+    Mat m_flow, m_upsampled, m_smoothed, m_tmp;
+};
+
+// Settings of the sparse KLT tracker.
+struct KLTParams
+{
+    int count = 300;            // tracks wanted, new corners replace the lost tracks
+    int grid = 8;               // cells per side, corners are only detected again in the cells short of tracks
+    float sigma = 2.0f;         // std. dev of the cornerness window
+    float thresh = 0.5f;        // cornerness threshold
+    int nms = 3;                // distance to look for local-maxes in the response map
+    bool shi_tomasi = true;     // shi tomasi or harris response, see cornernessResponse
+    int min_distance = 8;       // new corners closer than this to a track are skipped
+    int window = 11;            // LK window size, the same at every pyramid level. odd, up to KLTMaxWindow
+    int levels = 3;             // pyramid levels, see makePyramid
+    int iterations = 10;        // refinement steps per level
+    float epsilon = 0.01f;      // the refinement of a level stops when a step is smaller, pixels
+    float min_eigen = 1e-4f;    // tracks whose window has a smaller gradient eigenvalue (per pixel) are lost
+    float max_residual = 0.1f;  // tracks whose window differs more (mean absolute intensity) are lost
+};
+
+static const int KLTMaxWindow = 31;
+
+// A point followed from frame to frame.
+struct Track
+{
+    Point p;        // position in the current frame
+    Point previous; // position in the previous frame, p for new tracks
+    int id = -1;    // unique in the tracker
+    int age = 0;    // frames tracked, 0 for new tracks
+};
+using Tracks = std::vector<Track>;
+
+// Sparse pyramidal KLT feature tracker
+// (Bouguet, "Pyramidal implementation of the Lucas Kanade feature tracker").
+// Only windows around the tracks are solved, coarse to fine, and corners are detected only in the
+// cells of the image that lost tracks, so the per frame cost follows the number of tracks.
+// Frames only go through the gray conversion and the pyramid.
+class KLTTracker
+{
+  public:
+    explicit KLTTracker(KLTParams const& params = KLTParams());
+
+    // Tracks the points of the previous frame into im and replaces the lost ones with new corners.
+    // image im: next frame, it is copied.
+    // returns: the tracks in im, the first frame only detects.
+    Tracks const& track(Mat const& im);
+
+    Tracks const& tracks() const { return m_tracks; }
+    KLTParams const& params() const { return m_params; }
+
+    // forgets the previous frame and the tracks
+    void reset();
+
+  private:
+    // detects corners in the cells marked in m_detect that are short of tracks
+    void detect();
+    // grid cell of a point
+    int cell(Point const& p) const;
+
+    KLTParams m_params;
+    Tracks m_tracks;
+    int m_next_id = 0;
+
+    Mat m_gray, m_prev_gray;
+    std::vector<Mat> m_pyramid, m_prev_pyramid;
+    std::vector<uint8_t> m_lost, m_detect;
+    Mat m_response, m_suppressed;
 };
 
 } // namespace vs
@@ -116,11 +116,11 @@ bool sameChannel(Mat const &a, Mat const &b, int const ac, int const bc)
     for (int y = 0; y < a.h; ++y)
         for (int x = 0; x < a.w; ++x)
         {
-            int ai = a.w * a.h * ac + a.w * y + x;
-            int bi = b.w * b.h * bc + b.w * y + x;
-            if (!equivalent(a.data[ai], b.data[bi], epsilon))
+            float av = a.get(x, y, ac);
+            float bv = b.get(x, y, bc);
+            if (!equivalent(av, bv, epsilon))
             {
-                printf("Mismatch (%d %d) %f %f\n", x, y, double(a.data[ai]), double(b.data[bi]));
+                printf("Mismatch (%d %d) %f %f\n", x, y, double(av), double(bv));
                 return false;
             }
         }
@@ -142,10 +142,11 @@ bool sameMat(const Mat &a, const Mat &b)
         for (int y = 0; y < a.h; ++y)
             for (int x = 0; x < a.w; ++x)
             {
-                int index = a.w * a.h * k + a.w * y + x;
-                if (!equivalent(a.data[index], b.data[index], epsilon))
+                float av = a.get(x, y, k);
+                float bv = b.get(x, y, k);
+                if (!equivalent(av, bv, epsilon))
                 {
-                    printf("Mismatch (%d %d %d) %f %f\n", x, y, k, double(a.data[index]), double(b.data[index]));
+                    printf("Mismatch (%d %d %d) %f %f\n", x, y, k, double(av), double(bv));
                     return false;
                 }
             }
@@ -189,7 +190,7 @@ inline std::ostream &print(MatT<T> const &m, std::ostream &out, int max_cols, in
                     if (k > 0)
                         out << ", ";
 
-                    out << std::fixed << m.data[i * m.h * m.w + j * m.w + k];
+                    out << std::fixed << m.get(k, j, i);
                 }
                 out << std::endl;
             }
@@ -309,6 +310,176 @@ void readStream(int const id, vs::Mat& out) {
 #endif // VS_USE_OPENCV
 
 
+//
+// Threading
+//
+static std::mutex g_pool_mutex;
+static int g_concurrency = 0;
+static std::shared_ptr<ThreadPool> g_pool;
+
+static int hardwareConcurrency()
+{
+    int threads = int(std::thread::hardware_concurrency());
+    return (threads > 0) ? threads : 1;
+}
+
+void setConcurrency(int threads)
+{
+    if (threads <= 0)
+        threads = hardwareConcurrency();
+
+    std::lock_guard<std::mutex> guard(g_pool_mutex);
+    if (threads == g_concurrency)
+        return;
+
+    // running jobs keep their own reference to the old pool
+    g_concurrency = threads;
+    g_pool = std::make_shared<ThreadPool>(threads - 1);
+}
+
+int getConcurrency()
+{
+    return ThreadPool::global()->size() + 1;
+}
+
+ThreadPool::ThreadPool(int threads)
+    : m_stop(false)
+{
+    for (int i = 0; i < threads; ++i)
+        m_threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread &thread : m_threads)
+        thread.join();
+}
+
+int ThreadPool::size() const
+{
+    return int(m_threads.size());
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+
+            if (m_tasks.empty())
+                return;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::run(int count, std::function<void(int)> const &task)
+{
+    if (count <= 0)
+        return;
+
+    if (m_threads.empty() || count == 1)
+    {
+        for (int i = 0; i != count; ++i)
+            task(i);
+        return;
+    }
+
+    // helpers may still be queued after the batch is finished,
+    // so the shared state has to outlive this call.
+    // task is only touched while there are unclaimed indexes, and we wait for those.
+    struct Batch
+    {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        int count;
+        std::function<void(int)> const *task;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    batch->next = 0;
+    batch->done = 0;
+    batch->count = count;
+    batch->task = &task;
+
+    auto drain = [](Batch &b) {
+        int finished = 0;
+        for (int i = b.next++; i < b.count; i = b.next++)
+        {
+            (*b.task)(i);
+            finished++;
+        }
+
+        if (finished > 0 && (b.done += finished) == b.count)
+        {
+            std::lock_guard<std::mutex> guard(b.mutex);
+            b.condition.notify_all();
+        }
+    };
+
+    int helpers = minimum(count - 1, size());
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (int i = 0; i != helpers; ++i)
+            m_tasks.push_back([batch, drain] { drain(*batch); });
+    }
+    m_condition.notify_all();
+
+    drain(*batch);
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->condition.wait(lock, [&batch] { return batch->done == batch->count; });
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::global()
+{
+    std::lock_guard<std::mutex> guard(g_pool_mutex);
+    if (!g_pool)
+    {
+        g_concurrency = hardwareConcurrency();
+        g_pool = std::make_shared<ThreadPool>(g_concurrency - 1);
+    }
+    return g_pool;
+}
+
+void parallelFor(int begin, int end, std::function<void(int, int)> const &body, int grain)
+{
+    int const count = end - begin;
+    if (count <= 0)
+        return;
+
+    grain = maximum(grain, 1);
+
+    std::shared_ptr<ThreadPool> pool = ThreadPool::global();
+
+    // a few bands per thread to balance uneven rows
+    int bands = minimum((pool->size() + 1) * 4, (count + grain - 1) / grain);
+    if (bands <= 1)
+    {
+        body(begin, end);
+        return;
+    }
+
+    pool->run(bands, [&](int band) {
+        int band_begin = begin + int((long long)(count) * band / bands);
+        int band_end = begin + int((long long)(count) * (band + 1) / bands);
+        body(band_begin, band_end);
+    });
+}
+
 
 //
 // force template instantiation
@@ -71,6 +71,80 @@ int openStream(std::string const& name);
 void closeStream(int const id);
 void readStream(int const id, vs::Mat& out);
 
+
+// Counter based random numbers.
+// Value i of a stream is a hash of (seed, stream, i), there is no state shared between streams,
+// so work split over threads can give each item its own stream and the numbers drawn don't depend
+// on which thread runs it or in which order.
+class CounterRandom
+{
+  public:
+    CounterRandom(uint64_t seed, uint64_t stream)
+        : m_key(mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ull))), m_counter(0) {}
+
+    uint64_t next() { return mix(m_key + (++m_counter) * 0x9e3779b97f4a7c15ull); }
+
+    // uniform integer in [0, n)
+    int uniform(int n) { return int(((next() >> 32) * uint64_t(n)) >> 32); }
+
+  private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t m_key;
+    uint64_t m_counter;
+};
+
+//
+// Threading
+//
+
+// Sets the number of threads used by the image kernels.
+// threads <= 0 uses the hardware concurrency, 1 runs everything on the calling thread.
+void setConcurrency(int threads);
+int getConcurrency();
+
+// A fixed size pool of worker threads.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    // number of worker threads, the calling thread is not included
+    int size() const;
+
+    // Calls task(i) for every i in [0, count) and waits for all of them to finish.
+    // The calling thread also executes tasks, so nested calls can't deadlock.
+    void run(int count, std::function<void(int)> const &task);
+
+    // pool shared by every kernel, it has getConcurrency() - 1 workers
+    static std::shared_ptr<ThreadPool> global();
+
+private:
+    void work();
+
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stop;
+};
+
+// Splits the range [begin, end) into contiguous bands and calls body(band_begin, band_end)
+// for each band using the global thread pool.
+// Bands must write to disjoint outputs, that way results don't depend on the thread count.
+// grain: minimum number of items in a band.
+void parallelFor(int begin, int end, std::function<void(int, int)> const &body, int grain = 1);
+
 #define TWOPI 6.2831853
 
 #define UTEST(EX) { if(!(EX)) { fprintf(stderr, "failed: [%s] testing [%s] in %s, line %d\n", __FUNCTION__, #EX, __FILE__, __LINE__); } }
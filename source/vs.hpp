@@ -4,8 +4,13 @@
 #include <cmath>
 #include <cassert>
 #include <cstring>
+#include <cstdint>
 
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
@@ -15,13 +20,25 @@
 #include <array>
 #include <map>
 #include <deque>
+#include <random>
 #include <memory>
 
+// simd instruction sets available to the kernels, every simd path has a scalar fallback
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define VS_AVX2
+#include <immintrin.h>
+#endif
+
 #include "matrix.hpp"
 #include "image.hpp"
 #include "filter.hpp"
 #include "util.hpp"
 #include "features.hpp"
-#include "drawing.hpp"
 #include "opticalflow.hpp"
+#include "drawing.hpp"
 #include "optimization.hpp"